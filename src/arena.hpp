@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+namespace util {
+
+// Per-thread bump allocator for scratch memory of one intercepted call. The
+// outermost Scope on a thread hands everything back when it ends, the first
+// 16 KiB never touch the heap.
+class Arena {
+public:
+  class Scope {
+  public:
+    Scope() { ++local().depth; }
+    ~Scope() {
+      auto &arena = local();
+      if (--arena.depth == 0)
+        arena.memory.release();
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+  // Only valid inside a Scope, nothing allocated here outlives it.
+  static auto resource() -> std::pmr::memory_resource * {
+    return &local().memory;
+  }
+
+private:
+  Arena() = default;
+
+  static auto local() -> Arena & {
+    thread_local Arena arena;
+    return arena;
+  }
+
+  alignas(std::max_align_t) std::array<std::byte, 16 * 1024> initial;
+  std::pmr::monotonic_buffer_resource memory{initial.data(), initial.size()};
+  unsigned depth = 0;
+};
+
+} // namespace util
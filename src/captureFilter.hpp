@@ -0,0 +1,197 @@
+#pragma once
+#include "stages.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <format>
+#include <ranges>
+
+namespace impl {
+
+// Decides which shaders get dumped. The size and stage checks run before a
+// shader is hashed or copied, the hash ones right after hashing, the rate
+// limit when the dump is about to be written.
+class CaptureFilter {
+public:
+  CaptureFilter() {
+    if (auto stages = util::getEnv("VK_SHADER_GUTS_DUMP_STAGES"))
+      parseStages(*stages);
+    if (auto size = util::getEnv("VK_SHADER_GUTS_DUMP_SIZE"))
+      parseSize(*size);
+    if (auto hashes = util::getEnv("VK_SHADER_GUTS_DUMP_HASHES"))
+      allow = split(*hashes);
+    if (auto hashes = util::getEnv("VK_SHADER_GUTS_DUMP_SKIP_HASHES"))
+      deny = split(*hashes);
+    if (auto sample = util::getEnv("VK_SHADER_GUTS_DUMP_SAMPLE"))
+      parseNumber("VK_SHADER_GUTS_DUMP_SAMPLE", *sample, sampleRate);
+    if (auto rate = util::getEnv("VK_SHADER_GUTS_DUMP_RATE"))
+      parseRate(*rate);
+    tokens = double(bytesPerSecond);
+  }
+
+  auto checkSize(size_t codeSize) -> bool {
+    return count(codeSize >= minSize && codeSize <= maxSize, rejected.size);
+  }
+
+  auto checkStage(uint32_t stageBit) -> bool {
+    return count(stageMask & stageBit, rejected.stage);
+  }
+
+  // Allow/deny prefixes, then 1 in N by the hash itself, so the same shaders
+  // are picked on every run.
+  auto checkHash(std::string_view hash) -> bool {
+    auto prefixOf = [&](const std::string &prefix) {
+      return hash.starts_with(prefix);
+    };
+    if (!count((allow.empty() || std::ranges::any_of(allow, prefixOf)) &&
+                   std::ranges::none_of(deny, prefixOf),
+               rejected.hash))
+      return false;
+
+    if (sampleRate <= 1)
+      return true;
+
+    uint64_t value = 0;
+    auto digits = hash.substr(0, 16);
+    std::from_chars(digits.data(), digits.data() + digits.size(), value, 16);
+    return count(value % sampleRate == 0, rejected.sampled);
+  }
+
+  // Token bucket refilled at VK_SHADER_GUTS_DUMP_RATE bytes per second, one
+  // second worth of burst. A dump may overdraw it, so shaders larger than the
+  // bucket still get through once it's full. Called under the dump lock.
+  auto takeBytes(size_t bytes) -> bool {
+    if (!bytesPerSecond)
+      return true;
+
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration<double>(now - refilled).count();
+    refilled = now;
+    tokens = std::min(double(bytesPerSecond),
+                      tokens + elapsed * double(bytesPerSecond));
+
+    if (!count(tokens > 0, rejected.rate))
+      return false;
+    tokens -= double(bytes);
+    return true;
+  }
+
+  auto status() const -> std::string {
+    return std::format("filtered_stage: {}\nfiltered_size: {}\n"
+                       "filtered_hash: {}\nfiltered_sampled: {}\n"
+                       "filtered_rate: {}\n",
+                       rejected.stage.load(), rejected.size.load(),
+                       rejected.hash.load(), rejected.sampled.load(),
+                       rejected.rate.load());
+  }
+
+  auto printLogs() const -> void {
+    if (stageMask != ~0u)
+      std::clog << "[VK_SHADER_GUTS][log]: Dump stage mask: 0x" << std::hex
+                << stageMask << std::dec << "\n";
+    if (minSize || maxSize != SIZE_MAX)
+      std::clog << "[VK_SHADER_GUTS][log]: Dump size: " << minSize << "-"
+                << (maxSize == SIZE_MAX ? "" : std::to_string(maxSize))
+                << " bytes\n";
+    if (!allow.empty() || !deny.empty())
+      std::clog << "[VK_SHADER_GUTS][log]: Dump hashes: " << allow.size()
+                << " allowed, " << deny.size() << " skipped prefixes\n";
+    if (sampleRate > 1)
+      std::clog << "[VK_SHADER_GUTS][log]: Dump sample: 1 in " << sampleRate
+                << "\n";
+    if (bytesPerSecond)
+      std::clog << "[VK_SHADER_GUTS][log]: Dump rate: " << bytesPerSecond
+                << " bytes/s\n";
+  }
+
+private:
+  static auto count(bool pass, std::atomic<uint64_t> &rejections) -> bool {
+    if (!pass)
+      rejections.fetch_add(1, std::memory_order_relaxed);
+    return pass;
+  }
+
+  static auto split(std::string_view list) -> std::vector<std::string> {
+    auto items = std::vector<std::string>();
+    for (auto item : std::views::split(list, ','))
+      if (!item.empty())
+        items.emplace_back(item.begin(), item.end());
+    return items;
+  }
+
+  static auto parseNumber(std::string_view var, std::string_view text,
+                          uint64_t &value) -> bool {
+    auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec == std::errc() && end == text.data() + text.size())
+      return true;
+
+    std::clog << "[VK_SHADER_GUTS][err]: " << var << " isn't a number: "
+              << text << "\n";
+    value = 0;
+    return false;
+  }
+
+  // Stage folder or extension names, "FS,CS" or "frag,comp".
+  auto parseStages(std::string_view list) -> void {
+    stageMask = 0;
+    for (auto &name : split(list)) {
+      auto it = std::ranges::find_if(util::stageInfos, [&](auto &info) {
+        return info.folder == name || info.ext == name;
+      });
+      if (it == util::stageInfos.end() || it->folder == "Unknown") {
+        std::clog << "[VK_SHADER_GUTS][err]: Unknown stage in "
+                     "VK_SHADER_GUTS_DUMP_STAGES: "
+                  << name << "\n";
+        continue;
+      }
+      stageMask |= 1u << (it - util::stageInfos.begin());
+    }
+  }
+
+  // "min-max" in bytes, either side may be left out.
+  auto parseSize(std::string_view range) -> void {
+    auto dash = range.find('-');
+    auto low = range.substr(0, dash);
+    auto high = dash == std::string_view::npos ? std::string_view()
+                                               : range.substr(dash + 1);
+    uint64_t value = 0;
+    if (!low.empty() && parseNumber("VK_SHADER_GUTS_DUMP_SIZE", low, value))
+      minSize = value;
+    if (!high.empty() && parseNumber("VK_SHADER_GUTS_DUMP_SIZE", high, value))
+      maxSize = value;
+  }
+
+  auto parseRate(std::string_view text) -> void {
+    auto bytes = util::parseBytes(text);
+    if (!bytes)
+      std::clog << "[VK_SHADER_GUTS][err]: VK_SHADER_GUTS_DUMP_RATE isn't a "
+                   "byte count: "
+                << text << "\n";
+    bytesPerSecond = bytes.value_or(0);
+  }
+
+  uint32_t stageMask = ~0u;
+  size_t minSize = 0;
+  size_t maxSize = SIZE_MAX;
+  std::vector<std::string> allow;
+  std::vector<std::string> deny;
+  uint64_t sampleRate = 1;
+  uint64_t bytesPerSecond = 0;
+
+  double tokens = 0;
+  std::chrono::steady_clock::time_point refilled =
+      std::chrono::steady_clock::now();
+
+  struct Rejected {
+    std::atomic<uint64_t> stage = 0;
+    std::atomic<uint64_t> size = 0;
+    std::atomic<uint64_t> hash = 0;
+    std::atomic<uint64_t> sampled = 0;
+    std::atomic<uint64_t> rate = 0;
+  } rejected;
+};
+
+}; // namespace impl
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <vulkan/vulkan.h>
+
+namespace util {
+
+// Size of the structs that may come ahead of one the layer changes, in the
+// chains of pipeline and shader stage create infos. 0 for any other.
+inline auto chainStructSize(VkStructureType sType) -> size_t {
+  switch (sType) {
+  case VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO:
+    return sizeof(VkShaderModuleCreateInfo);
+  case VK_STRUCTURE_TYPE_SHADER_MODULE_VALIDATION_CACHE_CREATE_INFO_EXT:
+    return sizeof(VkShaderModuleValidationCacheCreateInfoEXT);
+  case VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_REQUIRED_SUBGROUP_SIZE_CREATE_INFO:
+    return sizeof(VkPipelineShaderStageRequiredSubgroupSizeCreateInfo);
+  case VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_MODULE_IDENTIFIER_CREATE_INFO_EXT:
+    return sizeof(VkPipelineShaderStageModuleIdentifierCreateInfoEXT);
+  case VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT:
+    return sizeof(VkDebugUtilsObjectNameInfoEXT);
+  case VK_STRUCTURE_TYPE_PIPELINE_ROBUSTNESS_CREATE_INFO_EXT:
+    return sizeof(VkPipelineRobustnessCreateInfoEXT);
+  case VK_STRUCTURE_TYPE_PIPELINE_CREATE_FLAGS_2_CREATE_INFO_KHR:
+    return sizeof(VkPipelineCreateFlags2CreateInfoKHR);
+  case VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO:
+    return sizeof(VkPipelineCreationFeedbackCreateInfo);
+  case VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO:
+    return sizeof(VkPipelineRenderingCreateInfo);
+  case VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR:
+    return sizeof(VkPipelineLibraryCreateInfoKHR);
+  case VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT:
+    return sizeof(VkGraphicsPipelineLibraryCreateInfoEXT);
+  case VK_STRUCTURE_TYPE_PIPELINE_BINARY_INFO_KHR:
+    return sizeof(VkPipelineBinaryInfoKHR);
+  default:
+    return 0;
+  }
+}
+
+// Points `pNext`, the field of a struct the caller already copied, at copies
+// of everything up to the first `sType` in its chain, and returns the copy
+// of that one to be changed. The rest of the chain is shared. nullptr, with
+// `pNext` left as it is, if there's no `sType` or a struct of unknown size
+// comes before it. The copies come from `memory` and are never freed on
+// their own.
+template <typename T>
+auto copyInChain(const void *&pNext, VkStructureType sType,
+                 std::pmr::memory_resource *memory) -> T * {
+  auto target = static_cast<const VkBaseInStructure *>(pNext);
+  for (; target && target->sType != sType; target = target->pNext)
+    if (!chainStructSize(target->sType))
+      return nullptr;
+  if (!target)
+    return nullptr;
+
+  std::pmr::polymorphic_allocator<> alloc(memory);
+  VkBaseOutStructure *last = nullptr;
+  for (auto next = static_cast<const VkBaseInStructure *>(pNext);;
+       next = next->pNext) {
+    auto size = next == target ? sizeof(T) : chainStructSize(next->sType);
+    auto copy = static_cast<VkBaseOutStructure *>(
+        alloc.allocate_bytes(size, alignof(std::max_align_t)));
+    std::memcpy(copy, next, size);
+
+    if (last)
+      last->pNext = copy;
+    else
+      pNext = copy;
+    if (next == target)
+      return reinterpret_cast<T *>(copy);
+    last = copy;
+  }
+}
+
+} // namespace util
@@ -0,0 +1,310 @@
+#pragma once
+#include "util.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <format>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+namespace impl {
+
+class CodePool;
+
+// One SPIR-V buffer accounted to a CodePool. The pool may drop the bytes
+// whenever it's over budget, get() brings them back: from `reload` if there
+// is one, otherwise from the file they were spilled to before being dropped.
+class PooledCode {
+public:
+  using Code = std::shared_ptr<const std::vector<std::byte>>;
+  using Reload = std::function<Code()>;
+
+  PooledCode(CodePool &pool, Code code, Reload reload = nullptr);
+  ~PooledCode();
+
+  PooledCode(const PooledCode &) = delete;
+  PooledCode &operator=(const PooledCode &) = delete;
+
+  // nullptr if the bytes were dropped and can't be brought back.
+  auto get() -> Code;
+
+  // Never reloads, nullptr unless the bytes are resident.
+  auto tryGet() -> Code;
+
+private:
+  friend class CodePool;
+
+  enum class Eviction { busy, dropped, spill };
+
+  // Only ever called by the pool, with its lock held. Drops the bytes if
+  // they can be brought back, otherwise hands them out in `toSpill` and
+  // keeps them until they're written.
+  auto evict(Code &toSpill) -> Eviction;
+
+  CodePool &pool;
+  Reload reload;
+
+  std::mutex lock;
+  Code code;
+  size_t bytes = 0;
+  std::filesystem::path spill;
+
+  // Guarded by the pool's lock. Listed means resident and accounted,
+  // spilling that the bytes are being written out and aren't accounted.
+  bool listed = false;
+  bool spilling = false;
+  std::list<PooledCode *>::iterator position;
+};
+
+// Accounts every buffer of SPIR-V the layer keeps, retained dumps and
+// replacements alike, and evicts the least recently used ones to stay within
+// VK_SHADER_GUTS_MEMORY_BUDGET. Without a budget nothing is evicted, usage is
+// still tracked.
+class CodePool {
+public:
+  CodePool() {
+    if (auto budget = util::getEnv("VK_SHADER_GUTS_MEMORY_BUDGET")) {
+      auto bytes = util::parseBytes(*budget);
+      if (!bytes)
+        std::clog << "[VK_SHADER_GUTS][err]: VK_SHADER_GUTS_MEMORY_BUDGET "
+                     "isn't a byte count: "
+                  << *budget << "\n";
+      this->budget = bytes.value_or(0);
+    }
+  }
+
+  CodePool(const CodePool &) = delete;
+  CodePool &operator=(const CodePool &) = delete;
+
+  ~CodePool() {
+    if (!spillDir.empty()) {
+      std::error_code ec;
+      std::filesystem::remove_all(spillDir, ec);
+    }
+  }
+
+  auto printLogs() const -> void {
+    if (budget)
+      std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_MEMORY_BUDGET = "
+                << budget << " bytes\n";
+  }
+
+  auto status() const -> std::string {
+    return std::format("memory_used: {}\nmemory_high_water: {}\n"
+                       "memory_budget: {}\nevictions: {}\nspilled_bytes: {}\n",
+                       used.load(), highWater.load(), budget,
+                       evictions.load(), spilled.load());
+  }
+
+private:
+  friend class PooledCode;
+
+  // Bytes on their way to a spill file, written without the pool's lock.
+  struct Spill {
+    PooledCode *code;
+    PooledCode::Code bytes;
+    std::filesystem::path path;
+  };
+
+  // A buffer became resident, it's the most recently used one now.
+  auto add(PooledCode *code, size_t bytes) -> void {
+    auto spills = std::vector<Spill>();
+    {
+      std::lock_guard<std::mutex> l(lock);
+
+      code->position = lru.insert(lru.begin(), code);
+      code->listed = true;
+
+      auto now = used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+      auto high = highWater.load(std::memory_order_relaxed);
+      while (now > high && !highWater.compare_exchange_weak(high, now))
+        ;
+
+      evictLocked(code, spills);
+    }
+    writeSpills(spills);
+  }
+
+  auto touch(PooledCode *code) -> void {
+    std::lock_guard<std::mutex> l(lock);
+    if (code->listed)
+      lru.splice(lru.begin(), lru, code->position);
+  }
+
+  auto remove(PooledCode *code) -> void {
+    std::unique_lock<std::mutex> l(lock);
+    spillsDone.wait(l, [&] { return !code->spilling; });
+    if (!code->listed)
+      return;
+
+    lru.erase(code->position);
+    code->listed = false;
+    used.fetch_sub(code->bytes, std::memory_order_relaxed);
+  }
+
+  // Oldest first, never the buffer that was just added. Buffers that are busy
+  // reloading stay. Those that have to be spilled first leave the budget
+  // right away and go to `spills`, nothing is written under the lock.
+  auto evictLocked(PooledCode *keep, std::vector<Spill> &spills) -> void {
+    for (auto it = lru.end();
+         budget && used.load(std::memory_order_relaxed) > budget &&
+         it != lru.begin();) {
+      auto victim = *--it;
+      auto bytes = PooledCode::Code();
+      if (victim == keep)
+        continue;
+
+      auto eviction = victim->evict(bytes);
+      if (eviction == PooledCode::Eviction::busy)
+        continue;
+
+      used.fetch_sub(victim->bytes, std::memory_order_relaxed);
+      victim->listed = false;
+      it = lru.erase(it);
+
+      if (eviction == PooledCode::Eviction::dropped) {
+        evictions.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        victim->spilling = true;
+        spills.push_back({victim, std::move(bytes), spillPath()});
+      }
+    }
+  }
+
+  // Bytes that were written are dropped, get() reads them back from the
+  // file. Those that couldn't be written go back to the pool, as oldest.
+  // The buffer's lock comes first, as in get().
+  auto writeSpills(std::vector<Spill> &spills) -> void {
+    if (spills.empty())
+      return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(spills.front().path.parent_path(), ec);
+    for (auto &spill : spills) {
+      util::SaveBinaryFile(*spill.bytes, spill.path.string());
+      bool written =
+          std::filesystem::file_size(spill.path, ec) == spill.bytes->size() &&
+          !ec;
+
+      auto *code = spill.code;
+      std::lock_guard<std::mutex> cl(code->lock);
+      if (written) {
+        code->spill = spill.path;
+        code->code.reset();
+        spilled.fetch_add(spill.bytes->size(), std::memory_order_relaxed);
+      } else {
+        std::filesystem::remove(spill.path, ec);
+      }
+
+      std::lock_guard<std::mutex> l(lock);
+      code->spilling = false;
+      if (written) {
+        evictions.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        code->position = lru.insert(lru.end(), code);
+        code->listed = true;
+        used.fetch_add(code->bytes, std::memory_order_relaxed);
+      }
+    }
+
+    std::lock_guard<std::mutex> l(lock);
+    spillsDone.notify_all();
+  }
+
+  auto spillPath() -> std::filesystem::path {
+    // Created by writeSpills(), nothing touches the disk under the lock.
+    if (spillDir.empty())
+      spillDir = std::filesystem::temp_directory_path() /
+                 ("shader-guts-" + std::to_string(getpid()));
+    return spillDir / (std::to_string(nextSpill++) + ".spv");
+  }
+
+  uint64_t budget = 0;
+  std::atomic<uint64_t> used = 0;
+  std::atomic<uint64_t> highWater = 0;
+  std::atomic<uint64_t> evictions = 0;
+  std::atomic<uint64_t> spilled = 0;
+
+  std::mutex lock;
+  // Signalled once spills are done, a buffer isn't destroyed while its
+  // bytes are being written.
+  std::condition_variable spillsDone;
+  std::list<PooledCode *> lru;
+  std::filesystem::path spillDir;
+  uint64_t nextSpill = 0;
+};
+
+inline PooledCode::PooledCode(CodePool &pool, Code code, Reload reload)
+    : pool(pool), reload(std::move(reload)), code(code),
+      bytes(code ? code->size() : 0) {
+  if (code)
+    pool.add(this, bytes);
+}
+
+inline PooledCode::~PooledCode() {
+  pool.remove(this);
+  if (!spill.empty()) {
+    std::error_code ec;
+    std::filesystem::remove(spill, ec);
+  }
+}
+
+inline auto PooledCode::get() -> Code {
+  auto result = Code();
+  bool loaded = false;
+  {
+    std::lock_guard<std::mutex> l(lock);
+    result = code;
+    if (!result) {
+      if (reload)
+        result = reload();
+      else if (!spill.empty())
+        result = std::make_shared<const std::vector<std::byte>>(
+            util::LoadBinaryFile(spill));
+
+      loaded = result != nullptr;
+      if (loaded) {
+        code = result;
+        bytes = result->size();
+      }
+    }
+  }
+
+  // Not under our own lock, the pool takes its lock first.
+  if (loaded)
+    pool.add(this, bytes);
+  else if (result)
+    pool.touch(this);
+  return result;
+}
+
+inline auto PooledCode::tryGet() -> Code {
+  auto result = Code();
+  {
+    std::lock_guard<std::mutex> l(lock);
+    result = code;
+  }
+  if (result)
+    pool.touch(this);
+  return result;
+}
+
+inline auto PooledCode::evict(Code &toSpill) -> Eviction {
+  std::unique_lock<std::mutex> l(lock, std::try_to_lock);
+  if (!l.owns_lock() || !code)
+    return Eviction::busy;
+
+  // Dump-pending bytes are written out once, they never change.
+  if (!reload && spill.empty()) {
+    toSpill = code;
+    return Eviction::spill;
+  }
+
+  code.reset();
+  return Eviction::dropped;
+}
+
+}; // namespace impl
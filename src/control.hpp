@@ -0,0 +1,131 @@
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace impl {
+
+// Unix socket serving one-line text commands from a thread of its own. Every
+// connection sends one command and gets one reply, see `shader-guts control`.
+// `tick` runs on the same thread about every 100 ms, for timed state changes.
+class ControlServer {
+public:
+  using Handler = std::function<std::string(std::string_view)>;
+
+  ControlServer(std::filesystem::path path, Handler handler,
+                std::function<void()> tick)
+      : path(std::move(path)), handler(std::move(handler)),
+        tick(std::move(tick)) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (this->path.native().size() >= sizeof(addr.sun_path)) {
+      std::clog << "[VK_SHADER_GUTS][err]: Control socket path too long: "
+                << this->path << "\n";
+      return;
+    }
+    this->path.native().copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+    // Left behind by an earlier run that didn't get to clean up.
+    unlink(this->path.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (listenFd < 0 || wakeFd < 0 ||
+        bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+        listen(listenFd, 4)) {
+      std::clog << "[VK_SHADER_GUTS][err]: Can't listen on " << this->path
+                << "\n";
+      return;
+    }
+
+    worker = std::thread([this] { serve(); });
+    std::clog << "[VK_SHADER_GUTS][log]: Control socket: " << this->path
+              << "\n";
+  }
+
+  ControlServer(const ControlServer &) = delete;
+  ControlServer &operator=(const ControlServer &) = delete;
+
+  ~ControlServer() {
+    if (worker.joinable()) {
+      uint64_t one = 1;
+      if (write(wakeFd, &one, sizeof(one)) == sizeof(one))
+        worker.join();
+      else
+        worker.detach();
+      unlink(path.c_str());
+    }
+    if (listenFd >= 0)
+      close(listenFd);
+    if (wakeFd >= 0)
+      close(wakeFd);
+  }
+
+private:
+  auto serve() -> void {
+    for (;;) {
+      pollfd fds[2] = {{listenFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+      if (poll(fds, 2, 100) < 0)
+        continue;
+
+      if (fds[1].revents)
+        return;
+
+      tick();
+      if (!(fds[0].revents & POLLIN))
+        continue;
+
+      int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0)
+        continue;
+
+      // A stuck client must not keep the thread from shutting down.
+      timeval timeout{1, 0};
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+      auto reply = handler(readLine(client));
+      for (size_t sent = 0; sent < reply.size();) {
+        auto n = send(client, reply.data() + sent, reply.size() - sent,
+                      MSG_NOSIGNAL);
+        if (n <= 0)
+          break;
+        sent += n;
+      }
+      close(client);
+    }
+  }
+
+  static auto readLine(int client) -> std::string {
+    auto line = std::string();
+    char buffer[256];
+
+    while (line.size() < 4096 && line.find('\n') == std::string::npos) {
+      auto n = recv(client, buffer, sizeof(buffer), 0);
+      if (n <= 0)
+        break;
+      line.append(buffer, n);
+    }
+
+    line.resize(std::min(line.find('\n'), line.size()));
+    return line;
+  }
+
+  std::filesystem::path path;
+  Handler handler;
+  std::function<void()> tick;
+
+  int listenFd = -1;
+  int wakeFd = -1;
+  std::thread worker;
+};
+
+}; // namespace impl
@@ -0,0 +1,432 @@
+#include "shaderGutsCore.h"
+#include "glslangShaders.hpp"
+#include "spirvOptimizer.hpp"
+#include "stages.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <mutex>
+#include <unistd.h>
+
+// Built as libshader-guts-core, static and shared. The layer only ever
+// dlopen()s the shared one, see glslLoader.hpp.
+
+struct ShaderGutsArchive_T {
+  std::filesystem::path dir;
+
+  // Sorted by stage and name.
+  std::mutex lock;
+  std::vector<ShaderGutsArchiveEntry> entries;
+};
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// Nobody pays for the threads unless a batch is actually run.
+auto workers() -> util::ThreadPool & {
+  static util::ThreadPool pool;
+  return pool;
+}
+
+// Runs `work(i)` for every index on the workers, `chunk` indices per task so
+// batches of tiny shaders don't drown in scheduling. Calls made from a worker,
+// from a callback of an outer batch, run on the calling thread.
+template <typename Work>
+auto parallelFor(uint32_t count, uint32_t chunk, Work &&work) -> void {
+  if (count <= chunk || workers().isWorker()) {
+    for (uint32_t i = 0; i < count; ++i)
+      work(i);
+    return;
+  }
+
+  auto pending = std::vector<std::future<void>>();
+  pending.reserve((count + chunk - 1) / chunk);
+  for (uint32_t first = 0; first < count; first += chunk)
+    pending.push_back(workers().submit([&work, first, count, chunk] {
+      for (uint32_t i = first; i < std::min(first + chunk, count); ++i)
+        work(i);
+    }));
+
+  for (auto &task : pending)
+    task.get();
+}
+
+auto valid(const ShaderGutsCode *pCode) -> bool {
+  return pCode && pCode->code && pCode->codeSize;
+}
+
+auto valid(const ShaderGutsOutput *pOutput) -> bool {
+  return pOutput && pOutput->pfnAllocate;
+}
+
+auto code(const ShaderGutsCode &code) -> std::span<const std::byte> {
+  return {static_cast<const std::byte *>(code.code), code.codeSize};
+}
+
+// The code as SPIR-V words. Callers needn't align it, code that isn't is
+// copied to `aligned` first.
+auto words(const ShaderGutsCode &code, std::vector<uint32_t> &aligned)
+    -> std::span<const uint32_t> {
+  auto count = code.codeSize / sizeof(uint32_t);
+  if (reinterpret_cast<uintptr_t>(code.code) % alignof(uint32_t) == 0)
+    return {static_cast<const uint32_t *>(code.code), count};
+
+  aligned.resize(count);
+  std::memcpy(aligned.data(), code.code, count * sizeof(uint32_t));
+  return aligned;
+}
+
+// Allocates `size` bytes of output and has `fill` write them.
+template <typename Fill>
+auto write(ShaderGutsOutput *pOutput, size_t size, Fill &&fill)
+    -> ShaderGutsResult {
+  pOutput->data = nullptr;
+  pOutput->size = 0;
+  if (!size)
+    return SHADER_GUTS_ERROR_FAILED;
+
+  auto out = pOutput->pfnAllocate(pOutput->pUserData, size);
+  if (!out)
+    return SHADER_GUTS_ERROR_OUT_OF_MEMORY;
+
+  fill(static_cast<std::byte *>(out));
+  pOutput->data = out;
+  pOutput->size = size;
+  return SHADER_GUTS_SUCCESS;
+}
+
+auto write(ShaderGutsOutput *pOutput, std::span<const std::byte> data)
+    -> ShaderGutsResult {
+  return write(pOutput, data.size(), [&](std::byte *out) {
+    std::ranges::copy(data, out);
+  });
+}
+
+// '\0'-terminated paths, one after the other.
+auto write(ShaderGutsOutput *pOutput,
+           const std::vector<std::filesystem::path> &paths)
+    -> ShaderGutsResult {
+  size_t size = 0;
+  for (const auto &path : paths)
+    size += path.native().size() + 1;
+  if (!size) {
+    pOutput->data = nullptr;
+    pOutput->size = 0;
+    return SHADER_GUTS_SUCCESS;
+  }
+
+  return write(pOutput, size, [&](std::byte *out) {
+    for (const auto &path : paths) {
+      auto bytes = std::as_bytes(std::span(path.c_str(),
+                                           path.native().size() + 1));
+      out = std::ranges::copy(bytes, out).out;
+    }
+  });
+}
+
+auto compile(const ShaderGutsSource &source, ShaderGutsOutput *pSpirv,
+             ShaderGutsOutput *pIncludes) -> ShaderGutsResult {
+  if (pIncludes) {
+    pIncludes->data = nullptr;
+    pIncludes->size = 0;
+  }
+  if (!source.source || !source.fileName || !valid(pSpirv) ||
+      (pIncludes && !valid(pIncludes)))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  auto params = util::shaders::makeCompileParams(
+      std::string(source.source, source.sourceSize), source.fileName);
+  if (!params) {
+    std::clog << params.error();
+    return SHADER_GUTS_ERROR_FAILED;
+  }
+
+  // Copied from glslang's output into the caller's allocation, nothing
+  // in between.
+  auto includes = std::vector<std::filesystem::path>();
+  auto ret = util::shaders::compileGLSLTo(
+      params.value(),
+      [&](std::span<const std::byte> spirv) { return write(pSpirv, spirv); },
+      pIncludes ? &includes : nullptr);
+  if (pIncludes)
+    write(pIncludes, includes);
+  return ret;
+}
+
+auto decompile(const ShaderGutsCode *pCode, ShaderGutsOutput *pGlsl)
+    -> ShaderGutsResult {
+  if (!valid(pCode) || !valid(pGlsl) || pCode->codeSize % sizeof(uint32_t))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  auto aligned = std::vector<uint32_t>();
+  auto glsl = std::string();
+  try {
+    glsl = util::DecompileGLSL(std::as_bytes(words(*pCode, aligned)));
+  } catch (const std::exception &e) {
+    std::clog << "[VK_SHADER_GUTS][err]: SPIRV-Cross failed: " << e.what()
+              << "\n";
+    return SHADER_GUTS_ERROR_FAILED;
+  }
+  return write(pGlsl, std::as_bytes(std::span(glsl)));
+}
+
+// The first failure of a batch, or success.
+auto firstFailure(uint32_t count, const ShaderGutsResult *pResults)
+    -> ShaderGutsResult {
+  auto failed = std::find_if(pResults, pResults + count, [](auto result) {
+    return result != SHADER_GUTS_SUCCESS;
+  });
+  return failed == pResults + count ? SHADER_GUTS_SUCCESS : *failed;
+}
+
+auto stageOf(std::string_view folder) -> uint32_t {
+  for (size_t bit = 0; bit < util::stageInfos.size(); ++bit)
+    if (util::stageInfos[bit].folder == folder)
+      return 1u << bit;
+  return 0;
+}
+
+auto entryPath(const ShaderGutsArchive_T &archive,
+               const ShaderGutsArchiveEntry &entry) -> fs::path {
+  return archive.dir / util::stageInfo(entry.stage).folder /
+         (std::string(entry.name) + ".spv");
+}
+
+auto byStageAndName(const ShaderGutsArchiveEntry &a,
+                    const ShaderGutsArchiveEntry &b) -> bool {
+  auto order = a.stage <=> b.stage;
+  return order != 0 ? order < 0 : std::strcmp(a.name, b.name) < 0;
+}
+
+auto makeEntry(uint32_t stage, std::string_view name, uint64_t size)
+    -> std::optional<ShaderGutsArchiveEntry> {
+  ShaderGutsArchiveEntry entry{stage, {}, size};
+  if (name.size() >= sizeof(entry.name))
+    return std::nullopt;
+  name.copy(entry.name, name.size());
+  return entry;
+}
+
+} // namespace
+
+extern "C" {
+
+uint32_t ShaderGutsCore_GetVersion(void) { return SHADER_GUTS_CORE_VERSION; }
+
+ShaderGutsResult ShaderGutsCore_HashBatch(uint32_t count,
+                                          const ShaderGutsCode *pCodes,
+                                          ShaderGutsHash *pHashes) {
+  if (count && (!pCodes || !pHashes))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  std::atomic<bool> invalid = false;
+  parallelFor(count, 16, [&](uint32_t i) {
+    pHashes[i] = {};
+    if (!valid(&pCodes[i])) {
+      invalid.store(true, std::memory_order_relaxed);
+      return;
+    }
+    util::Sha1Hash::compute(pCodes[i].code, pCodes[i].codeSize)
+        .toChars(pHashes[i].hex);
+  });
+  return invalid ? SHADER_GUTS_ERROR_INVALID_ARGUMENT : SHADER_GUTS_SUCCESS;
+}
+
+ShaderGutsResult ShaderGutsCore_Compile(const ShaderGutsSource *pSource,
+                                        ShaderGutsOutput *pSpirv,
+                                        ShaderGutsOutput *pIncludes) {
+  if (!pSource)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+  return compile(*pSource, pSpirv, pIncludes);
+}
+
+ShaderGutsResult ShaderGutsCore_CompileBatch(uint32_t count,
+                                             const ShaderGutsSource *pSources,
+                                             ShaderGutsOutput *pSpirvs,
+                                             ShaderGutsOutput *pIncludes,
+                                             ShaderGutsResult *pResults) {
+  if (count && (!pSources || !pSpirvs || !pResults))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  // One shader per task, compiles are long enough to be worth it.
+  parallelFor(count, 1, [&](uint32_t i) {
+    pResults[i] = compile(pSources[i], &pSpirvs[i],
+                          pIncludes ? &pIncludes[i] : nullptr);
+  });
+  return firstFailure(count, pResults);
+}
+
+ShaderGutsResult ShaderGutsCore_Decompile(const ShaderGutsCode *pCode,
+                                          ShaderGutsOutput *pGlsl) {
+  return decompile(pCode, pGlsl);
+}
+
+ShaderGutsResult ShaderGutsCore_DecompileBatch(uint32_t count,
+                                               const ShaderGutsCode *pCodes,
+                                               ShaderGutsOutput *pGlsls,
+                                               ShaderGutsResult *pResults) {
+  if (count && (!pCodes || !pGlsls || !pResults))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  parallelFor(count, 16, [&](uint32_t i) {
+    pResults[i] = decompile(&pCodes[i], &pGlsls[i]);
+  });
+  return firstFailure(count, pResults);
+}
+
+ShaderGutsResult ShaderGutsCore_Optimize(const ShaderGutsCode *pCode,
+                                         const char *recipe,
+                                         ShaderGutsOutput *pSpirv) {
+  if (!valid(pCode) || !recipe || !valid(pSpirv) ||
+      pCode->codeSize % sizeof(uint32_t))
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  auto aligned = std::vector<uint32_t>();
+  auto optimized = util::spirv::optimize(words(*pCode, aligned), recipe);
+  if (!optimized) {
+    std::clog << "[VK_SHADER_GUTS][err]: spirv-opt failed: "
+              << optimized.error() << "\n";
+    return SHADER_GUTS_ERROR_FAILED;
+  }
+  return write(pSpirv, std::as_bytes(std::span(*optimized)));
+}
+
+ShaderGutsResult ShaderGutsCore_OpenArchive(const char *path,
+                                            ShaderGutsArchive *pArchive) {
+  if (!path || !pArchive)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  auto archive = std::make_unique<ShaderGutsArchive_T>();
+  archive->dir = path;
+
+  std::error_code ec;
+  fs::create_directories(archive->dir, ec);
+  if (!fs::is_directory(archive->dir))
+    return SHADER_GUTS_ERROR_IO;
+
+  for (const auto &folder : fs::directory_iterator(archive->dir, ec)) {
+    auto stage = stageOf(folder.path().filename().string());
+    if (!stage || !folder.is_directory())
+      continue;
+
+    for (const auto &file : fs::directory_iterator(folder.path(), ec)) {
+      if (!file.is_regular_file() || file.path().extension() != ".spv")
+        continue;
+      if (auto entry = makeEntry(stage, file.path().stem().string(),
+                                 file.file_size(ec)))
+        archive->entries.push_back(*entry);
+    }
+  }
+  std::ranges::sort(archive->entries, byStageAndName);
+
+  *pArchive = archive.release();
+  return SHADER_GUTS_SUCCESS;
+}
+
+void ShaderGutsCore_CloseArchive(ShaderGutsArchive archive) {
+  delete archive;
+}
+
+ShaderGutsResult
+ShaderGutsCore_EnumerateArchive(ShaderGutsArchive archive, uint32_t *pCount,
+                                ShaderGutsArchiveEntry *pEntries) {
+  if (!archive || !pCount)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  std::lock_guard<std::mutex> l(archive->lock);
+  auto available = uint32_t(archive->entries.size());
+  if (!pEntries) {
+    *pCount = available;
+    return SHADER_GUTS_SUCCESS;
+  }
+
+  *pCount = std::min(*pCount, available);
+  std::copy_n(archive->entries.begin(), *pCount, pEntries);
+  return *pCount < available ? SHADER_GUTS_INCOMPLETE : SHADER_GUTS_SUCCESS;
+}
+
+ShaderGutsResult ShaderGutsCore_FindInArchive(ShaderGutsArchive archive,
+                                              uint32_t stage, const char *name,
+                                              ShaderGutsArchiveEntry *pEntry) {
+  if (!archive || !name || !pEntry || std::popcount(stage) != 1)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  auto key = makeEntry(stage, name, 0);
+  if (!key)
+    return SHADER_GUTS_ERROR_NOT_FOUND;
+
+  std::lock_guard<std::mutex> l(archive->lock);
+  auto it = std::ranges::lower_bound(archive->entries, *key, byStageAndName);
+  if (it == archive->entries.end() || byStageAndName(*key, *it))
+    return SHADER_GUTS_ERROR_NOT_FOUND;
+
+  *pEntry = *it;
+  return SHADER_GUTS_SUCCESS;
+}
+
+ShaderGutsResult
+ShaderGutsCore_ReadArchive(ShaderGutsArchive archive,
+                           const ShaderGutsArchiveEntry *pEntry, void *pData,
+                           size_t *pSize) {
+  if (!archive || !pEntry || !pSize)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  if (!pData) {
+    *pSize = pEntry->size;
+    return SHADER_GUTS_SUCCESS;
+  }
+
+  // Straight into the caller's buffer.
+  std::ifstream file(entryPath(*archive, *pEntry), std::ios::binary);
+  if (!file.is_open())
+    return SHADER_GUTS_ERROR_NOT_FOUND;
+
+  auto wanted = std::min<size_t>(*pSize, pEntry->size);
+  file.read(static_cast<char *>(pData), wanted);
+  *pSize = size_t(file.gcount());
+  if (*pSize != wanted)
+    return SHADER_GUTS_ERROR_IO;
+  return wanted < pEntry->size ? SHADER_GUTS_INCOMPLETE : SHADER_GUTS_SUCCESS;
+}
+
+ShaderGutsResult ShaderGutsCore_WriteArchive(ShaderGutsArchive archive,
+                                             uint32_t stage,
+                                             const ShaderGutsCode *pCode,
+                                             ShaderGutsArchiveEntry *pEntry) {
+  if (!archive || !valid(pCode) || std::popcount(stage) != 1)
+    return SHADER_GUTS_ERROR_INVALID_ARGUMENT;
+
+  ShaderGutsHash hash{};
+  util::Sha1Hash::compute(pCode->code, pCode->codeSize).toChars(hash.hex);
+  auto entry = *makeEntry(stage, {hash.hex, 40}, pCode->codeSize);
+  if (pEntry)
+    *pEntry = entry;
+
+  std::lock_guard<std::mutex> l(archive->lock);
+  auto it = std::ranges::lower_bound(archive->entries, entry, byStageAndName);
+  if (it != archive->entries.end() && !byStageAndName(entry, *it))
+    return SHADER_GUTS_SUCCESS;
+
+  // Written aside and renamed, readers never see half a shader.
+  auto path = entryPath(*archive, entry);
+  auto tmp = path;
+  tmp += std::format(".{}.tmp", getpid());
+
+  std::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+  util::SaveBinaryFile(code(*pCode), tmp.string());
+  if (fs::file_size(tmp, ec) != pCode->codeSize || ec) {
+    fs::remove(tmp, ec);
+    return SHADER_GUTS_ERROR_IO;
+  }
+  fs::rename(tmp, path, ec);
+  if (ec)
+    return SHADER_GUTS_ERROR_IO;
+
+  archive->entries.insert(it, entry);
+  return SHADER_GUTS_SUCCESS;
+}
+
+} // extern "C"
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+namespace impl {
+
+// The layer's share of a command the application deferred. Threads joining
+// the VkDeferredOperationKHR take tasks until none are left, then hand what
+// they found over. Whoever hands over the last one runs what comes after,
+// usually the driver's share of the command.
+class DeferredWork {
+public:
+  explicit DeferredWork(size_t tasks) : tasks(tasks) {}
+
+  DeferredWork(const DeferredWork &) = delete;
+  DeferredWork &operator=(const DeferredWork &) = delete;
+
+  // `run(index)` for each task this thread takes, `handOver()` once after
+  // them, `last()` on the thread that completes the layer's share. Returns
+  // whether that share is complete; if not, other threads are still busy
+  // with it and the caller should come back later.
+  template <typename Run, typename HandOver, typename Last>
+  auto join(Run &&run, HandOver &&handOver, Last &&last) -> bool {
+    size_t ran = 0;
+    for (size_t i; (i = next.fetch_add(1)) < tasks; ++ran)
+      run(i);
+    if (ran)
+      handOver();
+
+    if (done.fetch_add(ran) + ran == tasks && !claimed.exchange(true)) {
+      last();
+      complete.store(true, std::memory_order_release);
+    }
+    return complete.load(std::memory_order_acquire);
+  }
+
+  auto completed() const -> bool {
+    return complete.load(std::memory_order_acquire);
+  }
+
+  // For vkGetDeferredOperationMaxConcurrencyKHR, at least one.
+  auto remaining() const -> size_t {
+    auto taken = next.load(std::memory_order_relaxed);
+    return taken < tasks ? tasks - taken : 1;
+  }
+
+private:
+  size_t tasks;
+  std::atomic<size_t> next = 0;
+  std::atomic<size_t> done = 0;
+  std::atomic<bool> claimed = false;
+  std::atomic<bool> complete = false;
+};
+
+}; // namespace impl
@@ -149,7 +149,14 @@ typedef struct VkLayerDispatchTable_ {
   PFN_vkCmdDebugMarkerInsertEXT CmdDebugMarkerInsertEXT;
 
   PFN_vkCreateShadersEXT CreateShadersEXT;
+  PFN_vkDestroyShaderEXT DestroyShaderEXT;
   PFN_vkGetShaderBinaryDataEXT GetShaderBinaryDataEXT;
+  PFN_vkCreateRayTracingPipelinesKHR CreateRayTracingPipelinesKHR;
+  PFN_vkDeferredOperationJoinKHR DeferredOperationJoinKHR;
+  PFN_vkGetDeferredOperationResultKHR GetDeferredOperationResultKHR;
+  PFN_vkGetDeferredOperationMaxConcurrencyKHR
+      GetDeferredOperationMaxConcurrencyKHR;
+  PFN_vkDestroyDeferredOperationKHR DestroyDeferredOperationKHR;
 } VkLayerDispatchTable;
 
 typedef struct VkLayerInstanceDispatchTable_ {
@@ -217,4 +224,6 @@ typedef struct VkLayerInstanceDispatchTable_ {
   PFN_vkCreateDisplayPlaneSurfaceKHR CreateDisplayPlaneSurfaceKHR;
   PFN_vkGetPhysicalDeviceExternalImageFormatPropertiesNV
       GetPhysicalDeviceExternalImageFormatPropertiesNV;
+
+  PFN_vkGetPhysicalDeviceProperties2 GetPhysicalDeviceProperties2;
 } VkLayerInstanceDispatchTable;
\ No newline at end of file
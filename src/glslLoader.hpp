@@ -0,0 +1,196 @@
+#pragma once
+#include "shaderGutsCore.h"
+#include "util.hpp"
+#include <dlfcn.h>
+#include <mutex>
+
+#ifndef SHADER_GUTS_CORE_NAME
+#define SHADER_GUTS_CORE_NAME "libshader-guts-core.so"
+#endif
+
+namespace util::glsl {
+
+// Lazily dlopen()ed core library, see shaderGutsCore.h. Nothing is loaded
+// until the first call to compile(), optimize() or saveToFile(), so the
+// SPIR-V only paths never map glslang.
+class Plugin {
+public:
+  static auto get() -> const Plugin & {
+    static Plugin plugin;
+    static std::once_flag once;
+    std::call_once(once, [] { plugin.load(); });
+    return plugin;
+  }
+
+  auto loaded() const -> bool { return handle != nullptr; }
+
+  // `includes` gets the headers the shader pulled in, even if it failed.
+  auto compile(const std::string &source, const std::filesystem::path &path,
+               std::vector<std::filesystem::path> *includes = nullptr) const
+      -> std::vector<std::byte> {
+    if (!loaded())
+      return {};
+
+    auto spirv = std::vector<std::byte>();
+    auto includeList = std::string();
+    auto spirvOutput = outputTo(spirv);
+    auto includeOutput = outputTo(includeList);
+    ShaderGutsSource src{source.data(), source.size(), path.c_str()};
+
+    auto result = pfnCompile(&src, &spirvOutput,
+                             includes ? &includeOutput : nullptr);
+    if (includes)
+      *includes = splitPaths(includeList);
+    return result == SHADER_GUTS_SUCCESS ? spirv : std::vector<std::byte>();
+  }
+
+  struct Source {
+    std::string source;
+    std::filesystem::path path;
+  };
+
+  // Compiled in parallel by the library, results keep the order of
+  // `sources`.
+  auto compileBatch(const std::vector<Source> &sources) const
+      -> std::vector<std::vector<std::byte>> {
+    auto ret = std::vector<std::vector<std::byte>>(sources.size());
+    if (!loaded() || sources.empty())
+      return ret;
+
+    auto coreSources = std::vector<ShaderGutsSource>();
+    auto outputs = std::vector<ShaderGutsOutput>();
+    coreSources.reserve(sources.size());
+    outputs.reserve(sources.size());
+    for (size_t i = 0; i < sources.size(); ++i) {
+      coreSources.push_back({sources[i].source.data(),
+                             sources[i].source.size(),
+                             sources[i].path.c_str()});
+      outputs.push_back(outputTo(ret[i]));
+    }
+
+    auto results = std::vector<ShaderGutsResult>(sources.size());
+    pfnCompileBatch(uint32_t(coreSources.size()), coreSources.data(),
+                    outputs.data(), nullptr, results.data());
+
+    for (size_t i = 0; i < results.size(); ++i)
+      if (results[i] != SHADER_GUTS_SUCCESS)
+        ret[i].clear();
+    return ret;
+  }
+
+  // Empty if spirv-opt failed, the reason is logged by the library.
+  auto optimize(std::span<const std::byte> shader, const std::string &recipe)
+      const -> std::vector<std::byte> {
+    if (!loaded())
+      return {};
+
+    auto spirv = std::vector<std::byte>();
+    auto output = outputTo(spirv);
+    ShaderGutsCode code{shader.data(), shader.size()};
+    if (pfnOptimize(&code, recipe.c_str(), &output) != SHADER_GUTS_SUCCESS)
+      return {};
+    return spirv;
+  }
+
+  auto saveToFile(std::span<const std::byte> shader,
+                  const std::filesystem::path &path) const -> bool {
+    if (!loaded())
+      return false;
+
+    auto glsl = std::string();
+    auto output = outputTo(glsl);
+    ShaderGutsCode code{shader.data(), shader.size()};
+    if (pfnDecompile(&code, &output) != SHADER_GUTS_SUCCESS)
+      return false;
+
+    std::ofstream file(path, std::ios::binary);
+    return file.is_open() && file.write(glsl.data(), glsl.size());
+  }
+
+private:
+  Plugin() = default;
+
+  // The library writes its result straight into `out`.
+  template <typename Container>
+  static auto outputTo(Container &out) -> ShaderGutsOutput {
+    auto allocate = [](void *user, size_t size) -> void * {
+      auto &out = *static_cast<Container *>(user);
+      out.resize(size);
+      return out.data();
+    };
+    return {allocate, &out, nullptr, 0};
+  }
+
+  static auto splitPaths(std::string_view list)
+      -> std::vector<std::filesystem::path> {
+    auto paths = std::vector<std::filesystem::path>();
+    for (size_t start = 0, end; start < list.size(); start = end + 1) {
+      end = list.find('\0', start);
+      if (end == std::string_view::npos)
+        end = list.size();
+      paths.emplace_back(list.substr(start, end - start));
+    }
+    return paths;
+  }
+
+  // Next to the layer itself unless VK_SHADER_GUTS_CORE overrides it.
+  static auto findPluginPath() -> std::string {
+    if (auto env = util::getEnv("VK_SHADER_GUTS_CORE"))
+      return env.value();
+
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&findPluginPath), &info) &&
+        info.dli_fname) {
+      auto path = std::filesystem::path(info.dli_fname).parent_path() /
+                  SHADER_GUTS_CORE_NAME;
+      if (std::filesystem::exists(path))
+        return path.string();
+    }
+
+    // Let the dynamic linker search for it.
+    return SHADER_GUTS_CORE_NAME;
+  }
+
+  auto load() -> void {
+    const auto path = findPluginPath();
+
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+      std::clog << "[VK_SHADER_GUTS][err]: Can't load core library: "
+                << dlerror() << "\n";
+      return;
+    }
+
+    auto pfnGetVersion = reinterpret_cast<PFN_ShaderGutsCore_GetVersion>(
+        dlsym(handle, "ShaderGutsCore_GetVersion"));
+    pfnCompile = reinterpret_cast<PFN_ShaderGutsCore_Compile>(
+        dlsym(handle, "ShaderGutsCore_Compile"));
+    pfnCompileBatch = reinterpret_cast<PFN_ShaderGutsCore_CompileBatch>(
+        dlsym(handle, "ShaderGutsCore_CompileBatch"));
+    pfnDecompile = reinterpret_cast<PFN_ShaderGutsCore_Decompile>(
+        dlsym(handle, "ShaderGutsCore_Decompile"));
+    pfnOptimize = reinterpret_cast<PFN_ShaderGutsCore_Optimize>(
+        dlsym(handle, "ShaderGutsCore_Optimize"));
+
+    if (!pfnGetVersion || !pfnCompile || !pfnCompileBatch ||
+        !pfnDecompile || !pfnOptimize ||
+        pfnGetVersion() != SHADER_GUTS_CORE_VERSION) {
+      std::clog << "[VK_SHADER_GUTS][err]: Incompatible core library: "
+                << path << "\n";
+      dlclose(handle);
+      handle = nullptr;
+      return;
+    }
+
+    std::clog << "[VK_SHADER_GUTS][log]: Loaded core library: " << path
+              << "\n";
+  }
+
+  void *handle = nullptr;
+  PFN_ShaderGutsCore_Compile pfnCompile = nullptr;
+  PFN_ShaderGutsCore_CompileBatch pfnCompileBatch = nullptr;
+  PFN_ShaderGutsCore_Decompile pfnDecompile = nullptr;
+  PFN_ShaderGutsCore_Optimize pfnOptimize = nullptr;
+};
+
+} // namespace util::glsl
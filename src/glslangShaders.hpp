@@ -1,31 +1,82 @@
 #pragma once
 #include "util.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <expected>
+#include <format>
 #include <glslang/Public/ResourceLimits.h>
 #include <glslang/Public/ShaderLang.h>
 #include <glslang/SPIRV/GlslangToSpv.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <shared_mutex>
+#include <span>
+#include <spirv_cross/spirv_cross.hpp>
+#include <spirv_cross/spirv_glsl.hpp>
+
+namespace util {
+
+// Vulkan GLSL of a SPIR-V module. SPIRV-Cross throws on modules it can't
+// handle.
+inline auto DecompileGLSL(std::span<const std::byte> shader) -> std::string {
+  auto words = reinterpret_cast<const uint32_t *>(shader.data());
+  spirv_cross::CompilerGLSL compiler(words, shader.size() / sizeof(uint32_t));
+  spirv_cross::ShaderResources resources = compiler.get_shader_resources();
+
+  spirv_cross::CompilerGLSL::Options options;
+  options.vulkan_semantics = true;
+  compiler.set_common_options(options);
+
+  return compiler.compile();
+}
+
+inline auto SaveGLSLToFile(const std::vector<std::byte> &shader,
+                           std::filesystem::path path) -> void {
+  std::string glslCode = DecompileGLSL(shader);
+
+  if (std::ofstream file(path, std::ios::binary); file.is_open()) {
+    file.write(glslCode.c_str(), glslCode.size());
+    file.close();
+  }
+}
+
+} // namespace util
 
 namespace util::shaders {
 
 const std::map<std::string_view, EShLanguage> shaderTypeESh{
     {".vert", EShLangVertex},
+    {".tesc", EShLangTessControl},
+    {".tese", EShLangTessEvaluation},
     {".frag", EShLangFragment},
     {".comp", EShLangCompute},
     {".geom", EShLangGeometry},
+    {".task", EShLangTask},
+    {".mesh", EShLangMesh},
+    {".rgen", EShLangRayGen},
+    {".rahit", EShLangAnyHit},
+    {".rchit", EShLangClosestHit},
+    {".rmiss", EShLangMiss},
+    {".rint", EShLangIntersect},
+    {".rcall", EShLangCallable},
 };
 
 struct GLSLCompileParams {
   std::string shaderSource;
   size_t shaderVersion;
   EShLanguage shaderStage;
+  // #include is resolved next to it.
+  std::filesystem::path path;
 };
 
 inline auto findGLSLVersion(const std::string &shader)
     -> std::expected<uint, std::string> {
+  static const auto reg = std::regex(R"(#version\s+(\d+))");
+
   std::smatch match;
-  auto reg = std::regex(R"(#version\s+(\d+))");
   if (std::regex_search(shader, match, reg)) {
     return std::stoi(match[1]);
   }
@@ -45,50 +96,251 @@ inline auto findShaderType(const std::filesystem::path path)
       path.c_str()));
 }
 
-inline auto compileGLSL(const GLSLCompileParams &params)
-    -> std::vector<std::byte> {
-  glslang::InitializeProcess();
-  const char *shaderStrings[1];
+inline auto makeCompileParams(std::string source,
+                              const std::filesystem::path &path)
+    -> std::expected<GLSLCompileParams, std::string> {
+  auto glslType = findShaderType(path);
+  if (!glslType)
+    return std::unexpected(glslType.error());
+
+  auto glslVersion = findGLSLVersion(source);
+  if (!glslVersion)
+    return std::unexpected(glslVersion.error());
+
+  return GLSLCompileParams{std::move(source), glslVersion.value(),
+                           glslType.value(), path};
+}
+
+// Headers pulled in by #include, shared by every compile in the process. A
+// file is only read again once its size or mtime changes, and identical
+// contents are kept once no matter how many paths lead to them, so a large
+// header included by hundreds of overrides is read and held once. glslang
+// still preprocesses it per shader, macros may differ between includers.
+class IncludeCache {
+public:
+  using Text = std::shared_ptr<const std::string>;
+
+  static auto get() -> IncludeCache & {
+    static IncludeCache cache;
+    return cache;
+  }
+
+  // nullptr if there's no such file.
+  auto load(const std::filesystem::path &path) -> Text {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    auto time = std::filesystem::last_write_time(path, ec);
+    if (ec)
+      return nullptr;
+
+    auto key = path.lexically_normal().string();
+    {
+      std::shared_lock<std::shared_mutex> l(lock);
+      auto it = files.find(key);
+      if (it != files.end() && it->second.size == size &&
+          it->second.time == time) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second.text;
+      }
+    }
+
+    auto text = std::string();
+    if (std::ifstream file(path, std::ios::binary); file.is_open())
+      text.assign(std::istreambuf_iterator<char>(file),
+                  std::istreambuf_iterator<char>());
+    auto hash = util::Sha1Hash::compute(text.data(), text.size()).toString();
+
+    std::unique_lock<std::shared_mutex> l(lock);
+    auto &shared = contents[hash];
+    auto ret = shared.lock();
+    if (!ret)
+      shared = ret = std::make_shared<const std::string>(std::move(text));
+    files[key] = {size, time, ret};
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return ret;
+  }
+
+  auto status() const -> std::pair<uint64_t, uint64_t> {
+    return {hits.load(), misses.load()};
+  }
+
+private:
+  struct File {
+    uintmax_t size;
+    std::filesystem::file_time_type time;
+    Text text;
+  };
+
+  std::shared_mutex lock;
+  std::map<std::string, File> files;
+  std::map<std::string, std::weak_ptr<const std::string>> contents;
+  std::atomic<uint64_t> hits = 0;
+  std::atomic<uint64_t> misses = 0;
+};
 
-  shaderStrings[0] = params.shaderSource.data();
-  glslang::TShader shader(params.shaderStage);
-  shader.setStrings(shaderStrings, 1);
+// Resolves `#include "x"` next to the file that includes it, then next to
+// the shader, and `#include <x>` next to the shader only. Every header it
+// resolved is listed in includes(), for the callers' dependency tracking.
+class Includer : public glslang::TShader::Includer {
+public:
+  explicit Includer(std::filesystem::path dir) : dir(std::move(dir)) {}
 
-  EShMessages messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
+  auto includeLocal(const char *headerName, const char *includerName,
+                    size_t) -> IncludeResult * override {
+    auto from = std::filesystem::path(includerName).parent_path();
+    if (auto result = include(from / headerName))
+      return result;
+    return include(dir / headerName);
+  }
+
+  auto includeSystem(const char *headerName, const char *, size_t)
+      -> IncludeResult * override {
+    return include(dir / headerName);
+  }
+
+  auto releaseInclude(IncludeResult *result) -> void override {
+    if (result)
+      delete static_cast<IncludeCache::Text *>(result->userData);
+    delete result;
+  }
+
+  auto includes() const -> const std::vector<std::filesystem::path> & {
+    return resolved;
+  }
 
-  if (!shader.parse(GetDefaultResources(), params.shaderVersion, true,
-                    messages)) {
-    std::clog << "[VK_SHADER_GUTS][err]: " << shader.getInfoLog() << " "
-              << shader.getInfoDebugLog() << "\n";
-    return {};
+private:
+  auto include(const std::filesystem::path &path) -> IncludeResult * {
+    auto text = IncludeCache::get().load(path);
+    if (!text)
+      return nullptr;
+
+    auto normal = path.lexically_normal();
+    if (std::ranges::find(resolved, normal) == resolved.end())
+      resolved.push_back(normal);
+
+    // The cached text stays alive until glslang releases the include.
+    return new IncludeResult(normal.string(), text->data(), text->size(),
+                             new IncludeCache::Text(text));
   }
 
-  glslang::TProgram program;
-  program.addShader(&shader);
+  std::filesystem::path dir;
+  std::vector<std::filesystem::path> resolved;
+};
 
-  if (!program.link(messages)) {
-    std::clog << "[VK_SHADER_GUTS][err]: " << program.getInfoLog() << " "
-              << program.getInfoDebugLog() << "\n";
-    return {};
+// glslang only wants InitializeProcess() once per process, after that
+// TShader/TProgram can be used from any number of threads at once.
+class CompilerService {
+public:
+  static auto get() -> CompilerService & {
+    static CompilerService service;
+    return service;
   }
 
-  glslang::TIntermediate *intermediate =
-      program.getIntermediate(params.shaderStage);
+  CompilerService(const CompilerService &) = delete;
+  CompilerService &operator=(const CompilerService &) = delete;
 
-  if (!intermediate) {
-    std::clog << "[VK_SHADER_GUTS][err]: Failed to get SPIRV intermediate of "
-                 "the shader.\n";
-    return {};
+  // `includes` gets every header the shader pulled in, even if it failed.
+  auto compile(const GLSLCompileParams &params,
+               std::vector<std::filesystem::path> *includes = nullptr)
+      -> std::vector<std::byte> {
+    return compileTo(
+        params,
+        [](std::span<const std::byte> spirv) {
+          return std::vector<std::byte>(spirv.begin(), spirv.end());
+        },
+        includes);
   }
 
-  std::vector<uint32_t> spirvOutput;
-  glslang::GlslangToSpv(*intermediate, spirvOutput);
+  // Hands `write` the SPIR-V straight from this thread's scratch buffer,
+  // empty if the shader failed, and returns what it returns.
+  template <typename Write>
+  auto compileTo(const GLSLCompileParams &params, Write &&write,
+                 std::vector<std::filesystem::path> *includes = nullptr)
+      -> std::invoke_result_t<Write, std::span<const std::byte>> {
+    Includer includer(params.path.parent_path());
+    auto spirv = compile(params, includer);
+    if (includes)
+      *includes = includer.includes();
+    return write(std::as_bytes(spirv));
+  }
+
+private:
+  CompilerService() { glslang::InitializeProcess(); }
+
+  ~CompilerService() { glslang::FinalizeProcess(); }
+
+  // Valid until the next compile on this thread.
+  auto compile(const GLSLCompileParams &params, Includer &includer)
+      -> std::span<const uint32_t> {
+    // Scratch output reused by every compile on this thread.
+    thread_local std::vector<uint32_t> spirvOutput;
 
-  glslang::FinalizeProcess();
+    // The name is what nested includes are resolved against.
+    const char *shaderStrings[1] = {params.shaderSource.data()};
+    const int shaderLengths[1] = {int(params.shaderSource.size())};
+    auto name = params.path.string();
+    const char *shaderNames[1] = {name.c_str()};
+
+    glslang::TShader shader(params.shaderStage);
+    shader.setStringsWithLengthsAndNames(shaderStrings, shaderLengths,
+                                         shaderNames, 1);
+    if (params.shaderSource.contains("#include"))
+      shader.setPreamble("#extension GL_GOOGLE_include_directive : require\n");
+
+    // Mesh, task and ray tracing stages only exist from SPIR-V 1.4 on.
+    if (params.shaderStage >= EShLangRayGen) {
+      shader.setEnvInput(glslang::EShSourceGlsl, params.shaderStage,
+                         glslang::EShClientVulkan, 100);
+      shader.setEnvClient(glslang::EShClientVulkan,
+                          glslang::EShTargetVulkan_1_2);
+      shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_4);
+    }
+
+    EShMessages messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
+
+    if (!shader.parse(GetDefaultResources(), params.shaderVersion, true,
+                      messages, includer)) {
+      std::clog << "[VK_SHADER_GUTS][err]: " << shader.getInfoLog() << " "
+                << shader.getInfoDebugLog() << "\n";
+      return {};
+    }
+
+    glslang::TProgram program;
+    program.addShader(&shader);
+
+    if (!program.link(messages)) {
+      std::clog << "[VK_SHADER_GUTS][err]: " << program.getInfoLog() << " "
+                << program.getInfoDebugLog() << "\n";
+      return {};
+    }
+
+    glslang::TIntermediate *intermediate =
+        program.getIntermediate(params.shaderStage);
+
+    if (!intermediate) {
+      std::clog << "[VK_SHADER_GUTS][err]: Failed to get SPIRV intermediate of "
+                   "the shader.\n";
+      return {};
+    }
+
+    spirvOutput.clear();
+    glslang::GlslangToSpv(*intermediate, spirvOutput);
+    return spirvOutput;
+  }
+};
+
+inline auto compileGLSL(const GLSLCompileParams &params,
+                        std::vector<std::filesystem::path> *includes = nullptr)
+    -> std::vector<std::byte> {
+  return CompilerService::get().compile(params, includes);
+}
 
-  return std::vector<std::byte>(
-      reinterpret_cast<std::byte *>(spirvOutput.data()),
-      reinterpret_cast<std::byte *>(spirvOutput.data()) +
-          (spirvOutput.size() * sizeof(uint32_t)));
+template <typename Write>
+inline auto
+compileGLSLTo(const GLSLCompileParams &params, Write &&write,
+              std::vector<std::filesystem::path> *includes = nullptr)
+    -> std::invoke_result_t<Write, std::span<const std::byte>> {
+  return CompilerService::get().compileTo(params, std::forward<Write>(write),
+                                          includes);
 }
 } // namespace util::shaders
@@ -1,15 +1,155 @@
 #pragma once
+#include "arena.hpp"
+#include "captureFilter.hpp"
+#include "codePool.hpp"
+#include "control.hpp"
 #include "defines.hpp"
-#include "glslangShaders.hpp"
+#include "overrides.hpp"
+#include "pipelineIndex.hpp"
+#include "specialization.hpp"
+#include "stages.hpp"
+#include "trace.hpp"
+#include "spirvCost.hpp"
 #include "util.hpp"
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <memory_resource>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <span>
+#include <unordered_set>
 
 namespace impl {
+
+// One per process, shared by every instance and device: the configuration,
+// the overrides, the code pool and what was already dumped. What belongs to
+// a device, its modules and pipelines, is kept in a DeviceShaders the caller
+// passes along, since handles of different devices may have equal values.
 class ShaderGuts {
 public:
-  enum class ShaderLanguage { spirv, glsl };
+  using ShaderLanguage = impl::ShaderLanguage;
+  // Original SPIR-V, kept while the shader may still have to be dumped.
+  using RetainedCode = std::shared_ptr<PooledCode>;
+
+  struct ShaderRef {
+    VkShaderStageFlagBits stage;
+    util::HexHash hash;
+    // Hash of the specialization constants, empty unless they're tracked.
+    util::HexHash spec;
+    // Only set outside a capture window, for dumping at the first bind.
+    RetainedCode code = nullptr;
+  };
+  using PipelineShaders = std::vector<ShaderRef>;
+
+  // Per-call state lives in the calling thread's util::Arena, so a create
+  // call that has nothing to dump doesn't allocate.
+  template <typename T> using Scratch = std::pmr::vector<T>;
+
+  // A stage of pipeline `pipeline` that gets an override. The application's
+  // structs are never written, the driver gets patched copies. Inline
+  // VkShaderModuleCreateInfo code is replaced as it is. A module whose
+  // specialized variant has its own override was created before the
+  // constants were known, so the stage gets a `module` of its own.
+  struct StagePatch {
+    const VkPipelineShaderStageCreateInfo *stage;
+    size_t pipeline;
+    Overrides::Code code;
+    VkShaderModule module = VK_NULL_HANDLE;
+  };
+
+  // Replacements handed to the driver, which the code pool mustn't free
+  // before the create call returns.
+  using StagePatches = Scratch<StagePatch>;
+  using Pinned = Scratch<Overrides::Code>;
+
+  struct PipelineBatch {
+    // Batches that outlive the create call, deferred ones, bring their own
+    // memory.
+    PipelineBatch(std::pmr::memory_resource *memory = util::Arena::resource())
+        : shaders(memory), patches(memory), compileRequired(memory),
+          pipelineReplaced(memory) {}
+
+    // What the batch and the create info copies it patches are allocated
+    // from.
+    auto memory() const -> std::pmr::memory_resource * {
+      return shaders.get_allocator().resource();
+    }
+
+    auto resize(size_t createInfoCount) -> void {
+      shaders.resize(createInfoCount);
+      compileRequired.resize(createInfoCount);
+      pipelineReplaced.resize(createInfoCount);
+    }
+
+    auto markReplaced(size_t index) -> void {
+      replaced = true;
+      pipelineReplaced[index] = 1;
+    }
+
+    // Takes over what another thread found for the same create call.
+    auto merge(PipelineBatch &&other) -> void {
+      replaced |= other.replaced;
+      for (size_t i = 0; i < other.shaders.size(); ++i) {
+        shaders[i].insert(shaders[i].end(), other.shaders[i].begin(),
+                          other.shaders[i].end());
+        compileRequired[i] |= other.compileRequired[i];
+        pipelineReplaced[i] |= other.pipelineReplaced[i];
+      }
+      patches.insert(patches.end(), other.patches.begin(),
+                     other.patches.end());
+    }
+
+    // Whether any pipeline of the batch got replaced code.
+    bool replaced = false;
+    Scratch<Scratch<ShaderRef>> shaders;
+    StagePatches patches;
+    // Pipelines that asked not to block while one of their overrides is
+    // still being built. The layer leaves them to the application's retry.
+    Scratch<uint8_t> compileRequired;
+    // Pipelines with replaced code, their own stages or their libraries'.
+    Scratch<uint8_t> pipelineReplaced;
+  };
+
+  // One stage of a ray-tracing create. Those may be deferred, their stages
+  // then get processed by whichever threads join the deferred operation.
+  struct RayTracingStage {
+    uint32_t pipeline;
+    const VkPipelineShaderStageCreateInfo *stage;
+    bool noWait;
+  };
+
+  // Module hash, original code for dumping, and whether it got replaced.
+  struct ModuleLoad {
+    util::HexHash hash;
+    RetainedCode code;
+    bool replaced = false;
+    Overrides::Code pinned;
+    // The override wasn't built yet, pipelines using the module take it.
+    bool overridePending = false;
+  };
+
+  // Libraries, for their link step, and while windowed every pipeline.
+  struct PipelineRecord {
+    PipelineShaders shaders;
+    bool replaced;
+    bool bound = false;
+  };
+
+  // The shader modules and pipelines of one device.
+  struct DeviceShaders {
+    std::mutex lock;
+    // Nodes come from a pool, module creates don't go to the heap each time.
+    std::pmr::unsynchronized_pool_resource moduleNodes;
+    std::pmr::map<VkShaderModule, ModuleLoad> shaderModules{&moduleNodes};
+    std::map<VkPipeline, PipelineRecord> pipelines;
+  };
 
   ShaderGuts()
-      : dumpEnable(false), loadEnable(false), loadLang(ShaderLanguage::spirv) {
+      : warmUpEnable(false), dumpLang(ShaderLanguage::spirv),
+        loadLang(ShaderLanguage::spirv) {
     namespace fs = std::filesystem;
 
     bool dump = util::envContainsString("VK_SHADER_GUTS_DUMP_PATH", dumpPath);
@@ -20,191 +160,1062 @@ public:
     bool hash = util::envContainsString("VK_SHADER_GUTS_LOAD_HASH", loadHash);
     util::envContains<ShaderLanguage>("VK_SHADER_GUTS_LOAD_LANG",
                                       stringToSourceType, loadLang);
+    util::envContains<SpecDump>("VK_SHADER_GUTS_DUMP_SPEC", stringToSpecDump,
+                                specDump);
+    util::envContainsTrue("VK_SHADER_GUTS_WARMUP", warmUpEnable);
+    if (std::string tracePath;
+        util::envContainsString("VK_SHADER_GUTS_TRACE", tracePath))
+      util::trace::Tracer::get().start(tracePath);
+    util::envContainsString("VK_SHADER_GUTS_PIPELINE_CACHE", pipelineCacheDir);
+    util::envContainsString("VK_SHADER_GUTS_SHADER_BINARY_CACHE",
+                            shaderBinaryCacheDir);
+    if (std::string frames;
+        util::envContainsString("VK_SHADER_GUTS_CAPTURE_FRAMES", frames))
+      ParseFrameWindow(frames);
+    util::envContainsString("VK_SHADER_GUTS_CAPTURE_TRIGGER", captureTrigger);
 
     if (dump)
-      dumpEnable = fs::exists(dumpPath) ? true : fs::create_directory(dumpPath);
+      dumpConfigured =
+          fs::exists(dumpPath) ? true : fs::create_directory(dumpPath);
+    // A capture window starts closed, the first present opens it if due.
+    dumpEnable = dumpConfigured && !Windowed();
+
+    if (load && (hash || fs::is_directory(loadPath)) && fs::exists(loadPath))
+      PublishOverrides(
+          std::make_unique<Overrides>(loadPath, loadHash, loadLang,
+                                      codePool, optimizer));
 
-    if (load && hash)
-      loadEnable = hash && fs::exists(loadPath);
+    if (loadEnable && !pipelineCacheDir.empty() &&
+        !fs::exists(pipelineCacheDir))
+      fs::create_directories(pipelineCacheDir);
 
     PrintLogs();
+
+    if (std::string controlPath;
+        util::envContainsString("VK_SHADER_GUTS_CONTROL", controlPath))
+      control = std::make_unique<ControlServer>(
+          controlPath, [this](auto line) { return HandleCommand(line); },
+          [this] { ControlTick(); });
   }
 
-  auto CreateShaderModulePre(const VkShaderModuleCreateInfo *pCreateInfo)
-      -> void {
-    using sourceType = uint32_t;
+  ShaderGuts(const ShaderGuts &) = delete;
+  ShaderGuts &operator=(const ShaderGuts &) = delete;
 
-    if (!loadEnable)
+  ~ShaderGuts() {
+    control.reset();
+    WriteIndex();
+  }
+
+  // When the last instance goes away, so index.csv doesn't wait for exit.
+  // Rows of every instance so far are written each time.
+  auto WriteIndex() -> void {
+    scoped_lock l(lock);
+    FlushThrottledLocked(true);
+    if (dumpConfigured && !costIndex.empty())
+      util::spirv::CostIndex::write(dumpPath, costIndex);
+    if (dumpConfigured && !pipelineEdges.empty())
+      util::PipelineIndex::write(dumpPath, pipelineEdges);
+  }
+
+  // Called once the device exists, so the replacements get built while the
+  // application is still loading instead of inside its first pipeline create.
+  auto WarmUp() -> void {
+    scoped_lock l(controlLock);
+    deviceCreated = true;
+
+    auto set = overrides.load(std::memory_order_acquire);
+    if (set && warmUpEnable)
+      set->warmUp();
+  }
+
+  // One command from the control socket, runs on its thread.
+  auto HandleCommand(std::string_view line) -> std::string {
+    namespace fs = std::filesystem;
+
+    auto space = line.find(' ');
+    auto command = line.substr(0, space);
+    auto arg = space == std::string_view::npos ? std::string_view()
+                                               : line.substr(space + 1);
+
+    if (command == "status")
+      return Status();
+
+    if (command == "dump" && (arg == "on" || arg == "off")) {
+      if (!dumpConfigured)
+        return "error: VK_SHADER_GUTS_DUMP_PATH is not set\n";
+      dumpEnable = arg == "on";
+      captureEnd.reset();
+      return "ok\n";
+    }
+
+    if (command == "load" && (arg == "on" || arg == "off")) {
+      if (arg == "on" && ActiveOverrides().empty())
+        return "error: no overrides loaded\n";
+      loadEnable = arg == "on";
+      return "ok\n";
+    }
+
+    // Overrides that are unchanged, headers included, aren't built again.
+    if ((command == "load-path" && !arg.empty()) || command == "reload") {
+      auto path = fs::path(command == "reload" ? loadPath : arg);
+      if (!fs::exists(path) || (!fs::is_directory(path) && loadHash.empty()))
+        return "error: not a directory, or no VK_SHADER_GUTS_LOAD_HASH\n";
+
+      auto set = std::make_unique<Overrides>(path, loadHash, loadLang, codePool,
+                                             optimizer, &ActiveOverrides());
+      auto adopted = set->adopted();
+      auto count = PublishOverrides(std::move(set));
+      loadPath = path.string();
+      return std::format("ok: {} overrides, {} unchanged\n", count, adopted);
+    }
+
+    if (command == "capture" && dumpConfigured) {
+      unsigned seconds = 0;
+      auto [_, ec] = std::from_chars(arg.data(), arg.data() + arg.size(),
+                                     seconds);
+      if (ec != std::errc() || !seconds)
+        return "error: capture <seconds>\n";
+
+      captureEnd = std::chrono::steady_clock::now() +
+                   std::chrono::seconds(seconds);
+      dumpEnable = true;
+      return "ok\n";
+    }
+
+    return "error: commands are status, dump on|off, load on|off, "
+           "load-path <path>, reload, capture <seconds>\n";
+  }
+
+  // Where the layer keeps the pipeline cache of this device, if enabled. The
+  // name covers the driver's cache UUID and the current set of overrides.
+  auto PipelineCachePath(const uint8_t (&uuid)[VK_UUID_SIZE]) const
+      -> std::optional<std::filesystem::path> {
+    if (!loadEnable || pipelineCacheDir.empty())
+      return std::nullopt;
+
+    auto uuidHash = util::Sha1Hash::compute(uuid, VK_UUID_SIZE).toString();
+    auto setKey = ActiveOverrides().key();
+    return std::filesystem::path(pipelineCacheDir) /
+           (uuidHash.substr(0, 16) + "-" + setKey.substr(0, 16) + ".bin");
+  }
+
+  auto ShaderBinaryCacheDir() const -> std::optional<std::filesystem::path> {
+    if (shaderBinaryCacheDir.empty())
+      return std::nullopt;
+    return shaderBinaryCacheDir;
+  }
+
+  // Dumping is limited to frames N..M and/or to while the trigger file exists.
+  // Pipelines are then also followed to their binds, so shaders created
+  // before the window but used inside it still get dumped.
+  auto Windowed() const -> bool {
+    return dumpConfigured && (frameLast || !captureTrigger.empty());
+  }
+
+  // Counts frames and opens/closes the capture window.
+  auto QueuePresent() -> void {
+    auto frame = frames.fetch_add(1, std::memory_order_relaxed) + 1;
+    FlushThrottled();
+    if (!Windowed())
+      return;
+
+    bool inside = frame >= frameFirst && frame <= frameLast;
+    if (!captureTrigger.empty()) {
+      // A stat() per frame isn't free, the file only needs to be seen soon.
+      if (frame % triggerInterval == 0) {
+        std::error_code ec;
+        triggerHeld = std::filesystem::exists(captureTrigger, ec);
+      }
+      inside |= triggerHeld.load(std::memory_order_relaxed);
+    }
+
+    if (windowOpen.exchange(inside) == inside)
       return;
 
-    LoadShader<sourceType, VkShaderModuleCreateInfo>(pCreateInfo);
+    dumpEnable = inside;
+    std::clog << "[VK_SHADER_GUTS][log]: Capture " << (inside ? "on" : "off")
+              << " at frame " << frame << "\n";
   }
 
-  auto CreateShaderModulePost(const VkShaderModuleCreateInfo *pCreateInfo,
-                              VkShaderModule *pShaderModule) -> void {
-    if (!dumpEnable)
+  // First bind of a pipeline inside the window dumps the shaders it was
+  // created with while the window was closed.
+  auto BindPipeline(DeviceShaders &device, VkPipeline pipeline) -> void {
+    if (!dumpEnable.load(std::memory_order_relaxed))
       return;
 
-    auto shaderCode = std::vector<std::byte>(pCreateInfo->codeSize);
-    std::memcpy(shaderCode.data(), pCreateInfo->pCode, pCreateInfo->codeSize);
+    auto shaders = PipelineShaders();
+    {
+      scoped_lock l(device.lock);
+      auto it = device.pipelines.find(pipeline);
+      if (it == device.pipelines.end() || it->second.bound)
+        return;
 
-    shaderModules[*pShaderModule] = shaderCode;
+      it->second.bound = true;
+      for (auto &shader : it->second.shaders) {
+        if (shader.code)
+          shaders.push_back(shader);
+        shader.code.reset();
+      }
+    }
+
+    for (auto &shader : shaders) {
+      // The constants are long gone, variants are dumped unspecialized.
+      if (auto code = shader.code->get())
+        DumpShader(code->data(), code->size(), shader.stage, shader.hash,
+                   nullptr, {});
+    }
   }
 
-  auto CreateShadersEXT(uint32_t createInfoCount,
-                        const VkShaderCreateInfoEXT *pCreateInfos) -> void {
-    using sourceType = std::byte;
+  auto CreateShaderModulePre(const VkShaderModuleCreateInfo *pCreateInfo)
+      -> ModuleLoad {
+    if (!Tracking())
+      return {};
+
+    // A module that's neither dumped nor loaded is never hashed.
+    bool capture = dumpConfigured && filter.checkSize(pCreateInfo->codeSize);
+    if (!capture && !MayOverride(pCreateInfo))
+      return {};
+
+    ModuleLoad ret{Hash(pCreateInfo)};
+    capture = capture && filter.checkHash(ret.hash);
+
+    // Copied before the code gets swapped, dumps are always of the original.
+    if (capture && (dumpEnable || Windowed()))
+      ret.code = Retain(pCreateInfo);
+
+    // Module creates never wait for an override, the pipeline creates that
+    // use the module do if they may.
+    if (loadEnable) {
+      ret.pinned = LoadShader(ret.hash, {}, &ret.overridePending);
+      ret.replaced = ret.pinned != nullptr;
+    }
+    return ret;
+  }
+
+  auto CreateShaderModulePost(DeviceShaders &device,
+                              VkShaderModule shaderModule, ModuleLoad &&load)
+      -> void {
+    if (load.hash.empty())
+      return;
 
-    if (!(dumpEnable || loadEnable))
+    load.pinned.reset();
+    scoped_lock l(device.lock);
+    device.shaderModules[shaderModule] = std::move(load);
+  }
+
+  auto DestroyShaderModule(DeviceShaders &device, VkShaderModule shaderModule)
+      -> void {
+    if (!Tracking())
       return;
 
+    scoped_lock l(device.lock);
+    device.shaderModules.erase(shaderModule);
+  }
+
+  // One override per create info, nullptr for shaders that keep their code.
+  // Empty if none gets one.
+  auto CreateShadersEXT(uint32_t createInfoCount,
+                        const VkShaderCreateInfoEXT *pCreateInfos) -> Pinned {
+    Pinned pinned(util::Arena::resource());
+    if (!Tracking())
+      return pinned;
+
     for (size_t i = 0; i < createInfoCount; ++i) {
       auto constShaderInfo = &pCreateInfos[i];
 
-      if (dumpEnable)
-        DumpShader2<VkShaderCreateInfoEXT>(constShaderInfo,
-                                           constShaderInfo->stage);
+      // Driver binaries can be neither hashed as SPIR-V nor replaced.
+      if (constShaderInfo->codeType != VK_SHADER_CODE_TYPE_SPIRV_EXT)
+        continue;
+
+      bool capture = dumpEnable && Capture(constShaderInfo->stage,
+                                           constShaderInfo->codeSize);
+      if (!capture && !MayOverride(constShaderInfo))
+        continue;
+
+      auto hash = Hash(constShaderInfo);
+      auto spec = SpecHash(constShaderInfo->pSpecializationInfo);
 
-      if (loadEnable)
-        LoadShader<sourceType, VkShaderCreateInfoEXT>(constShaderInfo);
+      if (capture && filter.checkHash(hash))
+        DumpShader(constShaderInfo->pCode, constShaderInfo->codeSize,
+                   constShaderInfo->stage, hash,
+                   constShaderInfo->pSpecializationInfo, spec);
+
+      if (!loadEnable)
+        continue;
+      if (auto code = LoadShader(hash, spec)) {
+        pinned.resize(createInfoCount);
+        pinned[i] = std::move(code);
+      }
     }
+    return pinned;
   }
 
-  auto CreateGraphicsPipelines(uint32_t createInfoCount,
+  // Library creates are processed once, link creates only look up what their
+  // libraries already recorded.
+  auto CreateGraphicsPipelines(DeviceShaders &device, uint32_t createInfoCount,
                                const VkGraphicsPipelineCreateInfo *pCreateInfos)
-      -> void {
-    using sourceType = uint32_t;
+      -> PipelineBatch {
+    if (!Tracking())
+      return {};
 
-    if (!(dumpEnable || loadEnable))
-      return;
+    PipelineBatch batch;
+    batch.resize(createInfoCount);
 
     for (size_t i = 0; i < createInfoCount; i++) {
-      for (size_t j = 0; j < pCreateInfos[i].stageCount; j++) {
-        auto stage = pCreateInfos[i].pStages[j];
+      auto &info = pCreateInfos[i];
 
-        auto *next = reinterpret_cast<const VkBaseInStructure *>(stage.pNext);
+      // VK_KHR_pipeline_binary: the driver ignores the stages' code.
+      if (FindInChain<VkPipelineBinaryInfoKHR>(
+              info.pNext, VK_STRUCTURE_TYPE_PIPELINE_BINARY_INFO_KHR))
+        continue;
 
-        while (next) {
-          if (next->sType == VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO) {
-            auto constModuleInfo =
-                reinterpret_cast<const VkShaderModuleCreateInfo *>(next);
+      bool noWait =
+          PipelineFlags(info) &
+          VK_PIPELINE_CREATE_2_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_KHR;
+      for (size_t j = 0; j < info.stageCount; j++)
+        if (ProcessStage(device, info.pStages[j], batch, i, noWait))
+          batch.markReplaced(i);
 
-            if (dumpEnable)
-              DumpShader2<VkShaderModuleCreateInfo>(constModuleInfo,
-                                                    stage.stage);
+      MergeLibraries(
+          device,
+          FindInChain<VkPipelineLibraryCreateInfoKHR>(
+              info.pNext, VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR),
+          batch, i);
+    }
+    return batch;
+  }
 
-            if (loadEnable)
-              LoadShader<sourceType, VkShaderModuleCreateInfo>(constModuleInfo);
-          }
-          next = reinterpret_cast<const VkBaseInStructure *>(next->pNext);
-        }
+  auto CreateGraphicsPipelinesPost(
+      DeviceShaders &device, uint32_t createInfoCount,
+      const VkGraphicsPipelineCreateInfo *pCreateInfos,
+      const VkPipeline *pPipelines, PipelineBatch &&batch) -> void {
+    if (batch.shaders.empty())
+      return;
 
-        if (dumpEnable && shaderModules.contains(stage.module)) {
-          DumpShader(shaderModules[stage.module], stage.stage);
-        }
-      }
+    RecordPipelines(createInfoCount, pPipelines, batch);
+    scoped_lock l(device.lock);
+    for (size_t i = 0; i < createInfoCount; i++) {
+      if (pPipelines[i] == VK_NULL_HANDLE ||
+          !(IsLibrary(pCreateInfos[i]) || Windowed()))
+        continue;
+
+      device.pipelines[pPipelines[i]] = {
+          {batch.shaders[i].begin(), batch.shaders[i].end()},
+          batch.pipelineReplaced[i] != 0};
     }
   }
 
-  auto CreateComputePipelines(uint32_t createInfoCount,
-                              const VkComputePipelineCreateInfo *pCreateInfos) {
-    using sourceType = uint32_t;
+  // Stages of a deferred create always wait for their overrides, it's the
+  // application's threads joining the operation that build them.
+  auto RayTracingStages(uint32_t createInfoCount,
+                        const VkRayTracingPipelineCreateInfoKHR *pCreateInfos,
+                        bool deferred) -> std::vector<RayTracingStage> {
+    auto stages = std::vector<RayTracingStage>();
+    if (!Tracking())
+      return stages;
+
+    for (uint32_t i = 0; i < createInfoCount; i++) {
+      auto &info = pCreateInfos[i];
+      if (FindInChain<VkPipelineBinaryInfoKHR>(
+              info.pNext, VK_STRUCTURE_TYPE_PIPELINE_BINARY_INFO_KHR))
+        continue;
 
-    if (!(dumpEnable || loadEnable))
+      bool noWait =
+          !deferred &&
+          (PipelineFlags(info) &
+           VK_PIPELINE_CREATE_2_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_KHR);
+      for (uint32_t j = 0; j < info.stageCount; j++)
+        stages.push_back({i, &info.pStages[j], noWait});
+    }
+    return stages;
+  }
+
+  // `batch` is sized to the create call, one per thread.
+  auto ProcessRayTracingStage(DeviceShaders &device,
+                              const RayTracingStage &stage,
+                              PipelineBatch &batch) -> void {
+    if (ProcessStage(device, *stage.stage, batch, stage.pipeline,
+                     stage.noWait))
+      batch.markReplaced(stage.pipeline);
+  }
+
+  // What linked libraries bring along, RayTracingStages() the rest. Empty
+  // if nothing is tracked.
+  auto CreateRayTracingPipelines(
+      DeviceShaders &device, uint32_t createInfoCount,
+      const VkRayTracingPipelineCreateInfoKHR *pCreateInfos,
+      std::pmr::memory_resource *memory = util::Arena::resource())
+      -> PipelineBatch {
+    if (!Tracking())
+      return {memory};
+
+    PipelineBatch batch(memory);
+    batch.resize(createInfoCount);
+    for (size_t i = 0; i < createInfoCount; i++)
+      MergeLibraries(device, pCreateInfos[i].pLibraryInfo, batch, i);
+    return batch;
+  }
+
+  auto CreateRayTracingPipelinesPost(
+      DeviceShaders &device, uint32_t createInfoCount,
+      const VkRayTracingPipelineCreateInfoKHR *pCreateInfos,
+      const VkPipeline *pPipelines, PipelineBatch &&batch) -> void {
+    if (batch.shaders.empty())
       return;
 
+    RecordPipelines(createInfoCount, pPipelines, batch);
+    scoped_lock l(device.lock);
     for (size_t i = 0; i < createInfoCount; i++) {
-      auto *next = reinterpret_cast<const VkBaseInStructure *>(
-          pCreateInfos[i].stage.pNext);
+      bool library =
+          PipelineFlags(pCreateInfos[i]) & VK_PIPELINE_CREATE_2_LIBRARY_BIT_KHR;
+      if (pPipelines[i] == VK_NULL_HANDLE || !(library || Windowed()))
+        continue;
+
+      device.pipelines[pPipelines[i]] = {
+          {batch.shaders[i].begin(), batch.shaders[i].end()},
+          batch.pipelineReplaced[i] != 0};
+    }
+  }
+
+  auto CreateComputePipelines(DeviceShaders &device, uint32_t createInfoCount,
+                              const VkComputePipelineCreateInfo *pCreateInfos)
+      -> PipelineBatch {
+    if (!Tracking())
+      return {};
+
+    PipelineBatch batch;
+    batch.resize(createInfoCount);
+
+    for (size_t i = 0; i < createInfoCount; i++) {
+      auto &info = pCreateInfos[i];
+
+      if (FindInChain<VkPipelineBinaryInfoKHR>(
+              info.pNext, VK_STRUCTURE_TYPE_PIPELINE_BINARY_INFO_KHR))
+        continue;
+
+      bool noWait =
+          PipelineFlags(info) &
+          VK_PIPELINE_CREATE_2_FAIL_ON_PIPELINE_COMPILE_REQUIRED_BIT_KHR;
+      if (ProcessStage(device, info.stage, batch, i, noWait))
+        batch.markReplaced(i);
+    }
+    return batch;
+  }
+
+  auto CreateComputePipelinesPost(DeviceShaders &device,
+                                  uint32_t createInfoCount,
+                                  const VkPipeline *pPipelines,
+                                  PipelineBatch &&batch) -> void {
+    if (batch.shaders.empty())
+      return;
+
+    RecordPipelines(createInfoCount, pPipelines, batch);
+    if (!Windowed())
+      return;
+
+    scoped_lock l(device.lock);
+    for (size_t i = 0; i < createInfoCount; i++)
+      if (pPipelines[i] != VK_NULL_HANDLE)
+        device.pipelines[pPipelines[i]] = {
+            {batch.shaders[i].begin(), batch.shaders[i].end()},
+            batch.pipelineReplaced[i] != 0};
+  }
+
+  template <typename T>
+  static auto FindInChain(const void *pNext, VkStructureType sType)
+      -> const T * {
+    auto *next = reinterpret_cast<const VkBaseInStructure *>(pNext);
+    while (next && next->sType != sType)
+      next = next->pNext;
+    return reinterpret_cast<const T *>(next);
+  }
+
+  // The flags of a pipeline create info, from its
+  // VkPipelineCreateFlags2CreateInfoKHR if it has one. The legacy bits have
+  // the same values.
+  template <typename CreateInfo>
+  static auto PipelineFlags(const CreateInfo &info)
+      -> VkPipelineCreateFlags2KHR {
+    if (auto flags2 = FindInChain<VkPipelineCreateFlags2CreateInfoKHR>(
+            info.pNext,
+            VK_STRUCTURE_TYPE_PIPELINE_CREATE_FLAGS_2_CREATE_INFO_KHR))
+      return flags2->flags;
+    return info.flags;
+  }
+
+  // A copy of a shader module or shader object create info with `code`
+  // instead of its own, for the driver.
+  template <typename CreateInfo>
+  static auto WithCode(const CreateInfo &info, const Overrides::Code &code)
+      -> CreateInfo {
+    auto patched = info;
+    patched.pCode = reinterpret_cast<decltype(patched.pCode)>(code->data());
+    patched.codeSize = code->size();
+    return patched;
+  }
+
+  auto DestroyPipeline(DeviceShaders &device, VkPipeline pipeline) -> void {
+    if (!Tracking())
+      return;
+
+    scoped_lock l(device.lock);
+    device.pipelines.erase(pipeline);
+  }
+
+protected:
+  // Shaders are tracked while they could still be dumped or replaced, so
+  // both can be switched on from the control socket at any time.
+  auto Tracking() const -> bool { return dumpConfigured || loadEnable; }
+
+  // Readers never lock: sets are only ever added and the current one is
+  // swapped atomically, older ones stay alive until the layer goes away.
+  auto PublishOverrides(std::unique_ptr<Overrides> set) -> size_t {
+    scoped_lock l(controlLock);
+
+    auto count = set->size();
+    if (deviceCreated && warmUpEnable)
+      set->warmUp();
+
+    overrides.store(overrideSets.emplace_back(std::move(set)).get(),
+                    std::memory_order_release);
+    loadEnable = count != 0;
+    return count;
+  }
+
+  auto ActiveOverrides() const -> const Overrides & {
+    static const Overrides none;
+    auto set = overrides.load(std::memory_order_acquire);
+    return set ? *set : none;
+  }
 
-      while (next) {
-        if (next->sType == VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO) {
-          auto constModuleInfo =
-              reinterpret_cast<const VkShaderModuleCreateInfo *>(next);
+  // Also drains the dump backlog of apps that never present.
+  auto ControlTick() -> void {
+    if (captureEnd && std::chrono::steady_clock::now() >= *captureEnd) {
+      dumpEnable = false;
+      captureEnd.reset();
+    }
+    FlushThrottled();
+  }
 
-          if (dumpEnable)
-            DumpShader2<VkShaderModuleCreateInfo>(constModuleInfo,
-                                                  pCreateInfos[i].stage.stage);
+  auto Status() const -> std::string {
+    return std::format(
+        "dump: {} {}\nload: {} ({} overrides)\nframe: {}\nshaders_seen: {}\n"
+        "shaders_dumped: {}\nshaders_replaced: {}\nbytes_written: {}\n"
+        "queue_depth: {}\ndump_backlog: {}\ncompile_required: {}\n",
+        dumpEnable ? "on" : "off", dumpPath, loadEnable ? "on" : "off",
+        ActiveOverrides().size(), frames.load(), counters.seen.load(),
+        counters.dumped.load(), counters.replaced.load(),
+        counters.bytesWritten.load(), counters.queueDepth.load(),
+        throttledCount.load(), counters.compileRequired.load()) +
+           PrefilterStatus() + codePool.status() + optimizer.status() +
+           filter.status();
+  }
 
-          if (loadEnable)
-            LoadShader<sourceType, VkShaderModuleCreateInfo>(constModuleInfo);
+  // The time saved is what hashing the skipped bytes would have taken at
+  // the rate measured for the hashed ones.
+  auto PrefilterStatus() const -> std::string {
+    auto skipped = counters.prefilterSkipped.load();
+    auto skippedBytes = counters.prefilterSkippedBytes.load();
+    auto hashed = counters.hashedBytes.load();
+    auto nsPerByte = hashed ? double(counters.hashNs.load()) / hashed : 0.0;
+
+    return std::format(
+        "hash_ms: {:.1f}\nprefilter_skipped: {} of {}\n"
+        "prefilter_saved_ms: {:.1f}\n",
+        counters.hashNs.load() / 1e6, skipped,
+        skipped + counters.seen.load(), skippedBytes * nsPerByte / 1e6);
+  }
+
+  // "N-M", or "N" for N onwards.
+  auto ParseFrameWindow(std::string_view frames) -> void {
+    auto number = [](std::string_view text, uint64_t &value) {
+      auto [end, ec] =
+          std::from_chars(text.data(), text.data() + text.size(), value);
+      return ec == std::errc() && end == text.data() + text.size();
+    };
+
+    auto dash = frames.find('-');
+    frameLast = UINT64_MAX;
+    bool valid = number(frames.substr(0, dash), frameFirst) &&
+                 (dash == std::string_view::npos ||
+                  number(frames.substr(dash + 1), frameLast)) &&
+                 frameFirst <= frameLast;
+
+    if (!valid) {
+      std::clog << "[VK_SHADER_GUTS][err]: VK_SHADER_GUTS_CAPTURE_FRAMES "
+                   "wants N-M, got "
+                << frames << "\n";
+      frameFirst = frameLast = 0;
+    }
+  }
+
+  // The dump filters that don't need the hash.
+  auto Capture(VkShaderStageFlagBits stage, size_t codeSize) -> bool {
+    return filter.checkStage(stage) && filter.checkSize(codeSize);
+  }
+
+  template <typename CreateInfo>
+  auto Retain(const CreateInfo *info) -> RetainedCode {
+    auto code = reinterpret_cast<const std::byte *>(info->pCode);
+    return std::make_shared<PooledCode>(
+        codePool, std::make_shared<const std::vector<std::byte>>(
+                      code, code + info->codeSize));
+  }
+
+  template <typename CreateInfo>
+  auto Hash(const CreateInfo *info) -> util::HexHash {
+    util::trace::Scope trace(util::trace::Type::hash, info->codeSize);
+    counters.seen.fetch_add(1, std::memory_order_relaxed);
+
+    auto start = std::chrono::steady_clock::now();
+    auto hash =
+        util::HexHash(util::Sha1Hash::compute(info->pCode, info->codeSize));
+    auto time = std::chrono::steady_clock::now() - start;
+
+    counters.hashNs.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+        std::memory_order_relaxed);
+    counters.hashedBytes.fetch_add(info->codeSize, std::memory_order_relaxed);
+    return hash;
+  }
+
+  // Whether a shader nobody dumps needs hashing to find its override.
+  template <typename CreateInfo>
+  auto MayOverride(const CreateInfo *info) -> bool {
+    if (!loadEnable)
+      return false;
+    if (ActiveOverrides().mayOverride(info->pCode, info->codeSize))
+      return true;
+
+    counters.prefilterSkipped.fetch_add(1, std::memory_order_relaxed);
+    counters.prefilterSkippedBytes.fetch_add(info->codeSize,
+                                             std::memory_order_relaxed);
+    return false;
+  }
+
+  // Specialization only becomes part of a shader's identity when variants
+  // are dumped or have overrides of their own.
+  auto SpecHash(const VkSpecializationInfo *info) const -> util::HexHash {
+    if (specDump == SpecDump::off &&
+        !(loadEnable && ActiveOverrides().hasVariants()))
+      return {};
+    return SpecializationHash(info);
+  }
+
+  static auto IsLibrary(const VkGraphicsPipelineCreateInfo &info) -> bool {
+    return (PipelineFlags(info) & VK_PIPELINE_CREATE_2_LIBRARY_BIT_KHR) ||
+           FindInChain<VkGraphicsPipelineLibraryCreateInfoEXT>(
+               info.pNext,
+               VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT);
+  }
+
+  // Graphics and ray-tracing pipelines share the shaders of the libraries they
+  // link, and whether any of those were replaced.
+  auto MergeLibraries(DeviceShaders &device,
+                      const VkPipelineLibraryCreateInfoKHR *libraries,
+                      PipelineBatch &batch, size_t index) -> void {
+    if (!libraries)
+      return;
+
+    scoped_lock l(device.lock);
+    for (uint32_t j = 0; j < libraries->libraryCount; ++j) {
+      auto it = device.pipelines.find(libraries->pLibraries[j]);
+      if (it == device.pipelines.end())
+        continue;
+
+      if (it->second.replaced)
+        batch.markReplaced(index);
+      batch.shaders[index].insert(batch.shaders[index].end(),
+                                  it->second.shaders.begin(),
+                                  it->second.shaders.end());
+    }
+  }
+
+  // Dumps/loads one stage and records its hash. Returns true if the stage
+  // ends up with replaced code. With `noWait` an override that isn't built
+  // yet marks the pipeline in batch.compileRequired instead of blocking.
+  auto ProcessStage(DeviceShaders &device,
+                    const VkPipelineShaderStageCreateInfo &stage,
+                    PipelineBatch &batch, size_t index, bool noWait) -> bool {
+    bool replaced = false;
+    bool pending = false;
+    auto *wait = noWait ? &pending : nullptr;
+    auto spec = SpecHash(stage.pSpecializationInfo);
+
+    if (auto moduleInfo = FindInChain<VkShaderModuleCreateInfo>(
+            stage.pNext, VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO)) {
+      bool capture =
+          dumpConfigured && Capture(stage.stage, moduleInfo->codeSize);
+      if (!capture && !MayOverride(moduleInfo))
+        return replaced;
+
+      auto hash = Hash(moduleInfo);
+      capture = capture && filter.checkHash(hash);
+
+      auto code = RetainedCode();
+      if (capture && dumpEnable)
+        DumpShader(moduleInfo->pCode, moduleInfo->codeSize, stage.stage, hash,
+                   stage.pSpecializationInfo, spec);
+      else if (capture && Windowed())
+        code = Retain(moduleInfo);
+
+      if (loadEnable) {
+        if (auto code = LoadShader(hash, spec, wait)) {
+          batch.patches.push_back({&stage, index, std::move(code)});
+          replaced = true;
         }
-        next = reinterpret_cast<const VkBaseInStructure *>(next->pNext);
+        if (pending)
+          CompileRequired(batch, index);
       }
 
-      auto stage = pCreateInfos[i].stage;
-      if (dumpEnable && shaderModules.contains(stage.module)) {
-        DumpShader(shaderModules[stage.module], stage.stage);
+      batch.shaders[index].push_back(
+          {stage.stage, std::move(hash), spec, std::move(code)});
+    }
+
+    if (stage.module == VK_NULL_HANDLE)
+      return replaced;
+
+    auto hash = util::HexHash();
+    auto code = RetainedCode();
+    bool overridePending = false;
+    {
+      scoped_lock l(device.lock);
+      auto it = device.shaderModules.find(stage.module);
+      if (it == device.shaderModules.end())
+        return replaced;
+
+      // Modules created while dumping was off have no code to dump, nor
+      // those the size and hash filters turned down.
+      if (it->second.code && filter.checkStage(stage.stage))
+        code = it->second.code;
+
+      hash = it->second.hash;
+      replaced |= it->second.replaced;
+      overridePending = it->second.overridePending;
+    }
+
+    // Checked first, a spilled module isn't read back to be turned down.
+    if (code && dumpEnable) {
+      if (!Dumped(stage.stage, hash, spec))
+        if (auto original = code->get())
+          DumpShader(original->data(), original->size(), stage.stage, hash,
+                     stage.pSpecializationInfo, spec);
+      code.reset();
+
+      // Other variants may still need the code, a plain module is done.
+      if (!IsVariant(spec)) {
+        scoped_lock l(device.lock);
+        if (auto it = device.shaderModules.find(stage.module);
+            it != device.shaderModules.end())
+          it->second.code.reset();
       }
+    } else if (!Windowed())
+      code.reset();
+
+    // A variant's override, or the module's own one if that wasn't built
+    // when the module was created, gets a module of its own.
+    if (loadEnable) {
+      auto &active = ActiveOverrides();
+      auto code = active.findVariant(hash, spec, wait);
+      if (!code && !pending && overridePending)
+        code = active.find(hash, wait);
+
+      if (code) {
+        counters.replaced.fetch_add(1, std::memory_order_relaxed);
+        batch.patches.push_back({&stage, index, std::move(code)});
+        replaced = true;
+      } else if (pending)
+        CompileRequired(batch, index);
     }
+
+    batch.shaders[index].push_back(
+        {stage.stage, std::move(hash), spec, std::move(code)});
+    return replaced;
   }
 
-protected:
-  template <typename T, typename CreateInfo>
-  auto LoadShader(const CreateInfo *info) -> void {
-    if (util::Sha1Hash::compute(
-            reinterpret_cast<const std::byte *>(info->pCode),
-            info->codeSize * sizeof(std::byte))
-            .toString() != loadHash)
+  // Edges of pipelines.idx. A pipeline is known by the hash of its stages,
+  // sorted, as deferred creates find them in any order. Pipelines created
+  // again with the same stages are recorded once.
+  auto RecordPipelines(uint32_t createInfoCount, const VkPipeline *pPipelines,
+                       const PipelineBatch &batch) -> void {
+    if (!dumpConfigured)
       return;
 
-    auto shaderInfo = const_cast<CreateInfo *>(info);
-    switch (loadLang) {
-    case ShaderLanguage::spirv:
-      currentShader = util::LoadSPRV(loadPath);
-      break;
+    auto stages = Scratch<const ShaderRef *>(batch.memory());
+    auto chunks = Scratch<util::Sha1Hash::Sha1Data>(batch.memory());
+    for (size_t i = 0; i < createInfoCount && i < batch.shaders.size(); i++) {
+      if (pPipelines[i] == VK_NULL_HANDLE || batch.shaders[i].empty())
+        continue;
 
-    case ShaderLanguage::glsl:
-      auto glslShader = util::LoadFile(loadPath);
-      auto glslType = util::shaders::findShaderType(loadPath);
-      auto glslVersion = util::shaders::findGLSLVersion(glslShader);
+      stages.clear();
+      for (const auto &shader : batch.shaders[i])
+        stages.push_back(&shader);
+      std::ranges::sort(stages, {}, [](const ShaderRef *shader) {
+        return std::tuple(shader->stage, shader->hash.view(),
+                          shader->spec.view());
+      });
 
-      if (!glslType) {
-        std::cerr << glslType.error();
-        return;
+      // Most creates are of pipelines seen before, those stop here.
+      auto fingerprint = PipelineFingerprint(stages);
+      {
+        std::shared_lock<std::shared_mutex> l(recordedLock);
+        if (recordedPipelines.contains(fingerprint))
+          continue;
       }
-      if (!glslVersion) {
-        std::cerr << glslVersion.error();
-        return;
+      {
+        std::unique_lock<std::shared_mutex> l(recordedLock);
+        if (!recordedPipelines.insert(fingerprint).second)
+          continue;
       }
 
-      currentShader = util::shaders::compileGLSL(
-          {glslShader, glslVersion.value(), glslType.value()});
+      chunks.clear();
+      for (auto shader : stages) {
+        auto hash = shader->hash.view();
+        auto spec = shader->spec.view();
+        chunks.push_back({&shader->stage, sizeof(shader->stage)});
+        chunks.push_back({hash.data(), hash.size()});
+        chunks.push_back({spec.data(), spec.size()});
+      }
+      auto pipeline = util::PipelineIndex::key(util::HexHash(
+          util::Sha1Hash::compute(chunks.size(), chunks.data())));
+      if (!pipeline)
+        continue;
 
-      break;
+      scoped_lock l(lock);
+      for (auto shader : stages)
+        if (auto hash = util::PipelineIndex::key(shader->hash))
+          pipelineEdges.push_back(
+              {*pipeline, *hash, uint32_t(shader->stage)});
     }
+  }
 
-    shaderInfo->pCode = reinterpret_cast<T *>(currentShader.data());
-    shaderInfo->codeSize = currentShader.size();
+  // FNV-1a of the sorted stages. Only tells recorded pipelines apart, the
+  // index itself keys them by SHA-1.
+  static auto PipelineFingerprint(std::span<const ShaderRef *const> stages)
+      -> uint64_t {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](std::span<const std::byte> bytes) {
+      for (auto byte : bytes)
+        hash = (hash ^ uint8_t(byte)) * 0x100000001b3ull;
+    };
+    for (auto shader : stages) {
+      mix(std::as_bytes(std::span(&shader->stage, 1)));
+      mix(std::as_bytes(std::span(shader->hash.view())));
+      mix(std::as_bytes(std::span(shader->spec.view())));
+    }
+    return hash;
   }
 
-  template <typename CreateInfo>
-  auto DumpShader2(const CreateInfo *info, const VkShaderStageFlagBits stage)
-      -> void {
-    auto shaderCode = std::vector<std::byte>(info->codeSize);
-    std::memcpy(shaderCode.data(), info->pCode, info->codeSize);
-    DumpShader(shaderCode, stage);
+  auto CompileRequired(PipelineBatch &batch, size_t index) -> void {
+    if (!batch.compileRequired[index])
+      counters.compileRequired.fetch_add(1, std::memory_order_relaxed);
+    batch.compileRequired[index] = 1;
+  }
+
+  // Returns the replacement, to be kept until the driver is done with it.
+  // With `pending` it doesn't wait for an override that's still being built,
+  // it sets `pending` and leaves the shader as it is.
+  auto LoadShader(const util::HexHash &hash, const util::HexHash &spec,
+                  bool *pending = nullptr) -> Overrides::Code {
+    // An override of this very variant wins over one of the whole module.
+    auto code = ActiveOverrides().findVariant(hash, spec, pending);
+    if (!code && !(pending && *pending))
+      code = ActiveOverrides().find(hash, pending);
+    if (!code)
+      return nullptr;
+
+    counters.replaced.fetch_add(1, std::memory_order_relaxed);
+    util::trace::record(util::trace::Type::overrideHit,
+                        util::trace::Phase::instant,
+                        util::trace::hashArg(hash));
+    return code;
   }
 
-  auto DumpShader(const std::vector<std::byte> &shader,
-                  const VkShaderStageFlagBits stage) -> void {
-    const auto folder = std::string("/" + stageToName[stage] + "/");
-    const auto hash =
-        util::Sha1Hash::compute(shader.data(), shader.size()).toString();
+  auto DumpShader(const void *code, size_t size,
+                  const VkShaderStageFlagBits stage, const util::HexHash &hash,
+                  const VkSpecializationInfo *specInfo,
+                  const util::HexHash &spec) -> void {
+    counters.queueDepth.fetch_add(1, std::memory_order_relaxed);
+    {
+      scoped_lock l(lock);
+      DumpShaderLocked(code, size, stage, hash, specInfo, spec);
+    }
+    counters.queueDepth.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  auto IsVariant(const util::HexHash &spec) const -> bool {
+    return specDump != SpecDump::off && !spec.empty();
+  }
+
+  // `/<folder>/<hash>[-<spec hash>]`, built in `buffer` so that turning
+  // down a shader that was already dumped doesn't allocate.
+  using DumpKeyBuffer = std::array<char, 128>;
+  auto DumpKey(VkShaderStageFlagBits stage, const util::HexHash &hash,
+               const util::HexHash &spec, DumpKeyBuffer &buffer) const
+      -> std::string_view {
+    size_t length = 0;
+    auto append = [&](std::string_view part) {
+      part = part.substr(0, buffer.size() - length);
+      std::ranges::copy(part, buffer.data() + length);
+      length += part.size();
+    };
+    append("/");
+    append(util::stageInfo(stage).folder);
+    append("/");
+    append(hash);
+    if (IsVariant(spec)) {
+      append("-");
+      append(spec);
+    }
+    return {buffer.data(), length};
+  }
+
+  auto Dumped(VkShaderStageFlagBits stage, const util::HexHash &hash,
+              const util::HexHash &spec) -> bool {
+    DumpKeyBuffer buffer;
+    auto key = DumpKey(stage, hash, spec, buffer);
+    scoped_lock l(lock);
+    return dumped.contains(key);
+  }
+
+  // Every (stage, hash) is written once, no matter how many pipelines use it.
+  // With VK_SHADER_GUTS_DUMP_SPEC each specialized variant is written once,
+  // as `<hash>-<spec hash>` next to a `.spec` file with its constants.
+  auto DumpShaderLocked(const void *code, size_t size,
+                        const VkShaderStageFlagBits stage,
+                        const util::HexHash &hash,
+                        const VkSpecializationInfo *specInfo,
+                        const util::HexHash &spec) -> void {
+    DumpKeyBuffer buffer;
+    auto key = DumpKey(stage, hash, spec, buffer);
+    if (dumped.contains(key))
+      return;
+    dumped.emplace(key);
+
+    // Older ones first, and this one waits behind them.
+    if (!FlushThrottledLocked() || !filter.takeBytes(size)) {
+      Throttle(code, size, stage, hash, specInfo, spec);
+      return;
+    }
+    WriteDumpLocked(code, size, stage, hash, specInfo, spec);
+  }
+
+  auto WriteDumpLocked(const void *code, size_t size,
+                       const VkShaderStageFlagBits stage,
+                       const util::HexHash &hash,
+                       const VkSpecializationInfo *specInfo,
+                       const util::HexHash &spec) -> void {
+    const auto &info = util::stageInfo(stage);
+    const auto folder = "/" + std::string(info.folder) + "/";
+    const bool variant = IsVariant(spec);
+    const auto name = variant ? Overrides::variantKey(hash, spec) : hash.str();
+
+    util::trace::Scope trace(util::trace::Type::dump,
+                             util::trace::hashArg(hash));
 
     if (!std::filesystem::exists(this->dumpPath + folder))
       std::filesystem::create_directory(dumpPath + folder);
 
+    auto shader = std::span(static_cast<const std::byte *>(code), size);
+    auto baked = std::vector<std::byte>();
+
+    if (variant) {
+      if (std::ofstream file(dumpPath + folder + name + ".spec");
+          file.is_open())
+        file << SpecializationText(*specInfo);
+
+      if (specDump == SpecDump::bake) {
+        baked = Specialize(shader, *specInfo);
+        shader = baked;
+      }
+    }
+
+    auto original = std::span(static_cast<const std::byte *>(code), size);
+    costIndex.push_back({std::string(info.folder), name,
+                         util::spirv::analyze(shader), size,
+                         util::spirv::signature(original)});
+
+    auto file = dumpPath + folder + name + "." + std::string(info.ext);
+
     switch (dumpLang) {
     case ShaderLanguage::glsl:
-      util::SaveGLSLToFile(
-          shader, {dumpPath + folder + hash + "." + stageToFileExt[stage]});
-      break;
+      if (util::glsl::Plugin::get().saveToFile(shader, file))
+        break;
+      [[fallthrough]]; // no core library, keep the SPIR-V at least
     case ShaderLanguage::spirv:
-      util::SaveSPVToFile<std::byte>(shader,
-                                     {dumpPath + folder + hash + ".glsl"});
+      file = dumpPath + folder + name + ".spv";
+      util::SaveBinaryFile(shader, file);
       break;
     }
+
+    std::error_code ec;
+    auto bytes = std::filesystem::file_size(file, ec);
+    counters.dumped.fetch_add(1, std::memory_order_relaxed);
+    counters.bytesWritten.fetch_add(ec ? 0 : bytes, std::memory_order_relaxed);
+  }
+
+  // A dump over VK_SHADER_GUTS_DUMP_RATE, kept until there's room for it.
+  // The code goes to the code pool, so the backlog counts against
+  // VK_SHADER_GUTS_MEMORY_BUDGET and spills like everything else.
+  struct ThrottledDump {
+    VkShaderStageFlagBits stage;
+    util::HexHash hash;
+    util::HexHash spec;
+    RetainedCode code;
+    std::vector<VkSpecializationMapEntry> entries;
+    std::vector<std::byte> constants;
+  };
+
+  auto Throttle(const void *code, size_t size,
+                const VkShaderStageFlagBits stage, const util::HexHash &hash,
+                const VkSpecializationInfo *specInfo,
+                const util::HexHash &spec) -> void {
+    auto bytes = static_cast<const std::byte *>(code);
+    auto &dump = throttled.emplace_back(ThrottledDump{
+        stage, hash, spec,
+        std::make_shared<PooledCode>(
+            codePool,
+            std::make_shared<const std::vector<std::byte>>(bytes,
+                                                           bytes + size))});
+    if (specInfo) {
+      auto data = static_cast<const std::byte *>(specInfo->pData);
+      dump.entries.assign(specInfo->pMapEntries,
+                          specInfo->pMapEntries + specInfo->mapEntryCount);
+      dump.constants.assign(data, data + specInfo->dataSize);
+    }
+    throttledCount.store(throttled.size(), std::memory_order_relaxed);
+  }
+
+  // Writes what the rate limit held back, oldest first, for as long as it
+  // lets through. With `all` regardless of it. Returns whether the backlog
+  // is empty.
+  auto FlushThrottledLocked(bool all = false) -> bool {
+    while (!throttled.empty()) {
+      auto &dump = throttled.front();
+      auto code = dump.code->get();
+      if (code && !all && !filter.takeBytes(code->size()))
+        return false;
+
+      if (code) {
+        VkSpecializationInfo specInfo{uint32_t(dump.entries.size()),
+                                      dump.entries.data(),
+                                      dump.constants.size(),
+                                      dump.constants.data()};
+        WriteDumpLocked(code->data(), code->size(), dump.stage, dump.hash,
+                        dump.entries.empty() ? nullptr : &specInfo,
+                        dump.spec);
+      }
+      throttled.pop_front();
+      throttledCount.store(throttled.size(), std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  auto FlushThrottled(bool all = false) -> void {
+    if (!throttledCount.load(std::memory_order_relaxed))
+      return;
+    scoped_lock l(lock);
+    FlushThrottledLocked(all);
   }
 
   auto PrintLogs() -> void {
@@ -219,8 +1230,32 @@ protected:
                 << loadPath << "\n";
       std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_LOAD_HASH = "
                 << loadHash << "\n";
+      std::clog << "[VK_SHADER_GUTS][log]: Overrides: "
+                << ActiveOverrides().size()
+                << (warmUpEnable ? " (warm-up)" : "") << "\n";
+      if (!pipelineCacheDir.empty())
+        std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_PIPELINE_CACHE = "
+                  << pipelineCacheDir << "\n";
     }
 
+    if (frameLast)
+      std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_CAPTURE_FRAMES = "
+                << frameFirst << "-"
+                << (frameLast == UINT64_MAX ? "" : std::to_string(frameLast))
+                << "\n";
+    if (dumpConfigured && !captureTrigger.empty())
+      std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_CAPTURE_TRIGGER = "
+                << captureTrigger << "\n";
+
+    if (dumpConfigured)
+      filter.printLogs();
+    codePool.printLogs();
+    optimizer.printLogs();
+
+    if (dumpEnable && specDump != SpecDump::off)
+      std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_DUMP_SPEC = "
+                << (specDump == SpecDump::bake ? "bake" : "raw") << "\n";
+
     // FIXME:
     if (loadLang != ShaderLanguage::spirv) {
       std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_LOAD_LANG = glsl \n";
@@ -228,38 +1263,77 @@ protected:
   }
 
 private:
-  bool dumpEnable;
-  bool loadEnable;
+  using scoped_lock = std::lock_guard<std::mutex>;
+
+  bool dumpConfigured = false;
+  std::atomic<bool> dumpEnable = false;
+  std::atomic<bool> loadEnable = false;
+  bool warmUpEnable;
   std::string dumpPath;
   std::string loadPath;
   std::string loadHash;
+  std::string pipelineCacheDir;
+  std::string shaderBinaryCacheDir;
+
+  // Capture window, fixed once constructed. frameLast == 0 means no range.
+  uint64_t frameFirst = 0;
+  uint64_t frameLast = 0;
+  std::string captureTrigger;
+  static constexpr uint64_t triggerInterval = 16;
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<bool> windowOpen = false;
+  std::atomic<bool> triggerHeld = false;
+
+  CaptureFilter filter;
 
   ShaderLanguage dumpLang;
   ShaderLanguage loadLang;
+  SpecDump specDump = SpecDump::off;
 
-  // Keep the shader until it loads up into the driver.
-  std::vector<std::byte> currentShader;
-
-  std::map<VkShaderModule, std::vector<std::byte>> shaderModules;
-  std::map<VkShaderStageFlagBits, std::string> stageToName{
-      {VK_SHADER_STAGE_VERTEX_BIT, "VS"},
-      {VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT, "TS_Control"},
-      {VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT, "TS_evaluation"},
-      {VK_SHADER_STAGE_GEOMETRY_BIT, "GS"},
-      {VK_SHADER_STAGE_FRAGMENT_BIT, "FS"},
-      {VK_SHADER_STAGE_COMPUTE_BIT, "CS"},
-  };
+  // Before everything that keeps pooled code, so it goes away last.
+  CodePool codePool;
+  OverrideOptimizer optimizer;
 
-  std::map<VkShaderStageFlagBits, std::string> stageToFileExt{
-      {VK_SHADER_STAGE_VERTEX_BIT, "vert"},
-      {VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT, "tesc"},
-      {VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT, "tese"},
-      {VK_SHADER_STAGE_GEOMETRY_BIT, "geom"},
-      {VK_SHADER_STAGE_FRAGMENT_BIT, "frag"},
-      {VK_SHADER_STAGE_COMPUTE_BIT, "comp"},
-  };
+  // Owns the replacement code handed to the driver. Only the control socket
+  // and device creation take controlLock.
+  std::mutex controlLock;
+  std::atomic<Overrides *> overrides = nullptr;
+  std::vector<std::unique_ptr<Overrides>> overrideSets;
+  bool deviceCreated = false;
+  std::optional<std::chrono::steady_clock::time_point> captureEnd;
+
+  struct Counters {
+    std::atomic<uint64_t> seen = 0;
+    std::atomic<uint64_t> dumped = 0;
+    std::atomic<uint64_t> replaced = 0;
+    std::atomic<uint64_t> bytesWritten = 0;
+    std::atomic<uint64_t> queueDepth = 0;
+    std::atomic<uint64_t> hashNs = 0;
+    std::atomic<uint64_t> hashedBytes = 0;
+    std::atomic<uint64_t> prefilterSkipped = 0;
+    std::atomic<uint64_t> prefilterSkippedBytes = 0;
+    std::atomic<uint64_t> compileRequired = 0;
+  } counters;
+
+  // Guards the dump directory, loading needs no lock. Taken after a
+  // device's lock, never before.
+  std::mutex lock;
+  std::set<std::string, std::less<>> dumped;
+  std::deque<ThrottledDump> throttled;
+  std::atomic<size_t> throttledCount = 0;
+  // Written to <dump path>/index.csv once the instance goes away.
+  std::vector<util::spirv::IndexRow> costIndex;
+  std::vector<util::PipelineIndex::Edge> pipelineEdges;
+  // Fingerprints of the pipelines in pipelineEdges, checked without `lock`.
+  std::shared_mutex recordedLock;
+  std::unordered_set<uint64_t> recordedPipelines;
   std::map<std::string_view, ShaderLanguage> stringToSourceType{
       {"spirv", ShaderLanguage::spirv}, {"glsl", ShaderLanguage::glsl}};
+  std::map<std::string_view, SpecDump> stringToSpecDump{
+      {"off", SpecDump::off}, {"raw", SpecDump::raw}, {"bake", SpecDump::bake}};
+
+  // Last, its thread uses everything above.
+  std::unique_ptr<ControlServer> control;
 };
 
 }; // namespace impl
\ No newline at end of file
@@ -1,18 +1,169 @@
+#include "chain.hpp"
+#include "deferredWork.hpp"
 #include "guts.hpp"
+#include "pipelineCache.hpp"
+#include "procTable.hpp"
+#include "shaderBinaryCache.hpp"
+#include <atomic>
+#include <cstdlib>
 #include <memory>
 #include <mutex>
 
 using scoped_lock = std::lock_guard<std::mutex>;
 
-std::unique_ptr<impl::ShaderGuts> pShaderGuts;
+// Process-wide, shared by every instance and device, and only set up once:
+// the overrides, what was dumped and the index. Created by the first
+// vkCreateInstance, later instances find it as it is.
+impl::ShaderGuts &Guts() {
+  static impl::ShaderGuts guts;
+  return guts;
+}
+
 std::mutex global_lock;
-std::map<void *, VkLayerInstanceDispatchTable> instance_dispatch;
-std::map<void *, VkLayerDispatchTable> device_dispatch;
+
+struct InstanceState {
+  VkLayerInstanceDispatchTable dispatch;
+};
+
+// A ray-tracing create the application deferred. The threads joining the
+// operation process its stages, the last of them hands the same operation
+// to the driver, and joins go to the driver from then on.
+struct DeferredRayTracing {
+  VkDevice device;
+  VkDeferredOperationKHR operation;
+  VkPipelineCache pipelineCache;
+  uint32_t createInfoCount;
+  const VkRayTracingPipelineCreateInfoKHR *pCreateInfos;
+  const VkAllocationCallbacks *pAllocator;
+  VkPipeline *pPipelines;
+
+  std::vector<impl::ShaderGuts::RayTracingStage> stages;
+  impl::DeferredWork work{stages.size()};
+
+  std::mutex lock;
+  // The batch and the create info copies the driver gets, until the
+  // operation is destroyed. Merges into the batch happen under `lock`.
+  std::pmr::unsynchronized_pool_resource memory;
+  impl::ShaderGuts::PipelineBatch batch{&memory};
+
+  // Set by whoever completes the layer's share, read once work.completed().
+  bool driverDeferred = false;
+  VkResult result = VK_NOT_READY;
+  std::once_flag finished;
+};
+
+// Everything the layer keeps for one device. The caches are only opened once
+// the device needs them: the pipeline cache by the first create that uses an
+// override, the shader binary cache by the first vkCreateShadersEXT.
+struct DeviceState {
+  VkDevice device;
+  VkPhysicalDevice physicalDevice;
+  const VkLayerInstanceDispatchTable *instance;
+  VkLayerDispatchTable dispatch;
+  impl::ShaderGuts::DeviceShaders shaders;
+
+  std::once_flag pipelineCacheOnce;
+  std::unique_ptr<impl::PipelineCache> pipelineCache;
+  std::atomic<bool> pipelineCacheOpened = false;
+
+  std::once_flag shaderBinaryCacheOnce;
+  std::unique_ptr<impl::ShaderBinaryCache> shaderBinaryCache;
+
+  // Guarded by global_lock.
+  std::map<VkDeferredOperationKHR, std::unique_ptr<DeferredRayTracing>>
+      deferredRayTracing;
+};
+
+std::map<void *, std::unique_ptr<InstanceState>> instances;
+std::map<void *, std::unique_ptr<DeviceState>> devices;
 
 template <typename DispatchableType> void *GetKey(DispatchableType inst) {
   return *reinterpret_cast<void **>(inst);
 }
 
+// A handle whose instance or device wasn't created through the layer, or
+// was already destroyed. There is no next layer to call, so stop here
+// instead of calling through a null table.
+[[noreturn]] void UnknownHandle(const char *kind, void *key) {
+  std::clog << "[VK_SHADER_GUTS][err]: No " << kind << " for key " << key
+            << ", it wasn't created through the layer\n";
+  std::abort();
+}
+
+// Physical devices share the key of their instance.
+template <typename DispatchableType>
+VkLayerInstanceDispatchTable &InstanceDispatch(DispatchableType handle) {
+  scoped_lock l(global_lock);
+  auto it = instances.find(GetKey(handle));
+  if (it == instances.end())
+    UnknownHandle("instance", GetKey(handle));
+  return it->second->dispatch;
+}
+
+// Entries stay put until their device is destroyed, so the driver can be
+// called without holding the lock. Queues and command buffers share the key
+// of their device.
+template <typename DispatchableType>
+DeviceState &Device(DispatchableType handle) {
+  scoped_lock l(global_lock);
+  auto it = devices.find(GetKey(handle));
+  if (it == devices.end())
+    UnknownHandle("device", GetKey(handle));
+  return *it->second;
+}
+
+template <typename DispatchableType>
+VkLayerDispatchTable &DeviceDispatch(DispatchableType handle) {
+  return Device(handle).dispatch;
+}
+
+// Opens the layer's pipeline cache the first time a create needs it.
+impl::PipelineCache *LayerPipelineCache(DeviceState &state) {
+  std::call_once(state.pipelineCacheOnce, [&] {
+    VkPhysicalDeviceProperties properties;
+    state.instance->GetPhysicalDeviceProperties(state.physicalDevice,
+                                                &properties);
+
+    if (auto path = Guts().PipelineCachePath(properties.pipelineCacheUUID))
+      state.pipelineCache = std::make_unique<impl::PipelineCache>(
+          state.device, state.dispatch, *path);
+    state.pipelineCacheOpened.store(true, std::memory_order_release);
+  });
+  return state.pipelineCache.get();
+}
+
+// nullptr unless a create already opened it, never opens it.
+impl::PipelineCache *OpenedPipelineCache(DeviceState &state) {
+  if (!state.pipelineCacheOpened.load(std::memory_order_acquire))
+    return nullptr;
+  return state.pipelineCache.get();
+}
+
+impl::ShaderBinaryCache *LayerShaderBinaryCache(DeviceState &state) {
+  std::call_once(state.shaderBinaryCacheOnce, [&] {
+    auto &dispatch = state.dispatch;
+    auto binaryDir = Guts().ShaderBinaryCacheDir();
+    if (!binaryDir || !dispatch.CreateShadersEXT ||
+        !dispatch.GetShaderBinaryDataEXT ||
+        !state.instance->GetPhysicalDeviceProperties2)
+      return;
+
+    VkPhysicalDeviceShaderObjectPropertiesEXT shaderObject{};
+    shaderObject.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_OBJECT_PROPERTIES_EXT;
+
+    VkPhysicalDeviceProperties2 properties2{};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &shaderObject;
+    state.instance->GetPhysicalDeviceProperties2(state.physicalDevice,
+                                                 &properties2);
+
+    state.shaderBinaryCache = std::make_unique<impl::ShaderBinaryCache>(
+        state.device, dispatch, *binaryDir, shaderObject);
+  });
+  return state.shaderBinaryCache.get();
+}
+
 // Thanks to Baldurk for the initial layer implementation.
 // https://github.com/baldurk/sample_layer
 
@@ -45,6 +196,8 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateInstance(
       gpa(VK_NULL_HANDLE, "vkCreateInstance"));
 
   VkResult ret = createFunc(pCreateInfo, pAllocator, pInstance);
+  if (ret != VK_SUCCESS)
+    return ret;
 
   VkLayerInstanceDispatchTable dispatchTable;
   dispatchTable.GetInstanceProcAddr =
@@ -55,11 +208,18 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateInstance(
   dispatchTable.EnumerateDeviceExtensionProperties =
       reinterpret_cast<PFN_vkEnumerateDeviceExtensionProperties>(
           gpa(*pInstance, "vkEnumerateDeviceExtensionProperties"));
-
+  dispatchTable.GetPhysicalDeviceProperties =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceProperties>(
+          gpa(*pInstance, "vkGetPhysicalDeviceProperties"));
+  dispatchTable.GetPhysicalDeviceProperties2 =
+      reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2>(
+          gpa(*pInstance, "vkGetPhysicalDeviceProperties2"));
+
+  Guts();
   {
     scoped_lock l(global_lock);
-    pShaderGuts = std::make_unique<impl::ShaderGuts>(impl::ShaderGuts());
-    instance_dispatch[GetKey(*pInstance)] = dispatchTable;
+    instances[GetKey(*pInstance)] =
+        std::make_unique<InstanceState>(dispatchTable);
   }
 
   return VK_SUCCESS;
@@ -67,8 +227,21 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateInstance(
 
 VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyInstance(
     VkInstance instance, const VkAllocationCallbacks *pAllocator) {
-  scoped_lock l(global_lock);
-  instance_dispatch.erase(GetKey(instance));
+  auto state = std::unique_ptr<InstanceState>();
+  bool last = false;
+  {
+    scoped_lock l(global_lock);
+    if (auto node = instances.extract(GetKey(instance)))
+      state = std::move(node.mapped());
+    last = instances.empty();
+  }
+
+  if (state)
+    state->dispatch.DestroyInstance(instance, pAllocator);
+
+  // The process may well go on without Vulkan, or with a new instance.
+  if (last)
+    Guts().WriteIndex();
 }
 
 VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateDevice(
@@ -98,6 +271,8 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateDevice(
       gipa(VK_NULL_HANDLE, "vkCreateDevice"));
 
   VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
+  if (ret != VK_SUCCESS)
+    return ret;
 
   VkLayerDispatchTable dispatchTable;
 
@@ -111,69 +286,590 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateDevice(
   dispatchTable.CreateGraphicsPipelines =
       reinterpret_cast<PFN_vkCreateGraphicsPipelines>(
           gdpa(*pDevice, "vkCreateGraphicsPipelines"));
+  dispatchTable.DestroyShaderModule =
+      reinterpret_cast<PFN_vkDestroyShaderModule>(
+          gdpa(*pDevice, "vkDestroyShaderModule"));
+  dispatchTable.DestroyPipeline = reinterpret_cast<PFN_vkDestroyPipeline>(
+      gdpa(*pDevice, "vkDestroyPipeline"));
   dispatchTable.CreateShaderModule = reinterpret_cast<PFN_vkCreateShaderModule>(
       gdpa(*pDevice, "vkCreateShaderModule"));
   dispatchTable.CreateShadersEXT =
       (PFN_vkCreateShadersEXT)gdpa(*pDevice, "vkCreateShadersEXT");
+  dispatchTable.DestroyShaderEXT =
+      (PFN_vkDestroyShaderEXT)gdpa(*pDevice, "vkDestroyShaderEXT");
+  dispatchTable.GetShaderBinaryDataEXT = (PFN_vkGetShaderBinaryDataEXT)gdpa(
+      *pDevice, "vkGetShaderBinaryDataEXT");
+  dispatchTable.CreatePipelineCache =
+      reinterpret_cast<PFN_vkCreatePipelineCache>(
+          gdpa(*pDevice, "vkCreatePipelineCache"));
+  dispatchTable.DestroyPipelineCache =
+      reinterpret_cast<PFN_vkDestroyPipelineCache>(
+          gdpa(*pDevice, "vkDestroyPipelineCache"));
+  dispatchTable.GetPipelineCacheData =
+      reinterpret_cast<PFN_vkGetPipelineCacheData>(
+          gdpa(*pDevice, "vkGetPipelineCacheData"));
+  dispatchTable.MergePipelineCaches =
+      reinterpret_cast<PFN_vkMergePipelineCaches>(
+          gdpa(*pDevice, "vkMergePipelineCaches"));
+  dispatchTable.QueuePresentKHR = reinterpret_cast<PFN_vkQueuePresentKHR>(
+      gdpa(*pDevice, "vkQueuePresentKHR"));
+  dispatchTable.CmdBindPipeline = reinterpret_cast<PFN_vkCmdBindPipeline>(
+      gdpa(*pDevice, "vkCmdBindPipeline"));
+  dispatchTable.CreateRayTracingPipelinesKHR =
+      reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(
+          gdpa(*pDevice, "vkCreateRayTracingPipelinesKHR"));
+  dispatchTable.DeferredOperationJoinKHR =
+      reinterpret_cast<PFN_vkDeferredOperationJoinKHR>(
+          gdpa(*pDevice, "vkDeferredOperationJoinKHR"));
+  dispatchTable.GetDeferredOperationResultKHR =
+      reinterpret_cast<PFN_vkGetDeferredOperationResultKHR>(
+          gdpa(*pDevice, "vkGetDeferredOperationResultKHR"));
+  dispatchTable.GetDeferredOperationMaxConcurrencyKHR =
+      reinterpret_cast<PFN_vkGetDeferredOperationMaxConcurrencyKHR>(
+          gdpa(*pDevice, "vkGetDeferredOperationMaxConcurrencyKHR"));
+  dispatchTable.DestroyDeferredOperationKHR =
+      reinterpret_cast<PFN_vkDestroyDeferredOperationKHR>(
+          gdpa(*pDevice, "vkDestroyDeferredOperationKHR"));
+  auto state = std::make_unique<DeviceState>();
+  state->device = *pDevice;
+  state->physicalDevice = physicalDevice;
+  state->instance = &InstanceDispatch(physicalDevice);
+  state->dispatch = dispatchTable;
   {
     scoped_lock l(global_lock);
-    device_dispatch[GetKey(*pDevice)] = dispatchTable;
+    devices[GetKey(*pDevice)] = std::move(state);
   }
+  Guts().WarmUp();
 
   return VK_SUCCESS;
 }
 
 VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyDevice(
     VkDevice device, const VkAllocationCallbacks *pAllocator) {
-  scoped_lock l(global_lock);
+  auto state = std::unique_ptr<DeviceState>();
+  {
+    scoped_lock l(global_lock);
+    if (auto node = devices.extract(GetKey(device)))
+      state = std::move(node.mapped());
+  }
+  if (!state)
+    return;
 
-  device_dispatch.erase(GetKey(device));
+  if (auto layerCache = OpenedPipelineCache(*state))
+    layerCache->persistAndDestroy();
+  state->dispatch.DestroyDevice(device, pAllocator);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
 // Actual layer implementation
 
+// Pipelines with overridden shaders go into the layer's persistent cache, the
+// application's cache gets them merged in before it's read back.
+VkPipelineCache SwapPipelineCache(VkDevice device, VkPipelineCache appCache) {
+  auto layerCache = LayerPipelineCache(Device(device));
+  if (!layerCache || layerCache->handle() == VK_NULL_HANDLE)
+    return appCache;
+
+  if (appCache != VK_NULL_HANDLE)
+    layerCache->markDirty(appCache);
+  return layerCache->handle();
+}
+
+// Gives every stage with a variant override a module built from it. The
+// modules only live until DestroyModules(), after the create call.
+void CreateModules(VkDevice device, impl::ShaderGuts::StagePatches &patches) {
+  auto &dispatch = DeviceDispatch(device);
+
+  for (auto &patch : patches) {
+    if (patch.stage->module == VK_NULL_HANDLE)
+      continue;
+
+    VkShaderModuleCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    info.codeSize = patch.code->size();
+    info.pCode = reinterpret_cast<const uint32_t *>(patch.code->data());
+
+    if (dispatch.CreateShaderModule(device, &info, nullptr, &patch.module) !=
+        VK_SUCCESS)
+      patch.module = VK_NULL_HANDLE;
+  }
+}
+
+void DestroyModules(VkDevice device, impl::ShaderGuts::StagePatches &patches) {
+  auto &dispatch = DeviceDispatch(device);
+
+  for (auto &patch : patches)
+    if (patch.module != VK_NULL_HANDLE)
+      dispatch.DestroyShaderModule(device, patch.module, nullptr);
+}
+
+// `stage` with its module, or the code of its inline VkShaderModuleCreateInfo,
+// taken from `patch`. Left as it is if the module couldn't be created or the
+// code can't be reached in its chain.
+void PatchStage(VkPipelineShaderStageCreateInfo &stage,
+                const impl::ShaderGuts::StagePatch &patch,
+                std::pmr::memory_resource *memory) {
+  if (stage.module != VK_NULL_HANDLE) {
+    if (patch.module != VK_NULL_HANDLE)
+      stage.module = patch.module;
+    return;
+  }
+
+  auto moduleInfo = util::copyInChain<VkShaderModuleCreateInfo>(
+      stage.pNext, VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, memory);
+  if (!moduleInfo) {
+    std::clog << "[VK_SHADER_GUTS][err]: Can't replace the inline code of a "
+                 "stage, its pNext chain has structs unknown to the layer\n";
+    return;
+  }
+  *moduleInfo = impl::ShaderGuts::WithCode(*moduleInfo, patch.code);
+}
+
+// Copies of the application's create infos with every patch of the batch
+// applied, or the application's own if there are none. The copies come from
+// the batch's memory and live as long as it does.
+template <typename CreateInfo>
+const CreateInfo *
+PatchCreateInfos(uint32_t createInfoCount, const CreateInfo *pCreateInfos,
+                 const impl::ShaderGuts::PipelineBatch &batch) {
+  if (batch.patches.empty())
+    return pCreateInfos;
+
+  auto memory = batch.memory();
+  std::pmr::polymorphic_allocator<> alloc(memory);
+  auto infos = alloc.allocate_object<CreateInfo>(createInfoCount);
+  std::uninitialized_copy_n(pCreateInfos, createInfoCount, infos);
+
+  // Stage arrays are copied the first time one of their stages is patched.
+  constexpr bool compute =
+      std::is_same_v<CreateInfo, VkComputePipelineCreateInfo>;
+  auto stages = impl::ShaderGuts::Scratch<VkPipelineShaderStageCreateInfo *>(
+      createInfoCount, nullptr, util::Arena::resource());
+
+  for (const auto &patch : batch.patches) {
+    auto &info = infos[patch.pipeline];
+    if constexpr (compute) {
+      PatchStage(info.stage, patch, memory);
+    } else {
+      auto &copy = stages[patch.pipeline];
+      if (!copy) {
+        copy = alloc.allocate_object<VkPipelineShaderStageCreateInfo>(
+            info.stageCount);
+        std::uninitialized_copy_n(info.pStages, info.stageCount, copy);
+        info.pStages = copy;
+      }
+      auto index = patch.stage - pCreateInfos[patch.pipeline].pStages;
+      PatchStage(copy[index], patch, memory);
+    }
+  }
+  return infos;
+}
+
+// Creates only the pipelines whose overrides are ready and leaves
+// VK_NULL_HANDLE for the others, as a driver does for pipelines it can't
+// create without compiling. With EARLY_RETURN_ON_FAILURE nothing after the
+// first of them is created.
+template <typename CreateInfo, typename Create>
+VkResult CreateReadyPipelines(uint32_t createInfoCount,
+                              const CreateInfo *pCreateInfos,
+                              VkPipeline *pPipelines,
+                              const impl::ShaderGuts::PipelineBatch &batch,
+                              Create &&create) {
+  if (std::ranges::find(batch.compileRequired, 1) ==
+      batch.compileRequired.end())
+    return create(createInfoCount, pCreateInfos, pPipelines);
+
+  auto ready = impl::ShaderGuts::Scratch<CreateInfo>(util::Arena::resource());
+  auto slots = impl::ShaderGuts::Scratch<int32_t>(createInfoCount, -1,
+                                                  util::Arena::resource());
+  for (uint32_t i = 0; i < createInfoCount; ++i) {
+    auto flags = impl::ShaderGuts::PipelineFlags(pCreateInfos[i]);
+    if (batch.compileRequired[i]) {
+      if (flags & VK_PIPELINE_CREATE_2_EARLY_RETURN_ON_FAILURE_BIT_KHR)
+        break;
+      continue;
+    }
+
+    slots[i] = int32_t(ready.size());
+    ready.push_back(pCreateInfos[i]);
+
+    // Derivatives point at their base by index, which moved or is gone.
+    auto &info = ready.back();
+    if (info.basePipelineIndex < 0 ||
+        !(flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT))
+      continue;
+    info.basePipelineIndex = slots[info.basePipelineIndex];
+    if (info.basePipelineIndex >= 0)
+      continue;
+
+    // No longer a derivative, in whichever flags said it was.
+    info.flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+    if (impl::ShaderGuts::FindInChain<VkPipelineCreateFlags2CreateInfoKHR>(
+            info.pNext,
+            VK_STRUCTURE_TYPE_PIPELINE_CREATE_FLAGS_2_CREATE_INFO_KHR)) {
+      auto flags2 = util::copyInChain<VkPipelineCreateFlags2CreateInfoKHR>(
+          info.pNext, VK_STRUCTURE_TYPE_PIPELINE_CREATE_FLAGS_2_CREATE_INFO_KHR,
+          util::Arena::resource());
+      if (flags2) {
+        flags2->flags &= ~VK_PIPELINE_CREATE_2_DERIVATIVE_BIT_KHR;
+        continue;
+      }
+
+      // Can't be copied, the pipeline is left to the retry with its base.
+      ready.pop_back();
+      slots[i] = -1;
+      if (flags & VK_PIPELINE_CREATE_2_EARLY_RETURN_ON_FAILURE_BIT_KHR)
+        break;
+    }
+  }
+
+  auto handles = impl::ShaderGuts::Scratch<VkPipeline>(
+      ready.size(), VK_NULL_HANDLE, util::Arena::resource());
+  auto ret = ready.empty() ? VK_SUCCESS
+                           : create(uint32_t(ready.size()), ready.data(),
+                                    handles.data());
+
+  for (uint32_t i = 0; i < createInfoCount; ++i)
+    pPipelines[i] = slots[i] < 0 ? VK_NULL_HANDLE : handles[slots[i]];
+  return ret < 0 ? ret : VK_PIPELINE_COMPILE_REQUIRED;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyPipelineCache(
+    VkDevice device, VkPipelineCache pipelineCache,
+    const VkAllocationCallbacks *pAllocator) {
+  auto &state = Device(device);
+  if (auto layerCache = OpenedPipelineCache(state))
+    layerCache->untrack(pipelineCache);
+
+  state.dispatch.DestroyPipelineCache(device, pipelineCache, pAllocator);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_GetPipelineCacheData(
+    VkDevice device, VkPipelineCache pipelineCache, size_t *pDataSize,
+    void *pData) {
+  auto &state = Device(device);
+  if (auto layerCache = OpenedPipelineCache(state))
+    layerCache->mergeInto(pipelineCache);
+
+  return state.dispatch.GetPipelineCacheData(device, pipelineCache, pDataSize,
+                                             pData);
+}
+
+// ShaderGuts guards its own state, the global lock is only taken to find the
+// dispatch table so pipeline creation on other threads isn't serialized.
+
 VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateShaderModule(
     VkDevice device, const VkShaderModuleCreateInfo *pCreateInfo,
     const VkAllocationCallbacks *pAllocator, VkShaderModule *pShaderModule) {
-  scoped_lock l(global_lock);
-  pShaderGuts->CreateShaderModulePre(pCreateInfo);
-  auto ret = device_dispatch[GetKey(device)].CreateShaderModule(
-      device, pCreateInfo, pAllocator, pShaderModule);
-  pShaderGuts->CreateShaderModulePost(pCreateInfo, pShaderModule);
+  util::trace::Scope trace(util::trace::Type::moduleCreate,
+                           pCreateInfo->codeSize);
+  auto &state = Device(device);
+  auto load = Guts().CreateShaderModulePre(pCreateInfo);
+  auto info = load.pinned
+                  ? impl::ShaderGuts::WithCode(*pCreateInfo, load.pinned)
+                  : *pCreateInfo;
+  auto ret = state.dispatch.CreateShaderModule(device, &info, pAllocator,
+                                               pShaderModule);
+  if (ret == VK_SUCCESS)
+    Guts().CreateShaderModulePost(state.shaders, *pShaderModule,
+                                  std::move(load));
   return ret;
 }
 
+VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyShaderModule(
+    VkDevice device, VkShaderModule shaderModule,
+    const VkAllocationCallbacks *pAllocator) {
+  auto &state = Device(device);
+  Guts().DestroyShaderModule(state.shaders, shaderModule);
+  state.dispatch.DestroyShaderModule(device, shaderModule, pAllocator);
+}
+
 VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateShadersEXT(
     VkDevice device, uint32_t createInfoCount,
     const VkShaderCreateInfoEXT *pCreateInfos,
     const VkAllocationCallbacks *pAllocator, VkShaderEXT *pShaders) {
-  scoped_lock l(global_lock);
-  pShaderGuts->CreateShadersEXT(createInfoCount, pCreateInfos);
-  return device_dispatch[GetKey(device)].CreateShadersEXT(
-      device, createInfoCount, pCreateInfos, pAllocator, pShaders);
+  util::Arena::Scope scratch;
+  util::trace::Scope trace(util::trace::Type::shadersCreate, createInfoCount);
+  auto &state = Device(device);
+  auto pinned = Guts().CreateShadersEXT(createInfoCount, pCreateInfos);
+
+  auto infos = impl::ShaderGuts::Scratch<VkShaderCreateInfoEXT>(
+      util::Arena::resource());
+  if (!pinned.empty()) {
+    infos.assign(pCreateInfos, pCreateInfos + createInfoCount);
+    for (uint32_t i = 0; i < createInfoCount; ++i)
+      if (pinned[i])
+        infos[i] = impl::ShaderGuts::WithCode(infos[i], pinned[i]);
+    pCreateInfos = infos.data();
+  }
+
+  if (auto binaryCache = LayerShaderBinaryCache(state))
+    return binaryCache->create(createInfoCount, pCreateInfos, pAllocator,
+                               pShaders);
+
+  return state.dispatch.CreateShadersEXT(device, createInfoCount, pCreateInfos,
+                                         pAllocator, pShaders);
 }
 
 VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateGraphicsPipelines(
     VkDevice device, VkPipelineCache pipelineCache, uint32_t createInfoCount,
     const VkGraphicsPipelineCreateInfo *pCreateInfos,
     const VkAllocationCallbacks *pAllocator, VkPipeline *pPipelines) {
-  scoped_lock l(global_lock);
-  pShaderGuts->CreateGraphicsPipelines(createInfoCount, pCreateInfos);
-  return device_dispatch[GetKey(device)].CreateGraphicsPipelines(
-      device, pipelineCache, createInfoCount, pCreateInfos, pAllocator,
-      pPipelines);
+  util::Arena::Scope scratch;
+  util::trace::Scope trace(util::trace::Type::graphicsPipelines,
+                           createInfoCount);
+  auto &state = Device(device);
+  auto batch = Guts().CreateGraphicsPipelines(state.shaders, createInfoCount,
+                                              pCreateInfos);
+  if (batch.replaced)
+    pipelineCache = SwapPipelineCache(device, pipelineCache);
+
+  CreateModules(device, batch.patches);
+  auto ret = CreateReadyPipelines(
+      createInfoCount, PatchCreateInfos(createInfoCount, pCreateInfos, batch),
+      pPipelines, batch,
+      [&](uint32_t count, auto *infos, VkPipeline *handles) {
+        return state.dispatch.CreateGraphicsPipelines(
+            device, pipelineCache, count, infos, pAllocator, handles);
+      });
+  DestroyModules(device, batch.patches);
+
+  // Failed creates leave VK_NULL_HANDLE behind, the rest may be libraries.
+  Guts().CreateGraphicsPipelinesPost(state.shaders, createInfoCount,
+                                     pCreateInfos, pPipelines,
+                                     std::move(batch));
+  return ret;
 }
 
 VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateComputePipelines(
     VkDevice device, VkPipelineCache pipelineCache, uint32_t createInfoCount,
     const VkComputePipelineCreateInfo *pCreateInfos,
     const VkAllocationCallbacks *pAllocator, VkPipeline *pPipelines) {
+  util::Arena::Scope scratch;
+  util::trace::Scope trace(util::trace::Type::computePipelines,
+                           createInfoCount);
+  auto &state = Device(device);
+  auto batch = Guts().CreateComputePipelines(state.shaders, createInfoCount,
+                                             pCreateInfos);
+  if (batch.replaced)
+    pipelineCache = SwapPipelineCache(device, pipelineCache);
+
+  CreateModules(device, batch.patches);
+  auto ret = CreateReadyPipelines(
+      createInfoCount, PatchCreateInfos(createInfoCount, pCreateInfos, batch),
+      pPipelines, batch,
+      [&](uint32_t count, auto *infos, VkPipeline *handles) {
+        return state.dispatch.CreateComputePipelines(
+            device, pipelineCache, count, infos, pAllocator, handles);
+      });
+  DestroyModules(device, batch.patches);
+
+  Guts().CreateComputePipelinesPost(state.shaders, createInfoCount, pPipelines,
+                                    std::move(batch));
+  return ret;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_CreateRayTracingPipelinesKHR(
+    VkDevice device, VkDeferredOperationKHR deferredOperation,
+    VkPipelineCache pipelineCache, uint32_t createInfoCount,
+    const VkRayTracingPipelineCreateInfoKHR *pCreateInfos,
+    const VkAllocationCallbacks *pAllocator, VkPipeline *pPipelines) {
+  util::Arena::Scope scratch;
+  util::trace::Scope trace(util::trace::Type::rayTracingPipelines,
+                           createInfoCount);
+  bool deferred = deferredOperation != VK_NULL_HANDLE;
+  auto &state = Device(device);
+
+  // A deferred batch lives until the operation completes.
+  auto batch = Guts().CreateRayTracingPipelines(
+      state.shaders, createInfoCount, pCreateInfos,
+      deferred ? std::pmr::new_delete_resource() : util::Arena::resource());
+  if (batch.shaders.empty())
+    return state.dispatch.CreateRayTracingPipelinesKHR(
+        device, deferredOperation, pipelineCache, createInfoCount,
+        pCreateInfos, pAllocator, pPipelines);
+
+  auto stages =
+      Guts().RayTracingStages(createInfoCount, pCreateInfos, deferred);
+  if (deferred) {
+    auto create = std::make_unique<DeferredRayTracing>(
+        device, deferredOperation, pipelineCache, createInfoCount,
+        pCreateInfos, pAllocator, pPipelines, std::move(stages));
+    create->batch = std::move(batch);
+
+    scoped_lock l(global_lock);
+    state.deferredRayTracing[deferredOperation] = std::move(create);
+    return VK_OPERATION_DEFERRED_KHR;
+  }
+
+  for (auto &stage : stages)
+    Guts().ProcessRayTracingStage(state.shaders, stage, batch);
+  if (batch.replaced)
+    pipelineCache = SwapPipelineCache(device, pipelineCache);
+
+  CreateModules(device, batch.patches);
+  auto ret = CreateReadyPipelines(
+      createInfoCount, PatchCreateInfos(createInfoCount, pCreateInfos, batch),
+      pPipelines, batch,
+      [&](uint32_t count, auto *infos, VkPipeline *handles) {
+        return state.dispatch.CreateRayTracingPipelinesKHR(
+            device, VK_NULL_HANDLE, pipelineCache, count, infos, pAllocator,
+            handles);
+      });
+  DestroyModules(device, batch.patches);
+
+  Guts().CreateRayTracingPipelinesPost(state.shaders, createInfoCount,
+                                       pCreateInfos, pPipelines,
+                                       std::move(batch));
+  return ret;
+}
+
+DeferredRayTracing *FindDeferredRayTracing(DeviceState &state,
+                                           VkDeferredOperationKHR operation) {
   scoped_lock l(global_lock);
-  pShaderGuts->CreateComputePipelines(createInfoCount, pCreateInfos);
-  return device_dispatch[GetKey(device)].CreateComputePipelines(
-      device, pipelineCache, createInfoCount, pCreateInfos, pAllocator,
-      pPipelines);
+  auto it = state.deferredRayTracing.find(operation);
+  return it != state.deferredRayTracing.end() ? it->second.get() : nullptr;
+}
+
+// Every stage is processed, the driver gets the operation.
+void LaunchRayTracing(DeferredRayTracing &create) {
+  auto pipelineCache = create.batch.replaced
+                           ? SwapPipelineCache(create.device,
+                                               create.pipelineCache)
+                           : create.pipelineCache;
+
+  CreateModules(create.device, create.batch.patches);
+  auto ret = DeviceDispatch(create.device)
+                 .CreateRayTracingPipelinesKHR(
+                     create.device, create.operation, pipelineCache,
+                     create.createInfoCount,
+                     PatchCreateInfos(create.createInfoCount,
+                                      create.pCreateInfos, create.batch),
+                     create.pAllocator, create.pPipelines);
+
+  create.driverDeferred = ret == VK_OPERATION_DEFERRED_KHR;
+  create.result = ret == VK_OPERATION_NOT_DEFERRED_KHR ? VK_SUCCESS : ret;
+}
+
+// Once the driver is done, while the application's arrays are still valid.
+void FinishRayTracing(DeferredRayTracing &create) {
+  std::call_once(create.finished, [&] {
+    DestroyModules(create.device, create.batch.patches);
+    Guts().CreateRayTracingPipelinesPost(
+        Device(create.device).shaders, create.createInfoCount,
+        create.pCreateInfos, create.pPipelines, std::move(create.batch));
+  });
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_DeferredOperationJoinKHR(
+    VkDevice device, VkDeferredOperationKHR operation) {
+  auto &state = Device(device);
+  auto create = FindDeferredRayTracing(state, operation);
+  if (!create)
+    return state.dispatch.DeferredOperationJoinKHR(device, operation);
+
+  if (!create->work.completed()) {
+    util::Arena::Scope scratch;
+    util::trace::Scope trace(util::trace::Type::rayTracingPipelines);
+
+    impl::ShaderGuts::PipelineBatch found(std::pmr::new_delete_resource());
+    found.resize(create->createInfoCount);
+    bool complete = create->work.join(
+        [&](size_t i) {
+          Guts().ProcessRayTracingStage(state.shaders, create->stages[i],
+                                        found);
+        },
+        [&] {
+          scoped_lock l(create->lock);
+          create->batch.merge(std::move(found));
+        },
+        [&] { LaunchRayTracing(*create); });
+
+    // Others are still processing stages, there'll be more to join soon.
+    if (!complete)
+      return VK_THREAD_IDLE_KHR;
+  }
+
+  if (!create->driverDeferred) {
+    FinishRayTracing(*create);
+    return VK_SUCCESS;
+  }
+
+  auto ret = state.dispatch.DeferredOperationJoinKHR(device, operation);
+  if (ret == VK_SUCCESS)
+    FinishRayTracing(*create);
+  return ret;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_GetDeferredOperationResultKHR(
+    VkDevice device, VkDeferredOperationKHR operation) {
+  auto &state = Device(device);
+  auto create = FindDeferredRayTracing(state, operation);
+  if (!create)
+    return state.dispatch.GetDeferredOperationResultKHR(device, operation);
+  if (!create->work.completed())
+    return VK_NOT_READY;
+
+  auto ret = create->driverDeferred
+                 ? state.dispatch.GetDeferredOperationResultKHR(device,
+                                                                operation)
+                 : create->result;
+  if (ret != VK_NOT_READY)
+    FinishRayTracing(*create);
+  return ret;
+}
+
+VK_LAYER_EXPORT uint32_t VKAPI_CALL
+ShaderGuts_GetDeferredOperationMaxConcurrencyKHR(
+    VkDevice device, VkDeferredOperationKHR operation) {
+  auto &state = Device(device);
+  auto create = FindDeferredRayTracing(state, operation);
+  if (!create || (create->work.completed() && create->driverDeferred))
+    return state.dispatch.GetDeferredOperationMaxConcurrencyKHR(device,
+                                                                operation);
+
+  return create->work.completed() ? 0 : uint32_t(create->work.remaining());
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyDeferredOperationKHR(
+    VkDevice device, VkDeferredOperationKHR operation,
+    const VkAllocationCallbacks *pAllocator) {
+  auto &state = Device(device);
+  auto create = std::unique_ptr<DeferredRayTracing>();
+  {
+    scoped_lock l(global_lock);
+    if (auto node = state.deferredRayTracing.extract(operation))
+      create = std::move(node.mapped());
+  }
+
+  // Only complete operations may be destroyed.
+  if (create && create->work.completed())
+    FinishRayTracing(*create);
+
+  state.dispatch.DestroyDeferredOperationKHR(device, operation, pAllocator);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_DestroyPipeline(
+    VkDevice device, VkPipeline pipeline,
+    const VkAllocationCallbacks *pAllocator) {
+  auto &state = Device(device);
+  Guts().DestroyPipeline(state.shaders, pipeline);
+  state.dispatch.DestroyPipeline(device, pipeline, pAllocator);
+}
+
+// Only handed out with a capture window, see ShaderGuts::Windowed().
+VK_LAYER_EXPORT void VKAPI_CALL ShaderGuts_CmdBindPipeline(
+    VkCommandBuffer commandBuffer, VkPipelineBindPoint pipelineBindPoint,
+    VkPipeline pipeline) {
+  auto &state = Device(commandBuffer);
+  Guts().BindPipeline(state.shaders, pipeline);
+  state.dispatch.CmdBindPipeline(commandBuffer, pipelineBindPoint, pipeline);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL ShaderGuts_QueuePresentKHR(
+    VkQueue queue, const VkPresentInfoKHR *pPresentInfo) {
+  Guts().QueuePresent();
+  return DeviceDispatch(queue).QueuePresentKHR(queue, pPresentInfo);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -223,8 +919,7 @@ ShaderGuts_EnumerateDeviceExtensionProperties(
     if (physicalDevice == VK_NULL_HANDLE)
       return VK_SUCCESS;
 
-    scoped_lock l(global_lock);
-    return instance_dispatch[GetKey(physicalDevice)]
+    return InstanceDispatch(physicalDevice)
         .EnumerateDeviceExtensionProperties(physicalDevice, pLayerName,
                                             pPropertyCount, pProperties);
   }
@@ -238,51 +933,55 @@ ShaderGuts_EnumerateDeviceExtensionProperties(
 ///////////////////////////////////////////////////////////////////////////////////////////
 // GetProcAddr functions, entry points of the layer
 
-#define GETPROCADDR(func)                                                      \
-  if (!strcmp(pName, "vk" #func))                                              \
-    return (PFN_vkVoidFunction) & ShaderGuts_##func;
-
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
-ShaderGuts_GetDeviceProcAddr(VkDevice device, const char *pName) {
-  // device chain functions we intercept
-  GETPROCADDR(GetDeviceProcAddr);
-  GETPROCADDR(EnumerateDeviceLayerProperties);
-  GETPROCADDR(EnumerateDeviceExtensionProperties);
-  GETPROCADDR(CreateDevice);
-  GETPROCADDR(DestroyDevice);
+ShaderGuts_GetDeviceProcAddr(VkDevice device, const char *pName);
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
+ShaderGuts_GetInstanceProcAddr(VkInstance instance, const char *pName);
 
-  GETPROCADDR(CreateComputePipelines);
-  GETPROCADDR(CreateGraphicsPipelines);
+// What procTable.hpp names, in its order.
+#define PROC_ENTRY(func, scope)                                                \
+  ProcEntry{(PFN_vkVoidFunction) & ShaderGuts_##func, scope},
 
-  // Get shader
-  GETPROCADDR(CreateShaderModule);
-  GETPROCADDR(CreateShadersEXT);
+struct ProcEntry {
+  PFN_vkVoidFunction func;
+  uint8_t scope;
+};
 
-  {
-    scoped_lock l(global_lock);
-    return device_dispatch[GetKey(device)].GetDeviceProcAddr(device, pName);
+using enum impl::ProcScope;
+using impl::procHash;
+using impl::procNames;
+
+const std::array<ProcEntry, procNames.size()> procEntries{
+    SHADER_GUTS_PROCS(PROC_ENTRY)};
+
+const ProcEntry *FindProc(const char *pName, uint8_t scope) {
+  auto index = procHash.find(pName);
+  if (index == procHash.npos || !(procEntries[index].scope & scope))
+    return nullptr;
+  return &procEntries[index];
+}
+
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
+ShaderGuts_GetDeviceProcAddr(VkDevice device, const char *pName) {
+  uint8_t scope = deviceScope;
+  if (Guts().Windowed())
+    scope |= captureScope;
+
+  auto next = DeviceDispatch(device).GetDeviceProcAddr;
+  if (auto proc = FindProc(pName, scope)) {
+    // Our dispatch entry is null for extensions the app didn't enable.
+    if ((proc->scope & extensionScope) && !next(device, pName))
+      return nullptr;
+    return proc->func;
   }
+
+  return next(device, pName);
 }
 
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
 ShaderGuts_GetInstanceProcAddr(VkInstance instance, const char *pName) {
-  // instance chain functions we intercept
-  GETPROCADDR(GetInstanceProcAddr);
-  GETPROCADDR(EnumerateInstanceLayerProperties);
-  GETPROCADDR(EnumerateInstanceExtensionProperties);
-  GETPROCADDR(CreateInstance);
-  GETPROCADDR(DestroyInstance);
-
-  // device chain functions we intercept
-  GETPROCADDR(GetDeviceProcAddr);
-  GETPROCADDR(EnumerateDeviceLayerProperties);
-  GETPROCADDR(EnumerateDeviceExtensionProperties);
-  GETPROCADDR(CreateDevice);
-  GETPROCADDR(DestroyDevice);
+  if (auto proc = FindProc(pName, instanceScope))
+    return proc->func;
 
-  {
-    scoped_lock l(global_lock);
-    return instance_dispatch[GetKey(instance)].GetInstanceProcAddr(instance,
-                                                                   pName);
-  }
-}
\ No newline at end of file
+  return InstanceDispatch(instance).GetInstanceProcAddr(instance, pName);
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include "glslLoader.hpp"
+#include "spirvCost.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <mutex>
+#include <set>
+#include <unistd.h>
+
+namespace impl {
+
+// Runs every built override through spirv-opt before it replaces anything,
+// with the recipe from VK_SHADER_GUTS_LOAD_OPTIMIZE. Results are stored as
+// `<input sha1>-<recipe sha1>.spv` in VK_SHADER_GUTS_LOAD_OPTIMIZE_CACHE, so
+// an override is optimized once per recipe, across evictions and runs, and
+// a run that only hits the cache never loads the core library.
+class OverrideOptimizer {
+public:
+  OverrideOptimizer() {
+    if (!util::envContainsString("VK_SHADER_GUTS_LOAD_OPTIMIZE", recipe) ||
+        recipe.empty())
+      return;
+
+    recipeKey = util::Sha1Hash::compute(recipe.data(), recipe.size())
+                    .toString()
+                    .substr(0, 16);
+
+    auto dir = std::string();
+    if (util::envContainsString("VK_SHADER_GUTS_LOAD_OPTIMIZE_CACHE", dir))
+      cacheDir = dir;
+    else
+      cacheDir = std::filesystem::temp_directory_path() /
+                 "shader-guts-optimized";
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDir, ec);
+  }
+
+  OverrideOptimizer(const OverrideOptimizer &) = delete;
+  OverrideOptimizer &operator=(const OverrideOptimizer &) = delete;
+
+  auto enabled() const -> bool { return !recipe.empty(); }
+
+  // `code` optimized, or as it is if spirv-opt turned it down. `path` is only
+  // for the report.
+  auto optimize(std::vector<std::byte> code, const std::filesystem::path &path)
+      -> std::vector<std::byte> {
+    if (!enabled())
+      return code;
+
+    auto key = util::Sha1Hash::compute(code.data(), code.size()).toString() +
+               "-" + recipeKey;
+    auto file = cacheDir / (key + ".spv");
+
+    if (auto cached = util::LoadBinaryFile(file); util::isSPIRV(cached)) {
+      if (firstTime(key)) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        report(path, code, cached, "cached");
+      }
+      return cached;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto optimized = util::glsl::Plugin::get().optimize(code, recipe);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (!util::isSPIRV(optimized)) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+      std::clog << "[VK_SHADER_GUTS][err]: Can't optimize " << path
+                << ", it's loaded as it is\n";
+      return code;
+    }
+
+    // Written aside and renamed, so concurrent runs never read half a file.
+    auto tmp = file;
+    tmp += std::format(".{}.tmp", getpid());
+    util::SaveBinaryFile(optimized, tmp.string());
+    std::error_code ec;
+    std::filesystem::rename(tmp, file, ec);
+
+    if (firstTime(key)) {
+      optimizedCount.fetch_add(1, std::memory_order_relaxed);
+      auto elapsedNs = std::chrono::nanoseconds(elapsed).count();
+      ns.fetch_add(elapsedNs, std::memory_order_relaxed);
+      report(path, code, optimized, std::format("{:.2f} ms", elapsedNs / 1e6));
+    }
+    return optimized;
+  }
+
+  auto printLogs() const -> void {
+    if (enabled())
+      std::clog << "[VK_SHADER_GUTS][log]: VK_SHADER_GUTS_LOAD_OPTIMIZE = "
+                << recipe << " (cache " << cacheDir << ")\n";
+  }
+
+  auto status() const -> std::string {
+    if (!enabled())
+      return {};
+    return std::format(
+        "optimize: {}\noptimized: {}\noptimize_cache_hits: {}\n"
+        "optimize_failed: {}\noptimize_ms: {:.2f}\n"
+        "instructions_before: {}\ninstructions_after: {}\n",
+        recipe, optimizedCount.load(), hits.load(), failed.load(),
+        ns.load() / 1e6, before.load(), after.load());
+  }
+
+private:
+  // Overrides evicted from the CodePool come back through here, they're
+  // only reported the first time.
+  auto firstTime(const std::string &key) -> bool {
+    std::lock_guard<std::mutex> l(lock);
+    return reported.insert(key).second;
+  }
+
+  auto report(const std::filesystem::path &path,
+              std::span<const std::byte> original,
+              std::span<const std::byte> optimized, std::string_view time)
+      -> void {
+    auto from = util::spirv::analyze(original).instructions;
+    auto to = util::spirv::analyze(optimized).instructions;
+    before.fetch_add(from, std::memory_order_relaxed);
+    after.fetch_add(to, std::memory_order_relaxed);
+
+    std::clog << std::format("[VK_SHADER_GUTS][log]: Optimized {}: {} -> {} "
+                             "instructions ({:+.1f}%), {}\n",
+                             path.filename().string(), from, to,
+                             from ? 100.0 * (double(to) - from) / from : 0.0,
+                             time);
+  }
+
+  std::string recipe;
+  std::string recipeKey;
+  std::filesystem::path cacheDir;
+
+  std::mutex lock;
+  std::set<std::string> reported;
+
+  std::atomic<uint64_t> optimizedCount = 0;
+  std::atomic<uint64_t> hits = 0;
+  std::atomic<uint64_t> failed = 0;
+  std::atomic<uint64_t> ns = 0;
+  std::atomic<uint64_t> before = 0;
+  std::atomic<uint64_t> after = 0;
+};
+
+}; // namespace impl
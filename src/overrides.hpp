@@ -0,0 +1,351 @@
+#pragma once
+#include "codePool.hpp"
+#include "glslLoader.hpp"
+#include "overrideOptimizer.hpp"
+#include "prefilter.hpp"
+#include "threadPool.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <set>
+
+namespace impl {
+
+enum class ShaderLanguage { spirv, glsl };
+
+// The set of replacement shaders. Either a single file + hash, or a directory
+// of `<sha1>.spv` / `<sha1>.<stage ext>` files. `<sha1>-<spec sha1>.*` files
+// only replace the variant specialized with those constants. Entries are
+// fixed once constructed, so lookups never need the layer lock. Built code
+// goes through the OverrideOptimizer and lives in the CodePool, which may drop
+// it, it's rebuilt from the file then.
+//
+// GLSL overrides may #include headers. Which override included which header
+// is kept as a graph, so a set loaded over a previous one only rebuilds the
+// overrides whose file, or any header they include, changed.
+class Overrides {
+public:
+  using Code = PooledCode::Code;
+
+  Overrides() = default;
+
+  Overrides(const std::filesystem::path &loadPath, const std::string &loadHash,
+            ShaderLanguage loadLang, CodePool &codePool,
+            OverrideOptimizer &optimizer, const Overrides *previous = nullptr)
+      : codePool(&codePool), optimizer(&optimizer) {
+    namespace fs = std::filesystem;
+
+    if (!fs::is_directory(loadPath)) {
+      if (!loadHash.empty())
+        entries[loadHash] =
+            std::make_unique<Entry>(loadHash, loadPath, loadLang);
+      setKey = computeKey();
+      buildPrefilter(loadPath.parent_path());
+      if (previous)
+        adopt(*previous);
+      return;
+    }
+
+    for (const auto &file : fs::directory_iterator(loadPath)) {
+      if (!file.is_regular_file())
+        continue;
+
+      auto hash = file.path().stem().string();
+      if (!isHash(hash) && !isVariant(hash))
+        continue;
+      variants |= isVariant(hash);
+
+      auto lang = file.path().extension() == ".spv" ? ShaderLanguage::spirv
+                                                    : ShaderLanguage::glsl;
+      entries[hash] = std::make_unique<Entry>(hash, file.path(), lang);
+    }
+    setKey = computeKey();
+    buildPrefilter(loadPath);
+    if (previous)
+      adopt(*previous);
+  }
+
+  auto empty() const -> bool { return entries.empty(); }
+  auto hasVariants() const -> bool { return variants; }
+
+  static auto variantKey(std::string_view hash, std::string_view spec)
+      -> std::string {
+    return std::string(hash) + "-" + std::string(spec);
+  }
+  auto size() const -> size_t { return entries.size(); }
+
+  // False only for modules that certainly have no override, without hashing.
+  auto mayOverride(const void *code, size_t size) const -> bool {
+    return prefilter.mayMatch(code, size);
+  }
+
+  // Changes whenever an override is added, removed or edited.
+  auto key() const -> const std::string & { return setKey; }
+
+  // Overrides taken over, already built, from the set this one replaced.
+  auto adopted() const -> size_t { return reused; }
+
+  // Loads, compiles and validates every entry on background threads.
+  auto warmUp() -> void {
+    for (auto &[hash, entry] : entries)
+      startBuild(*entry);
+  }
+
+  // Blocks only while this very override is still being built. Returns
+  // nullptr for unknown hashes and overrides that failed to build. Callers
+  // keep the code alive for as long as the driver may read it.
+  //
+  // With `pending` it never blocks: an override that isn't built yet, or was
+  // evicted, is brought back on a background thread and `pending` is set.
+  auto find(std::string_view hash, bool *pending = nullptr) const -> Code {
+    auto it = entries.find(hash);
+    if (it == entries.end())
+      return nullptr;
+
+    auto &entry = *it->second;
+    if (pending) {
+      startBuild(entry);
+      if (entry.ready.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        *pending = true;
+        return nullptr;
+      }
+      if (!entry.code)
+        return nullptr;
+      if (auto code = entry.code->tryGet())
+        return code;
+
+      *pending = true;
+      if (!entry.reloading.exchange(true))
+        background().submit([&entry] {
+          entry.code->get();
+          entry.reloading = false;
+        });
+      return nullptr;
+    }
+
+    // call_once only ever submits the build, so callers that mustn't block
+    // never wait in it behind this one.
+    startBuild(entry);
+    entry.ready.wait();
+    return entry.code ? entry.code->get() : nullptr;
+  }
+
+  // find(variantKey(hash, spec)), with the key built on the stack.
+  auto findVariant(const util::HexHash &hash, const util::HexHash &spec,
+                   bool *pending = nullptr) const -> Code {
+    if (!variants || spec.empty())
+      return nullptr;
+
+    std::array<char, 2 * 40 + 1> key;
+    auto end = std::ranges::copy(hash.view(), key.begin()).out;
+    *end++ = '-';
+    end = std::ranges::copy(spec.view(), end).out;
+    return find(std::string_view(key.begin(), end), pending);
+  }
+
+private:
+  // What a file looked like when something was built from it.
+  struct Stamp {
+    uintmax_t size = 0;
+    std::filesystem::file_time_type time;
+
+    static auto of(const std::filesystem::path &path) -> Stamp {
+      std::error_code ec;
+      auto size = std::filesystem::file_size(path, ec);
+      auto time = std::filesystem::last_write_time(path, ec);
+      return ec ? Stamp() : Stamp{size, time};
+    }
+
+    auto operator==(const Stamp &) const -> bool = default;
+  };
+
+  struct Entry {
+    Entry(std::string hash, std::filesystem::path path, ShaderLanguage lang)
+        : hash(std::move(hash)), path(std::move(path)), lang(lang) {}
+
+    std::string hash;
+    std::filesystem::path path;
+    ShaderLanguage lang;
+
+    std::once_flag once;
+    std::shared_future<void> ready;
+    // Shared with the sets that adopt it.
+    std::shared_ptr<PooledCode> code;
+    std::atomic<bool> reloading = false;
+
+    // Written before `built` is set, then fixed.
+    Stamp stamp;
+    std::vector<std::filesystem::path> includes;
+    std::atomic<bool> built = false;
+  };
+
+  // Header -> what it looked like when first included, and which overrides
+  // include it.
+  struct Header {
+    Stamp stamp;
+    std::set<std::string, std::less<>> includedBy;
+  };
+
+  auto record(std::string_view hash, const Entry &entry) const -> void {
+    std::lock_guard<std::mutex> l(graphLock);
+    for (const auto &include : entry.includes) {
+      auto [it, added] = headers.try_emplace(include);
+      if (added)
+        it->second.stamp = Stamp::of(include);
+      it->second.includedBy.emplace(hash);
+    }
+  }
+
+  // Built overrides of `previous` are taken over unless their own file, or a
+  // header that the graph says they include, changed since.
+  auto adopt(const Overrides &previous) -> void {
+    auto stale = std::set<std::string, std::less<>>();
+    {
+      std::lock_guard<std::mutex> l(previous.graphLock);
+      for (const auto &[path, header] : previous.headers)
+        if (Stamp::of(path) != header.stamp)
+          stale.insert(header.includedBy.begin(), header.includedBy.end());
+    }
+
+    for (auto &[hash, entry] : entries) {
+      auto it = previous.entries.find(hash);
+      if (it == previous.entries.end() || stale.contains(hash))
+        continue;
+
+      auto &old = *it->second;
+      if (!old.built.load(std::memory_order_acquire) || !old.code ||
+          old.path != entry->path || Stamp::of(old.path) != old.stamp)
+        continue;
+
+      std::call_once(entry->once, [&] {
+        entry->code = old.code;
+        entry->stamp = old.stamp;
+        entry->includes = old.includes;
+        entry->built = true;
+
+        std::promise<void> ready;
+        ready.set_value();
+        entry->ready = ready.get_future().share();
+      });
+      record(hash, *entry);
+      ++reused;
+    }
+
+    if (!stale.empty() || reused)
+      std::clog << "[VK_SHADER_GUTS][log]: Overrides: " << reused
+                << " unchanged, " << entries.size() - reused
+                << " to build, " << stale.size()
+                << " invalidated by changed headers\n";
+  }
+
+  auto background() const -> util::ThreadPool & {
+    std::call_once(poolOnce, [this] {
+      pool = std::make_unique<util::ThreadPool>(
+          std::min(entries.size(), util::ThreadPool::defaultThreadCount()));
+    });
+    return *pool;
+  }
+
+  auto startBuild(Entry &entry) const -> void {
+    std::call_once(entry.once, [&] {
+      entry.ready = background().submit([this, &entry] { prepare(entry); })
+                        .share();
+    });
+  }
+
+  static auto isHash(std::string_view str) -> bool {
+    return str.size() == 2 * std::tuple_size_v<util::Sha1Digest> &&
+           str.find_first_not_of("0123456789abcdef") == std::string::npos;
+  }
+
+  static auto isVariant(std::string_view str) -> bool {
+    auto dash = str.find('-');
+    return dash != std::string_view::npos && isHash(str.substr(0, dash)) &&
+           isHash(str.substr(dash + 1));
+  }
+
+  // From VK_SHADER_GUTS_LOAD_INDEX, or the index.csv next to the overrides.
+  auto buildPrefilter(const std::filesystem::path &dir) -> void {
+    auto index = dir / "index.csv";
+    if (auto path = util::getEnv("VK_SHADER_GUTS_LOAD_INDEX"))
+      index = *path;
+    if (entries.empty() || !std::filesystem::exists(index))
+      return;
+
+    auto hashes = std::set<std::string, std::less<>>();
+    for (const auto &[key, _] : entries)
+      hashes.insert(key.substr(0, key.find('-')));
+    prefilter = Prefilter(index, hashes);
+  }
+
+  auto computeKey() const -> std::string {
+    auto key = std::string();
+    for (const auto &[hash, entry] : entries) {
+      std::error_code ec;
+      auto size = std::filesystem::file_size(entry->path, ec);
+      auto time = std::filesystem::last_write_time(entry->path, ec);
+
+      key += hash + entry->path.string() + std::to_string(size) +
+             std::to_string(time.time_since_epoch().count());
+    }
+    return util::Sha1Hash::compute(key.data(), key.size()).toString();
+  }
+
+  // `includes` gets the headers a GLSL override pulled in.
+  auto build(const Entry &entry,
+             std::vector<std::filesystem::path> *includes = nullptr) const
+      -> Code {
+    util::trace::Scope trace(util::trace::Type::compile);
+    auto code = std::vector<std::byte>();
+
+    switch (entry.lang) {
+    case ShaderLanguage::spirv:
+      code = util::LoadSPRV(entry.path);
+      break;
+
+    case ShaderLanguage::glsl:
+      code = util::glsl::Plugin::get().compile(util::LoadFile(entry.path),
+                                               entry.path, includes);
+      break;
+    }
+
+    if (!util::isSPIRV(code)) {
+      std::clog << "[VK_SHADER_GUTS][err]: Not a valid SPIR-V override: "
+                << entry.path << "\n";
+      return nullptr;
+    }
+
+    code = optimizer->optimize(std::move(code), entry.path);
+    return std::make_shared<const std::vector<std::byte>>(std::move(code));
+  }
+
+  auto prepare(Entry &entry) const -> void {
+    entry.stamp = Stamp::of(entry.path);
+    if (auto code = build(entry, &entry.includes))
+      entry.code = std::make_shared<PooledCode>(
+          *codePool, std::move(code),
+          [this, &entry] { return build(entry); });
+
+    record(entry.hash, entry);
+    entry.built.store(true, std::memory_order_release);
+  }
+
+  std::map<std::string, std::unique_ptr<Entry>, std::less<>> entries;
+  std::string setKey;
+  bool variants = false;
+  Prefilter prefilter;
+  CodePool *codePool = nullptr;
+  OverrideOptimizer *optimizer = nullptr;
+  size_t reused = 0;
+
+  mutable std::mutex graphLock;
+  mutable std::map<std::filesystem::path, Header> headers;
+  mutable std::once_flag poolOnce;
+  mutable std::unique_ptr<util::ThreadPool> pool;
+};
+
+}; // namespace impl
@@ -0,0 +1,55 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+namespace util {
+
+constexpr auto fnv1a(std::string_view str, uint32_t seed) -> uint32_t {
+  uint32_t hash = 2166136261u ^ seed;
+  for (char c : str) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Collision-free string -> index table, the seed is searched for at compile
+// time. A lookup is one hash of the key and one string compare.
+template <size_t N> class PerfectHash {
+public:
+  static constexpr size_t npos = ~size_t(0);
+
+  consteval explicit PerfectHash(const std::array<std::string_view, N> &keys)
+      : keys(keys) {
+    while (!tryBuild())
+      ++seed;
+  }
+
+  constexpr auto find(std::string_view key) const -> size_t {
+    auto index = table[fnv1a(key, seed) & (slots - 1)];
+    return index != npos && keys[index] == key ? index : npos;
+  }
+
+private:
+  // Sparse enough that a working seed turns up within a few dozen tries.
+  static constexpr size_t slots = std::bit_ceil(N * 4);
+
+  consteval auto tryBuild() -> bool {
+    table.fill(npos);
+    for (size_t i = 0; i < N; ++i) {
+      auto &slot = table[fnv1a(keys[i], seed) & (slots - 1)];
+      if (slot != npos)
+        return false;
+      slot = i;
+    }
+    return true;
+  }
+
+  std::array<std::string_view, N> keys;
+  std::array<size_t, slots> table{};
+  uint32_t seed = 0;
+};
+
+} // namespace util
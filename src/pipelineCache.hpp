@@ -0,0 +1,106 @@
+#pragma once
+#include "defines.hpp"
+#include "util.hpp"
+#include <mutex>
+#include <set>
+
+namespace impl {
+
+// Layer-owned VkPipelineCache for pipelines built from overridden shaders.
+// The application's caches never see those shaders across runs, so the
+// layer keeps its own on disk and merges it into the application's caches
+// before it reads them back.
+class PipelineCache {
+public:
+  PipelineCache(VkDevice device, const VkLayerDispatchTable &dispatch,
+                std::filesystem::path path)
+      : device(device), dispatch(dispatch), path(std::move(path)) {
+    auto initialData = util::LoadBinaryFile(this->path);
+
+    VkPipelineCacheCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    info.initialDataSize = initialData.size();
+    info.pInitialData = initialData.data();
+
+    if (dispatch.CreatePipelineCache(device, &info, nullptr, &cache) !=
+        VK_SUCCESS) {
+      cache = VK_NULL_HANDLE;
+      return;
+    }
+
+    std::clog << "[VK_SHADER_GUTS][log]: Pipeline cache: " << this->path
+              << " (" << initialData.size() << " bytes)\n";
+  }
+
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+
+  auto handle() const -> VkPipelineCache { return cache; }
+
+  // The application destroyed `appCache`, its handle may come back.
+  auto untrack(VkPipelineCache appCache) -> void {
+    std::lock_guard<std::mutex> l(lock);
+    dirtyCaches.erase(appCache);
+  }
+
+  // `appCache` was swapped for ours in a create call and misses its entries.
+  auto markDirty(VkPipelineCache appCache) -> void {
+    std::lock_guard<std::mutex> l(lock);
+    dirtyCaches.insert(appCache);
+  }
+
+  // Called right before the application reads `appCache` back.
+  auto mergeInto(VkPipelineCache appCache) -> void {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      if (!dirtyCaches.erase(appCache))
+        return;
+    }
+    dispatch.MergePipelineCaches(device, appCache, 1, &cache);
+  }
+
+  // Writes the cache next to the old one and renames it over, so a crash
+  // mid-write never leaves a truncated cache behind.
+  auto persistAndDestroy() -> void {
+    if (cache == VK_NULL_HANDLE)
+      return;
+
+    size_t size = 0;
+    auto data = std::vector<std::byte>();
+    if (dispatch.GetPipelineCacheData(device, cache, &size, nullptr) ==
+        VK_SUCCESS) {
+      data.resize(size);
+      if (dispatch.GetPipelineCacheData(device, cache, &size, data.data()) !=
+          VK_SUCCESS)
+        data.clear();
+      data.resize(size);
+    }
+
+    dispatch.DestroyPipelineCache(device, cache, nullptr);
+    cache = VK_NULL_HANDLE;
+
+    if (data.empty())
+      return;
+
+    auto tmp = path;
+    tmp += ".tmp";
+    util::SaveSPVToFile(data, tmp);
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+      std::clog << "[VK_SHADER_GUTS][err]: Can't write pipeline cache " << path
+                << ": " << ec.message() << "\n";
+  }
+
+private:
+  VkDevice device;
+  const VkLayerDispatchTable &dispatch;
+  std::filesystem::path path;
+  VkPipelineCache cache = VK_NULL_HANDLE;
+
+  std::mutex lock;
+  std::set<VkPipelineCache> dirtyCaches;
+};
+
+}; // namespace impl
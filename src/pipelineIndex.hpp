@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+namespace util {
+
+// `pipelines.idx` of a dump directory: which shaders every pipeline was
+// created with. Pipeline handles don't survive the run, a pipeline is known
+// by the hash of its stages instead. The file is the edges twice, sorted by
+// pipeline and sorted by shader, so both questions are a binary search in
+// the mapped file and nothing is loaded up front.
+class PipelineIndex {
+public:
+  using Key = std::array<uint8_t, 20>;
+
+  struct Edge {
+    Key pipeline;
+    Key shader;
+    uint32_t stage; // VkShaderStageFlagBits
+  };
+  static_assert(sizeof(Edge) == 44);
+
+  struct FileHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t edgeSize;
+    uint64_t edges;
+  };
+
+  static constexpr std::array<char, 8> fileMagic{'V', 'K', 'S', 'G',
+                                                 'P', 'I', 'P', '1'};
+  static constexpr uint32_t fileVersion = 1;
+
+  // A hash, or a prefix of one padded with `fill` up to 40 hex digits.
+  static auto key(std::string_view hex, char fill = '0')
+      -> std::optional<Key> {
+    if (hex.size() > 40)
+      return std::nullopt;
+
+    auto digit = [](char c) -> int {
+      if (c >= '0' && c <= '9')
+        return c - '0';
+      if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+      return -1;
+    };
+
+    Key key{};
+    for (size_t i = 0; i < 40; ++i) {
+      int value = digit(i < hex.size() ? hex[i] : fill);
+      if (value < 0)
+        return std::nullopt;
+      key[i / 2] |= uint8_t(i % 2 ? value : value << 4);
+    }
+    return key;
+  }
+
+  static auto hex(const Key &key) -> std::string {
+    constexpr auto digits = std::string_view("0123456789abcdef");
+    auto out = std::string(40, '0');
+    for (size_t i = 0; i < key.size(); ++i) {
+      out[2 * i] = digits[key[i] >> 4];
+      out[2 * i + 1] = digits[key[i] & 15];
+    }
+    return out;
+  }
+
+  static auto byPipeline(const Edge &a, const Edge &b) -> bool {
+    return std::tie(a.pipeline, a.stage, a.shader) <
+           std::tie(b.pipeline, b.stage, b.shader);
+  }
+
+  static auto byShader(const Edge &a, const Edge &b) -> bool {
+    return std::tie(a.shader, a.pipeline, a.stage) <
+           std::tie(b.shader, b.pipeline, b.stage);
+  }
+
+  // Edges of earlier runs are kept, duplicates dropped.
+  static auto write(const std::filesystem::path &dir, std::vector<Edge> edges)
+      -> void {
+    auto path = dir / "pipelines.idx";
+    if (auto old = PipelineIndex(path); old.valid()) {
+      auto forward = old.forward();
+      edges.insert(edges.end(), forward.begin(), forward.end());
+    }
+
+    auto same = [](const Edge &a, const Edge &b) {
+      return !byPipeline(a, b) && !byPipeline(b, a);
+    };
+    std::ranges::sort(edges, byPipeline);
+    edges.erase(std::ranges::unique(edges, same).begin(), edges.end());
+
+    auto reverse = edges;
+    std::ranges::sort(reverse, byShader);
+
+    FileHeader header{fileMagic, fileVersion, sizeof(Edge), edges.size()};
+
+    auto tmp = path;
+    tmp += ".tmp";
+    if (std::ofstream file(tmp, std::ios::binary); file.is_open()) {
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char *>(edges.data()),
+                 edges.size() * sizeof(Edge));
+      file.write(reinterpret_cast<const char *>(reverse.data()),
+                 reverse.size() * sizeof(Edge));
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+  }
+
+  // Maps `path` read-only, valid() tells whether it's an index.
+  explicit PipelineIndex(const std::filesystem::path &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(FileHeader)) {
+      auto data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        mapping = data;
+        mapSize = info.st_size;
+      }
+    }
+    close(fd);
+
+    if (!mapping)
+      return;
+
+    FileHeader header;
+    std::memcpy(&header, mapping, sizeof(header));
+    if (header.magic != fileMagic || header.version != fileVersion ||
+        header.edgeSize != sizeof(Edge) ||
+        mapSize != sizeof(header) + 2 * header.edges * sizeof(Edge))
+      return;
+
+    // The header keeps the tables 4-byte aligned, as Edge wants.
+    auto first = reinterpret_cast<const Edge *>(
+        static_cast<const std::byte *>(mapping) + sizeof(header));
+    forwardEdges = {first, header.edges};
+    reverseEdges = {first + header.edges, header.edges};
+  }
+
+  ~PipelineIndex() {
+    if (mapping)
+      munmap(mapping, mapSize);
+  }
+
+  PipelineIndex(const PipelineIndex &) = delete;
+  PipelineIndex &operator=(const PipelineIndex &) = delete;
+
+  auto valid() const -> bool { return forwardEdges.data() != nullptr; }
+  auto size() const -> size_t { return forwardEdges.size(); }
+
+  auto forward() const -> std::span<const Edge> { return forwardEdges; }
+
+  // Shaders of the pipelines whose hash lies in [first, last], by pipeline.
+  auto shadersOf(const Key &first, const Key &last) const
+      -> std::span<const Edge> {
+    auto begin = std::ranges::lower_bound(forwardEdges, first, {},
+                                          &Edge::pipeline);
+    auto end = std::ranges::upper_bound(begin, forwardEdges.end(), last, {},
+                                        &Edge::pipeline);
+    return {begin, end};
+  }
+
+  // Pipelines using the shaders whose hash lies in [first, last], by shader.
+  auto pipelinesUsing(const Key &first, const Key &last) const
+      -> std::span<const Edge> {
+    auto begin = std::ranges::lower_bound(reverseEdges, first, {},
+                                          &Edge::shader);
+    auto end = std::ranges::upper_bound(begin, reverseEdges.end(), last, {},
+                                        &Edge::shader);
+    return {begin, end};
+  }
+
+private:
+  void *mapping = nullptr;
+  size_t mapSize = 0;
+  std::span<const Edge> forwardEdges;
+  std::span<const Edge> reverseEdges;
+};
+
+} // namespace util
@@ -0,0 +1,125 @@
+#pragma once
+#include "spirvCost.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <set>
+#include <string_view>
+#include <vector>
+
+namespace impl {
+
+// Tells modules that can't have an override apart without hashing them. The
+// original of every override has one of a few sizes, and its signature (see
+// util::spirv::signature) is in a small Bloom filter. Both come from the
+// index.csv of the dump the overrides were made from. Unless that covers
+// every override, everything passes.
+class Prefilter {
+public:
+  Prefilter() = default;
+
+  // `hashes` are the hashes of the modules the overrides replace.
+  Prefilter(const std::filesystem::path &index,
+            const std::set<std::string, std::less<>> &hashes) {
+    std::ifstream file(index);
+    auto line = std::string();
+    if (!std::getline(file, line))
+      return;
+
+    auto columns = split(line);
+    auto column = [&](std::string_view name) {
+      return size_t(std::ranges::find(columns, name) - columns.begin());
+    };
+    auto hashColumn = column("hash");
+    auto sizeColumn = column("size");
+    auto headColumn = column("head");
+    auto needed = std::max({hashColumn, sizeColumn, headColumn});
+    if (needed >= columns.size())
+      return;
+
+    auto found = std::set<std::string, std::less<>>();
+    while (std::getline(file, line)) {
+      auto fields = split(line);
+      if (fields.size() <= needed)
+        continue;
+
+      // Spec dumps name their rows `<hash>-<spec hash>`, size and head are
+      // still the module's. A module may only have such rows.
+      auto hash = std::string_view(fields[hashColumn]);
+      hash = hash.substr(0, hash.find('-'));
+      if (!hashes.contains(hash))
+        continue;
+
+      auto size = std::strtoull(fields[sizeColumn].c_str(), nullptr, 10);
+      auto head = std::strtoull(fields[headColumn].c_str(), nullptr, 16);
+      if (!size)
+        continue;
+
+      sizes.push_back(size);
+      set(head);
+      found.emplace(hash);
+    }
+
+    if (found.size() != hashes.size()) {
+      std::clog << "[VK_SHADER_GUTS][log]: " << index << " lacks "
+                << hashes.size() - found.size()
+                << " of the overridden shaders, every module gets hashed\n";
+      sizes.clear();
+      return;
+    }
+
+    std::ranges::sort(sizes);
+    sizes.erase(std::ranges::unique(sizes).begin(), sizes.end());
+    std::clog << "[VK_SHADER_GUTS][log]: Load prefilter: " << sizes.size()
+              << " sizes from " << index << "\n";
+  }
+
+  auto enabled() const -> bool { return !sizes.empty(); }
+
+  auto mayMatch(const void *code, size_t size) const -> bool {
+    if (!enabled())
+      return true;
+    if (!std::ranges::binary_search(sizes, size))
+      return false;
+    return test(util::spirv::signature(
+        std::span(static_cast<const std::byte *>(code), size)));
+  }
+
+private:
+  // 4096 bits with three probes keep false positives around 1% for a few
+  // hundred overrides.
+  static constexpr size_t bits = 4096;
+  static constexpr size_t probes = 3;
+
+  static auto split(const std::string &line) -> std::vector<std::string> {
+    auto fields = std::vector<std::string>();
+    size_t start = 0;
+    for (auto comma = line.find(','); comma != std::string::npos;
+         start = comma + 1, comma = line.find(',', start))
+      fields.push_back(line.substr(start, comma - start));
+    fields.push_back(line.substr(start));
+    return fields;
+  }
+
+  static auto probe(uint64_t head, size_t i) -> size_t {
+    return (head + i * ((head >> 32) | 1)) % bits;
+  }
+
+  auto set(uint64_t head) -> void {
+    for (size_t i = 0; i < probes; ++i)
+      bloom[probe(head, i) / 64] |= 1ull << (probe(head, i) % 64);
+  }
+
+  auto test(uint64_t head) const -> bool {
+    for (size_t i = 0; i < probes; ++i)
+      if (!(bloom[probe(head, i) / 64] & (1ull << (probe(head, i) % 64))))
+        return false;
+    return true;
+  }
+
+  std::vector<size_t> sizes;
+  std::array<uint64_t, bits / 64> bloom{};
+};
+
+}; // namespace impl
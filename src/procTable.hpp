@@ -0,0 +1,62 @@
+#pragma once
+#include "perfectHash.hpp"
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace impl {
+
+// Intercepted entry points. vkGetInstanceProcAddr hands out the instance
+// ones, vkGetDeviceProcAddr the device ones. Capture ones sit on hot paths and
+// are only handed out when there's something to capture. Extension ones are
+// only handed out when the device below has them.
+enum ProcScope : uint8_t {
+  instanceScope = 1,
+  deviceScope = 2,
+  captureScope = 4,
+  extensionScope = 8,
+};
+
+#define SHADER_GUTS_PROCS(X)                                                   \
+  X(GetInstanceProcAddr, instanceScope)                                        \
+  X(EnumerateInstanceLayerProperties, instanceScope)                           \
+  X(EnumerateInstanceExtensionProperties, instanceScope)                       \
+  X(CreateInstance, instanceScope)                                             \
+  X(DestroyInstance, instanceScope)                                            \
+                                                                               \
+  X(GetDeviceProcAddr, instanceScope | deviceScope)                            \
+  X(EnumerateDeviceLayerProperties, instanceScope | deviceScope)               \
+  X(EnumerateDeviceExtensionProperties, instanceScope | deviceScope)           \
+  X(CreateDevice, instanceScope | deviceScope)                                 \
+  X(DestroyDevice, instanceScope | deviceScope)                                \
+                                                                               \
+  X(CreateComputePipelines, deviceScope)                                       \
+  X(CreateGraphicsPipelines, deviceScope)                                      \
+  X(CreateRayTracingPipelinesKHR, deviceScope | extensionScope)                \
+  X(DestroyPipeline, deviceScope)                                              \
+                                                                               \
+  X(DestroyPipelineCache, deviceScope)                                         \
+  X(GetPipelineCacheData, deviceScope)                                         \
+                                                                               \
+  X(CreateShaderModule, deviceScope)                                           \
+  X(DestroyShaderModule, deviceScope)                                          \
+  X(CreateShadersEXT, deviceScope | extensionScope)                            \
+  X(QueuePresentKHR, deviceScope | extensionScope)                             \
+                                                                               \
+  X(DeferredOperationJoinKHR, deviceScope | extensionScope)                    \
+  X(GetDeferredOperationResultKHR, deviceScope | extensionScope)               \
+  X(GetDeferredOperationMaxConcurrencyKHR, deviceScope | extensionScope)       \
+  X(DestroyDeferredOperationKHR, deviceScope | extensionScope)                 \
+                                                                               \
+  X(CmdBindPipeline, captureScope)
+
+#define PROC_NAME(func, scope) "vk" #func,
+
+// Intercepted names, looked up with one hash and one compare.
+constexpr auto procNames =
+    std::to_array<std::string_view>({SHADER_GUTS_PROCS(PROC_NAME)});
+constexpr util::PerfectHash<procNames.size()> procHash(procNames);
+
+#undef PROC_NAME
+
+}; // namespace impl
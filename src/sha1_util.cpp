@@ -4,18 +4,20 @@
 namespace util {
 
 std::string Sha1Hash::toString() const {
-  static const char nibbles[] = {'0', '1', '2', '3', '4', '5', '6', '7',
-                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
-
   std::string result;
   result.resize(2 * m_digest.size());
+  toChars(result.data());
+  return result;
+}
+
+void Sha1Hash::toChars(char *out) const {
+  static const char nibbles[] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 
   for (uint32_t i = 0; i < m_digest.size(); i++) {
-    result.at(2 * i + 0) = nibbles[(m_digest[i] >> 4) & 0xF];
-    result.at(2 * i + 1) = nibbles[(m_digest[i] >> 0) & 0xF];
+    out[2 * i + 0] = nibbles[(m_digest[i] >> 4) & 0xF];
+    out[2 * i + 1] = nibbles[(m_digest[i] >> 0) & 0xF];
   }
-
-  return result;
 }
 
 Sha1Hash Sha1Hash::compute(const void *data, size_t size) {
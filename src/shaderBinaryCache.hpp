@@ -0,0 +1,168 @@
+#pragma once
+#include "defines.hpp"
+#include "util.hpp"
+#include <format>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace impl {
+
+// On-disk cache of VK_EXT_shader_object driver binaries. A SPIR-V create whose
+// binary was stored by an earlier run is turned into a binary create, so the
+// driver skips compiling it. Binaries live in a folder per shaderBinaryUUID
+// and shaderBinaryVersion, so a driver update never sees stale ones.
+class ShaderBinaryCache {
+public:
+  ShaderBinaryCache(VkDevice device, const VkLayerDispatchTable &dispatch,
+                    const std::filesystem::path &dir,
+                    const VkPhysicalDeviceShaderObjectPropertiesEXT &props)
+      : device(device), dispatch(dispatch) {
+    auto uuid = std::string();
+    for (auto byte : props.shaderBinaryUUID)
+      uuid += std::format("{:02x}", byte);
+
+    path = dir / (uuid + "-" + std::to_string(props.shaderBinaryVersion));
+    std::filesystem::create_directories(path);
+
+    std::clog << "[VK_SHADER_GUTS][log]: Shader binary cache: " << path
+              << "\n";
+  }
+
+  ShaderBinaryCache(const ShaderBinaryCache &) = delete;
+  ShaderBinaryCache &operator=(const ShaderBinaryCache &) = delete;
+
+  // Everything in the create info that changes the driver binary and
+  // survives across runs. Set layouts are handles and can't be part of it.
+  static auto key(const VkShaderCreateInfoEXT &info) -> std::string {
+    auto name = std::string_view(info.pName ? info.pName : "");
+    auto chunks = std::vector<util::Sha1Hash::Sha1Data>{
+        {info.pCode, info.codeSize},
+        {&info.stage, sizeof(info.stage)},
+        {&info.nextStage, sizeof(info.nextStage)},
+        {&info.flags, sizeof(info.flags)},
+        {name.data(), name.size()},
+    };
+
+    for (uint32_t i = 0; i < info.pushConstantRangeCount; ++i)
+      chunks.push_back(
+          {&info.pPushConstantRanges[i], sizeof(VkPushConstantRange)});
+
+    if (auto spec = info.pSpecializationInfo) {
+      chunks.push_back(
+          {spec->pMapEntries,
+           spec->mapEntryCount * sizeof(VkSpecializationMapEntry)});
+      chunks.push_back({spec->pData, spec->dataSize});
+    }
+
+    return util::Sha1Hash::compute(chunks.size(), chunks.data()).toString();
+  }
+
+  auto create(uint32_t createInfoCount,
+              const VkShaderCreateInfoEXT *pCreateInfos,
+              const VkAllocationCallbacks *pAllocator, VkShaderEXT *pShaders)
+      -> VkResult {
+    auto keys = std::vector<std::string>(createInfoCount);
+    auto binaries = std::vector<std::vector<std::byte>>(createInfoCount);
+    auto infos = std::vector<VkShaderCreateInfoEXT>(
+        pCreateInfos, pCreateInfos + createInfoCount);
+
+    bool linked = false;
+    size_t hits = 0, spirvs = 0;
+
+    for (uint32_t i = 0; i < createInfoCount; ++i) {
+      linked |= infos[i].flags & VK_SHADER_CREATE_LINK_STAGE_BIT_EXT;
+      if (infos[i].codeType != VK_SHADER_CODE_TYPE_SPIRV_EXT)
+        continue;
+
+      ++spirvs;
+      keys[i] = key(infos[i]);
+      binaries[i] = util::LoadBinaryFile(path / (keys[i] + ".bin"));
+      hits += !binaries[i].empty();
+    }
+
+    // Linked stages must all share one code type.
+    bool useBinaries = hits && (!linked || hits == spirvs);
+
+    if (useBinaries) {
+      for (uint32_t i = 0; i < createInfoCount; ++i) {
+        if (binaries[i].empty())
+          continue;
+
+        infos[i].codeType = VK_SHADER_CODE_TYPE_BINARY_EXT;
+        infos[i].pCode = binaries[i].data();
+        infos[i].codeSize = binaries[i].size();
+      }
+
+      auto ret = dispatch.CreateShadersEXT(device, createInfoCount,
+                                           infos.data(), pAllocator, pShaders);
+      if (ret == VK_SUCCESS) {
+        storeMissing(createInfoCount, keys, binaries, pShaders);
+        return ret;
+      }
+
+      // Driver refused our binaries, drop them and compile from SPIR-V.
+      for (uint32_t i = 0; i < createInfoCount; ++i) {
+        if (pShaders[i] != VK_NULL_HANDLE)
+          dispatch.DestroyShaderEXT(device, pShaders[i], pAllocator);
+        pShaders[i] = VK_NULL_HANDLE;
+        if (!binaries[i].empty())
+          forget(keys[i]);
+        binaries[i].clear();
+      }
+    }
+
+    auto ret = dispatch.CreateShadersEXT(device, createInfoCount, pCreateInfos,
+                                         pAllocator, pShaders);
+    if (ret == VK_SUCCESS)
+      storeMissing(createInfoCount, keys, binaries, pShaders);
+    return ret;
+  }
+
+private:
+  auto forget(const std::string &key) const -> void {
+    std::error_code ec;
+    std::filesystem::remove(path / (key + ".bin"), ec);
+  }
+
+  auto storeMissing(uint32_t count, const std::vector<std::string> &keys,
+                    const std::vector<std::vector<std::byte>> &binaries,
+                    const VkShaderEXT *pShaders) -> void {
+    for (uint32_t i = 0; i < count; ++i) {
+      if (keys[i].empty() || !binaries[i].empty())
+        continue;
+
+      size_t size = 0;
+      if (dispatch.GetShaderBinaryDataEXT(device, pShaders[i], &size,
+                                          nullptr) != VK_SUCCESS ||
+          !size)
+        continue;
+
+      auto data = std::vector<std::byte>(size);
+      if (dispatch.GetShaderBinaryDataEXT(device, pShaders[i], &size,
+                                          data.data()) != VK_SUCCESS)
+        continue;
+
+      // Two processes, or two threads of one, may store the same key. Each
+      // writes its own temp file, and only a complete one is renamed in.
+      auto file = path / (keys[i] + ".bin");
+      auto tmp = file;
+      tmp += std::format(".{}.{}.tmp", getpid(), syscall(SYS_gettid));
+      util::SaveSPVToFile(data, tmp.string());
+
+      std::error_code ec;
+      if (std::filesystem::file_size(tmp, ec) != size || ec) {
+        std::filesystem::remove(tmp, ec);
+        continue;
+      }
+      std::filesystem::rename(tmp, file, ec);
+      if (ec)
+        std::filesystem::remove(tmp, ec);
+    }
+  }
+
+  VkDevice device;
+  const VkLayerDispatchTable &dispatch;
+  std::filesystem::path path;
+};
+
+}; // namespace impl
@@ -0,0 +1,178 @@
+#ifndef _SHADER_GUTS_CORE_H
+#define _SHADER_GUTS_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C API of libshader-guts-core, everything the layer does to shaders outside
+// of Vulkan: hashing, GLSL compile and decompile, spirv-opt and dump
+// directories. It comes as a static and a shared library. The layer is
+// implicit and mustn't map glslang in every process, so it dlopen()s the
+// shared one the first time a *_LANG=glsl path or an optimization needs it.
+//
+// Inputs are only read for the duration of a call. Outputs whose size is
+// known cheaply, hashes, archive listings and reads, go into buffers the
+// caller passes, with the Vulkan two-call idiom. Outputs whose size only the
+// work itself tells, SPIR-V, GLSL, include lists, go through the caller's
+// allocation callback. glslang, SPIRV-Cross and spirv-opt only produce
+// containers of their own, the finished output is copied from those into the
+// caller's allocation once.
+//
+// Every function may be called from any number of threads at once. Batch
+// calls run on the library's worker threads. One made from those threads, from
+// an allocation callback of another batch say, runs on the calling thread
+// instead, so nested calls never wait for workers that are all waiting too.
+
+#define SHADER_GUTS_CORE_VERSION 1
+
+// A shader's file name in a dump directory: `<hash>` or `<hash>-<spec hash>`.
+#define SHADER_GUTS_NAME_SIZE 96
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ShaderGutsResult {
+  SHADER_GUTS_SUCCESS = 0,
+  // The caller's buffer was too small, it holds what fit.
+  SHADER_GUTS_INCOMPLETE = 1,
+  SHADER_GUTS_ERROR_INVALID_ARGUMENT = -1,
+  SHADER_GUTS_ERROR_NOT_FOUND = -2,
+  // The shader didn't compile, decompile or optimize, the reason is logged.
+  SHADER_GUTS_ERROR_FAILED = -3,
+  SHADER_GUTS_ERROR_OUT_OF_MEMORY = -4,
+  SHADER_GUTS_ERROR_IO = -5,
+} ShaderGutsResult;
+
+// Called at most once per output, with its final size, never 0. Returning
+// NULL fails that output with SHADER_GUTS_ERROR_OUT_OF_MEMORY.
+typedef void *(*PFN_ShaderGutsAllocate)(void *pUserData, size_t size);
+
+// `data` and `size` are set to the allocation on success, left NULL and 0
+// otherwise.
+typedef struct ShaderGutsOutput {
+  PFN_ShaderGutsAllocate pfnAllocate;
+  void *pUserData;
+  void *data;
+  size_t size;
+} ShaderGutsOutput;
+
+// SPIR-V, or any bytes for hashing. `code` needs no particular alignment.
+typedef struct ShaderGutsCode {
+  const void *code;
+  size_t codeSize;
+} ShaderGutsCode;
+
+// SHA-1 of a module as 40 hex digits, the name the layer dumps and loads it
+// by.
+typedef struct ShaderGutsHash {
+  char hex[41];
+} ShaderGutsHash;
+
+// The stage is guessed from the extension of `fileName`, #include is resolved
+// next to it.
+typedef struct ShaderGutsSource {
+  const char *source;
+  size_t sourceSize;
+  const char *fileName;
+} ShaderGutsSource;
+
+// A VK_SHADER_GUTS_DUMP_PATH tree.
+typedef struct ShaderGutsArchive_T *ShaderGutsArchive;
+
+typedef struct ShaderGutsArchiveEntry {
+  uint32_t stage; // VkShaderStageFlagBits
+  char name[SHADER_GUTS_NAME_SIZE];
+  uint64_t size;
+} ShaderGutsArchiveEntry;
+
+typedef uint32_t (*PFN_ShaderGutsCore_GetVersion)(void);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_HashBatch)(
+    uint32_t count, const ShaderGutsCode *pCodes, ShaderGutsHash *pHashes);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_Compile)(
+    const ShaderGutsSource *pSource, ShaderGutsOutput *pSpirv,
+    ShaderGutsOutput *pIncludes);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_CompileBatch)(
+    uint32_t count, const ShaderGutsSource *pSources, ShaderGutsOutput *pSpirvs,
+    ShaderGutsOutput *pIncludes, ShaderGutsResult *pResults);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_Decompile)(
+    const ShaderGutsCode *pCode, ShaderGutsOutput *pGlsl);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_DecompileBatch)(
+    uint32_t count, const ShaderGutsCode *pCodes, ShaderGutsOutput *pGlsls,
+    ShaderGutsResult *pResults);
+typedef ShaderGutsResult (*PFN_ShaderGutsCore_Optimize)(
+    const ShaderGutsCode *pCode, const char *recipe, ShaderGutsOutput *pSpirv);
+
+uint32_t ShaderGutsCore_GetVersion(void);
+
+// `pHashes` has `count` entries. Invalid entries, NULL or empty code, get an
+// empty string and make the call return SHADER_GUTS_ERROR_INVALID_ARGUMENT.
+ShaderGutsResult ShaderGutsCore_HashBatch(uint32_t count,
+                                          const ShaderGutsCode *pCodes,
+                                          ShaderGutsHash *pHashes);
+
+// `pIncludes` is NULL, or gets the paths of every header the shader included,
+// each terminated by '\0', even if it failed.
+ShaderGutsResult ShaderGutsCore_Compile(const ShaderGutsSource *pSource,
+                                        ShaderGutsOutput *pSpirv,
+                                        ShaderGutsOutput *pIncludes);
+
+// `pSpirvs` and `pResults` have `count` entries, `pIncludes` is NULL or does
+// too. Returns SHADER_GUTS_SUCCESS if every shader compiled, otherwise the
+// first failure, `pResults` tells which ones.
+ShaderGutsResult ShaderGutsCore_CompileBatch(uint32_t count,
+                                             const ShaderGutsSource *pSources,
+                                             ShaderGutsOutput *pSpirvs,
+                                             ShaderGutsOutput *pIncludes,
+                                             ShaderGutsResult *pResults);
+
+// Vulkan GLSL, as the layer dumps with VK_SHADER_GUTS_DUMP_LANG=glsl.
+ShaderGutsResult ShaderGutsCore_Decompile(const ShaderGutsCode *pCode,
+                                          ShaderGutsOutput *pGlsl);
+
+ShaderGutsResult ShaderGutsCore_DecompileBatch(uint32_t count,
+                                               const ShaderGutsCode *pCodes,
+                                               ShaderGutsOutput *pGlsls,
+                                               ShaderGutsResult *pResults);
+
+// Runs spirv-opt. `recipe` is "-O", "-Os" or a list of spirv-opt pass flags.
+ShaderGutsResult ShaderGutsCore_Optimize(const ShaderGutsCode *pCode,
+                                         const char *recipe,
+                                         ShaderGutsOutput *pSpirv);
+
+// Lists the SPIR-V shaders under `path` once, the directory is created if it
+// doesn't exist yet.
+ShaderGutsResult ShaderGutsCore_OpenArchive(const char *path,
+                                            ShaderGutsArchive *pArchive);
+void ShaderGutsCore_CloseArchive(ShaderGutsArchive archive);
+
+// Sorted by stage and name. With `pEntries` NULL `*pCount` is set to the
+// number of entries, otherwise up to `*pCount` are written.
+ShaderGutsResult
+ShaderGutsCore_EnumerateArchive(ShaderGutsArchive archive, uint32_t *pCount,
+                                ShaderGutsArchiveEntry *pEntries);
+
+// Looks `name` up in `stage`, for callers that know the hash already.
+ShaderGutsResult ShaderGutsCore_FindInArchive(ShaderGutsArchive archive,
+                                              uint32_t stage, const char *name,
+                                              ShaderGutsArchiveEntry *pEntry);
+
+// Reads an entry's SPIR-V into `pData`. With `pData` NULL `*pSize` is set to
+// its size, otherwise up to `*pSize` bytes are read.
+ShaderGutsResult
+ShaderGutsCore_ReadArchive(ShaderGutsArchive archive,
+                           const ShaderGutsArchiveEntry *pEntry, void *pData,
+                           size_t *pSize);
+
+// Adds a shader as the layer dumps it, once per stage and hash. `pEntry` may
+// be NULL, otherwise it gets the shader's entry.
+ShaderGutsResult ShaderGutsCore_WriteArchive(ShaderGutsArchive archive,
+                                             uint32_t stage,
+                                             const ShaderGutsCode *pCode,
+                                             ShaderGutsArchiveEntry *pEntry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SHADER_GUTS_CORE_H */
@@ -0,0 +1,126 @@
+#pragma once
+#include "arena.hpp"
+#include "defines.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <format>
+#include <span>
+
+namespace impl {
+
+enum class SpecDump { off, raw, bake };
+
+// Identity of the constants a stage is specialized with. Entries are sorted
+// by constant id, so the same values hash equal however the application lays
+// them out. Empty for stages without specialization. Scratch comes from the
+// calling intercept's util::Arena.
+inline auto SpecializationHash(const VkSpecializationInfo *info)
+    -> util::HexHash {
+  if (!info || !info->mapEntryCount || !info->pData)
+    return {};
+
+  auto entries = std::pmr::vector<VkSpecializationMapEntry>(
+      info->pMapEntries, info->pMapEntries + info->mapEntryCount,
+      util::Arena::resource());
+  std::ranges::sort(entries, {}, &VkSpecializationMapEntry::constantID);
+
+  auto data = static_cast<const std::byte *>(info->pData);
+  auto chunks =
+      std::pmr::vector<util::Sha1Hash::Sha1Data>(util::Arena::resource());
+  chunks.reserve(2 * entries.size());
+  for (const auto &entry : entries) {
+    if (entry.offset + entry.size > info->dataSize)
+      continue;
+    chunks.push_back({&entry.constantID, sizeof(entry.constantID)});
+    chunks.push_back({data + entry.offset, entry.size});
+  }
+
+  return util::HexHash(util::Sha1Hash::compute(chunks.size(), chunks.data()));
+}
+
+// `constant_id size value` per line, the value as little-endian hex bytes.
+inline auto SpecializationText(const VkSpecializationInfo &info)
+    -> std::string {
+  auto data = static_cast<const uint8_t *>(info.pData);
+  auto text = std::string();
+
+  for (uint32_t i = 0; i < info.mapEntryCount; ++i) {
+    const auto &entry = info.pMapEntries[i];
+    if (entry.offset + entry.size > info.dataSize)
+      continue;
+
+    text += std::format("{} {} ", entry.constantID, entry.size);
+    for (size_t j = 0; j < entry.size; ++j)
+      text += std::format("{:02x}", data[entry.offset + j]);
+    text += "\n";
+  }
+  return text;
+}
+
+// Copy of `code` whose spec constants default to the values in `info`, so
+// the dump shows the variant that was actually compiled. SpecId decorations
+// always precede the constants, one pass sees both.
+inline auto Specialize(std::span<const std::byte> code,
+                       const VkSpecializationInfo &info)
+    -> std::vector<std::byte> {
+  constexpr uint32_t OpDecorate = 71, DecorationSpecId = 1;
+  constexpr uint32_t OpSpecConstantTrue = 48, OpSpecConstantFalse = 49,
+                     OpSpecConstant = 50;
+
+  auto ret = std::vector<std::byte>(code.begin(), code.end());
+  if (ret.size() % sizeof(uint32_t))
+    return ret;
+
+  auto words = std::span(reinterpret_cast<uint32_t *>(ret.data()),
+                         ret.size() / sizeof(uint32_t));
+  if (words.size() < 5 || words[0] != util::SPIRVMagic)
+    return ret;
+
+  auto data = static_cast<const std::byte *>(info.pData);
+  auto entryOf = [&](uint32_t constantID) -> const VkSpecializationMapEntry * {
+    for (uint32_t i = 0; i < info.mapEntryCount; ++i) {
+      const auto &entry = info.pMapEntries[i];
+      if (entry.constantID == constantID &&
+          entry.offset + entry.size <= info.dataSize)
+        return &entry;
+    }
+    return nullptr;
+  };
+
+  // Result id -> entry of its SpecId.
+  auto specIds = std::map<uint32_t, const VkSpecializationMapEntry *>();
+
+  for (size_t i = 5; i < words.size();) {
+    auto op = words[i] & 0xffff;
+    auto count = words[i] >> 16;
+    if (!count || i + count > words.size())
+      break;
+
+    if (op == OpDecorate && count == 4 && words[i + 2] == DecorationSpecId) {
+      if (auto entry = entryOf(words[i + 3]))
+        specIds[words[i + 1]] = entry;
+    } else if ((op == OpSpecConstantTrue || op == OpSpecConstantFalse) &&
+               count == 3) {
+      if (auto it = specIds.find(words[i + 2]); it != specIds.end()) {
+        bool value = std::any_of(data + it->second->offset,
+                                 data + it->second->offset + it->second->size,
+                                 [](std::byte b) { return b != std::byte{}; });
+        words[i] = (count << 16) |
+                   (value ? OpSpecConstantTrue : OpSpecConstantFalse);
+      }
+    } else if (op == OpSpecConstant && count > 3) {
+      // Narrower values are zero extended, the type isn't tracked.
+      if (auto it = specIds.find(words[i + 2]); it != specIds.end()) {
+        auto literal = std::as_writable_bytes(words.subspan(i + 3, count - 3));
+        std::ranges::fill(literal, std::byte{});
+        std::memcpy(literal.data(), data + it->second->offset,
+                    std::min(literal.size(), it->second->size));
+      }
+    }
+    i += count;
+  }
+
+  return ret;
+}
+
+}; // namespace impl
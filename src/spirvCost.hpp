@@ -0,0 +1,355 @@
+#pragma once
+#include "util.hpp"
+#include <algorithm>
+#include <format>
+#include <set>
+#include <span>
+#include <sstream>
+
+namespace util::spirv {
+
+// What one pass over a module's instruction stream tells about its cost.
+// Counts are static, a loop body counts once no matter how often it runs.
+struct Cost {
+  uint32_t words = 0;
+  uint32_t instructions = 0;
+  uint32_t alu = 0;
+  uint32_t memory = 0;
+  uint32_t texture = 0;
+  uint32_t branches = 0;
+  uint32_t loops = 0;
+  uint32_t calls = 0;
+  uint32_t descriptors = 0;
+  uint32_t pushConstants = 0;
+  // Most SSA values alive at once in any function, back edges ignored. Zero
+  // when the header's id bound doesn't fit the module.
+  uint32_t livePeak = 0;
+
+  // Rough weights, only meant to order shaders for triage.
+  auto estimate() const -> uint64_t {
+    return alu + 4ull * memory + 8ull * texture + 2ull * branches +
+           16ull * loops + 4ull * livePeak;
+  }
+};
+
+namespace impl {
+
+enum Op : uint32_t {
+  OpExtInst = 12,
+  OpFunction = 54,
+  OpFunctionEnd = 56,
+  OpFunctionCall = 57,
+  OpVariable = 59,
+  OpLoad = 61,
+  OpCopyMemorySized = 64,
+  OpDecorate = 71,
+  OpImageSampleImplicitLod = 87,
+  OpImageWrite = 99,
+  OpConvertFToU = 109,
+  OpBitcast = 124,
+  OpSNegate = 126,
+  OpSMulExtended = 152,
+  OpAny = 154,
+  OpFUnordGreaterThanEqual = 191,
+  OpShiftRightLogical = 194,
+  OpBitCount = 205,
+  OpDPdx = 207,
+  OpFwidthCoarse = 215,
+  OpAtomicLoad = 227,
+  OpAtomicXor = 242,
+  OpLoopMerge = 246,
+  OpSelectionMerge = 247,
+  OpLabel = 248,
+  OpBranchConditional = 250,
+  OpSwitch = 251,
+  OpImageSparseSampleImplicitLod = 305,
+  OpImageSparseDrefGather = 315,
+  OpImageSparseRead = 320,
+};
+
+constexpr uint32_t DecorationBinding = 33;
+constexpr uint32_t StorageClassPushConstant = 9;
+
+constexpr auto inRange(uint32_t op, Op first, Op last) -> bool {
+  return op >= first && op <= last;
+}
+
+constexpr auto isALU(uint32_t op) -> bool {
+  return op == OpExtInst || inRange(op, OpConvertFToU, OpBitcast) ||
+         inRange(op, OpSNegate, OpSMulExtended) ||
+         inRange(op, OpAny, OpFUnordGreaterThanEqual) ||
+         inRange(op, OpShiftRightLogical, OpBitCount) ||
+         inRange(op, OpDPdx, OpFwidthCoarse);
+}
+
+constexpr auto isMemory(uint32_t op) -> bool {
+  return inRange(op, OpLoad, OpCopyMemorySized) ||
+         inRange(op, OpAtomicLoad, OpAtomicXor);
+}
+
+constexpr auto isTexture(uint32_t op) -> bool {
+  return inRange(op, OpImageSampleImplicitLod, OpImageWrite) ||
+         inRange(op, OpImageSparseSampleImplicitLod,
+                 OpImageSparseDrefGather) ||
+         op == OpImageSparseRead;
+}
+
+// Instructions inside a function body without <result type> <result id>.
+constexpr auto hasNoResult(uint32_t op) -> bool {
+  switch (op) {
+  case 0:    // OpNop
+  case 8:    // OpLine
+  case 62:   // OpStore
+  case 63:   // OpCopyMemory
+  case 64:   // OpCopyMemorySized
+  case 99:   // OpImageWrite
+  case 218:  // OpEmitVertex
+  case 219:  // OpEndPrimitive
+  case 220:  // OpEmitStreamVertex
+  case 221:  // OpEndStreamPrimitive
+  case 224:  // OpControlBarrier
+  case 225:  // OpMemoryBarrier
+  case 228:  // OpAtomicStore
+  case 246:  // OpLoopMerge
+  case 247:  // OpSelectionMerge
+  case 248:  // OpLabel, has an id but no value
+  case 249:  // OpBranch
+  case 250:  // OpBranchConditional
+  case 251:  // OpSwitch
+  case 252:  // OpKill
+  case 253:  // OpReturn
+  case 254:  // OpReturnValue
+  case 255:  // OpUnreachable
+  case 256:  // OpLifetimeStart
+  case 257:  // OpLifetimeStop
+  case 317:  // OpNoLine
+  case 4416: // OpTerminateInvocation
+  case 4445: // OpTraceRayKHR
+  case 4446: // OpExecuteCallableKHR
+  case 4448: // OpIgnoreIntersectionKHR
+  case 4449: // OpTerminateRayKHR
+  case 5294: // OpEmitMeshTasksEXT
+  case 5295: // OpSetMeshOutputsEXT
+  case 5364: // OpBeginInvocationInterlockEXT
+  case 5365: // OpEndInvocationInterlockEXT
+  case 5380: // OpDemoteToHelperInvocation
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Live ranges of the values defined in the current function, as instruction
+// indices. Operand words that happen to look like ids of values defined
+// earlier count as uses, that's close enough for an estimate.
+class LiveRanges {
+public:
+  explicit LiveRanges(uint32_t bound) : def(bound, none), last(bound, 0) {}
+
+  auto define(uint32_t id) -> void {
+    if (id >= def.size())
+      return;
+    def[id] = index;
+    last[id] = index;
+    defined.push_back(id);
+  }
+
+  auto use(uint32_t id) -> void {
+    if (id < def.size() && def[id] != none)
+      last[id] = index;
+  }
+
+  auto next() -> void { ++index; }
+
+  // Sweeps the function's ranges and forgets them.
+  auto endFunction() -> uint32_t {
+    auto delta = std::vector<int32_t>(index + 2, 0);
+    for (auto id : defined) {
+      ++delta[def[id]];
+      --delta[last[id] + 1];
+      def[id] = none;
+    }
+
+    int32_t live = 0, peak = 0;
+    for (auto d : delta)
+      peak = std::max(peak, live += d);
+
+    defined.clear();
+    index = 0;
+    return static_cast<uint32_t>(peak);
+  }
+
+private:
+  static constexpr uint32_t none = ~0u;
+
+  std::vector<uint32_t> def;
+  std::vector<uint32_t> last;
+  std::vector<uint32_t> defined;
+  uint32_t index = 0;
+};
+
+} // namespace impl
+
+// Single streaming pass over the words, nothing but the live range table is
+// allocated. Returns an empty cost for anything that isn't SPIR-V.
+inline auto analyze(std::span<const uint32_t> code) -> Cost {
+  using namespace impl;
+
+  Cost cost;
+  if (code.size() < 5 || code[0] != util::SPIRVMagic)
+    return cost;
+
+  cost.words = static_cast<uint32_t>(code.size());
+
+  // The bound comes from the application and sizes the live range table.
+  // Ids are defined by instructions of the module, so a bound far past its
+  // size is a broken header: live ranges are skipped instead.
+  auto bound = code[3] <= 2 * code.size() ? code[3] : 0;
+  LiveRanges ranges(static_cast<uint32_t>(bound));
+  bool inFunction = false;
+
+  for (size_t i = 5; i < code.size();) {
+    auto op = code[i] & 0xffff;
+    auto count = code[i] >> 16;
+    if (!count || i + count > code.size())
+      break;
+
+    auto operands = code.subspan(i + 1, count - 1);
+    i += count;
+    ++cost.instructions;
+
+    if (op == OpDecorate && operands.size() >= 2 &&
+        operands[1] == DecorationBinding)
+      ++cost.descriptors;
+    else if (op == OpVariable && operands.size() >= 3 &&
+             operands[2] == StorageClassPushConstant)
+      ++cost.pushConstants;
+
+    if (op == OpFunction) {
+      inFunction = true;
+      continue;
+    }
+    if (op == OpFunctionEnd) {
+      inFunction = false;
+      cost.livePeak = std::max(cost.livePeak, ranges.endFunction());
+      continue;
+    }
+    if (!inFunction)
+      continue;
+
+    cost.alu += isALU(op);
+    cost.memory += isMemory(op);
+    cost.texture += isTexture(op);
+    cost.branches += op == OpBranchConditional || op == OpSwitch;
+    cost.loops += op == OpLoopMerge;
+    cost.calls += op == OpFunctionCall;
+
+    ranges.next();
+    if (hasNoResult(op) || operands.size() < 2) {
+      for (auto word : operands)
+        ranges.use(word);
+      continue;
+    }
+
+    for (auto word : operands.subspan(2))
+      ranges.use(word);
+    ranges.define(operands[1]);
+  }
+
+  return cost;
+}
+
+inline auto analyze(std::span<const std::byte> code) -> Cost {
+  if (code.size() % sizeof(uint32_t))
+    return {};
+
+  // Dumped code comes straight from a create info or a vector, both are
+  // aligned for uint32_t.
+  return analyze(std::span(reinterpret_cast<const uint32_t *>(code.data()),
+                           code.size() / sizeof(uint32_t)));
+}
+
+// FNV-1a of the first words after the header. Together with the size it
+// tells most modules apart without hashing them, see impl::Prefilter.
+constexpr size_t signatureWords = 8;
+
+inline auto signature(std::span<const std::byte> code) -> uint64_t {
+  auto body = code.subspan(std::min(code.size(), 5 * sizeof(uint32_t)));
+  body = body.first(std::min(body.size(), signatureWords * sizeof(uint32_t)));
+
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (auto byte : body)
+    hash = (hash ^ uint8_t(byte)) * 0x100000001b3ull;
+  return hash;
+}
+
+// Size and signature are of the code the application passed, so they can be
+// matched against modules before any hashing.
+struct IndexRow {
+  std::string stage;
+  std::string hash;
+  Cost cost;
+  size_t size = 0;
+  uint64_t head = 0;
+};
+
+// `index.csv` of a dump directory, most expensive shader first. Rows of
+// earlier runs that `rows` doesn't cover are kept.
+class CostIndex {
+public:
+  static constexpr auto header =
+      "cost,stage,hash,words,alu,memory,texture,branches,loops,calls,"
+      "descriptors,push_constants,live_peak,size,head";
+
+  static auto write(const std::filesystem::path &dir,
+                    const std::vector<IndexRow> &rows) -> void {
+    auto path = dir / "index.csv";
+
+    auto lines = std::vector<std::pair<uint64_t, std::string>>();
+    auto fresh = std::set<std::string>();
+    for (const auto &row : rows) {
+      fresh.insert(row.stage + "," + row.hash);
+      lines.emplace_back(row.cost.estimate(), format(row));
+    }
+
+    std::ifstream old(path);
+    for (std::string line; std::getline(old, line);) {
+      auto first = line.find(',');
+      auto second = line.find(',', first + 1);
+      auto third = line.find(',', second + 1);
+      if (line.starts_with("cost,") || third == std::string::npos ||
+          fresh.contains(line.substr(first + 1, third - first - 1)))
+        continue;
+      lines.emplace_back(std::strtoull(line.c_str(), nullptr, 10), line);
+    }
+    old.close();
+
+    std::ranges::stable_sort(lines, std::greater{},
+                             &std::pair<uint64_t, std::string>::first);
+
+    auto out = std::ostringstream();
+    out << header << "\n";
+    for (const auto &[_, line] : lines)
+      out << line << "\n";
+
+    auto tmp = path;
+    tmp += ".tmp";
+    if (std::ofstream file(tmp); file.is_open())
+      file << out.str();
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+  }
+
+private:
+  static auto format(const IndexRow &row) -> std::string {
+    const auto &c = row.cost;
+    return std::format("{},{},{},{},{},{},{},{},{},{},{},{},{},{},{:016x}",
+                       c.estimate(), row.stage, row.hash, c.words, c.alu,
+                       c.memory, c.texture, c.branches, c.loops, c.calls,
+                       c.descriptors, c.pushConstants, c.livePeak, row.size,
+                       row.head);
+  }
+};
+
+} // namespace util::spirv
@@ -0,0 +1,77 @@
+#pragma once
+#include "util.hpp"
+#include <expected>
+#include <format>
+#include <span>
+#include <spirv-tools/optimizer.hpp>
+
+namespace util::spirv {
+
+// The oldest Vulkan environment that accepts the module's SPIR-V version,
+// so the validator run by the optimizer holds it to the right rules.
+inline auto targetEnv(uint32_t version) -> spv_target_env {
+  switch ((version >> 8) & 0xff) {
+  case 0:
+  case 1:
+  case 2:
+    return SPV_ENV_VULKAN_1_0;
+  case 3:
+    return SPV_ENV_VULKAN_1_1;
+  case 4:
+    return SPV_ENV_VULKAN_1_1_SPIRV_1_4;
+  case 5:
+    return SPV_ENV_VULKAN_1_2;
+  default:
+    return SPV_ENV_VULKAN_1_3;
+  }
+}
+
+// spirv-opt's `-O` and `-Os`, or a list of its pass flags separated by
+// spaces or commas, e.g. "--merge-return,--eliminate-dead-code-aggressive".
+// The leading dashes may be left out.
+inline auto recipeFlags(std::string_view recipe) -> std::vector<std::string> {
+  auto flags = std::vector<std::string>();
+  size_t start = 0;
+  while (start < recipe.size()) {
+    auto end = recipe.find_first_of(" ,", start);
+    if (end == std::string_view::npos)
+      end = recipe.size();
+
+    auto flag = std::string(recipe.substr(start, end - start));
+    if (!flag.empty())
+      flags.push_back(flag.starts_with("-") ? flag : "--" + flag);
+    start = end + 1;
+  }
+  return flags;
+}
+
+inline auto optimize(std::span<const uint32_t> code, std::string_view recipe)
+    -> std::expected<std::vector<uint32_t>, std::string> {
+  if (code.size() < 5 || code[0] != util::SPIRVMagic)
+    return std::unexpected("not SPIR-V");
+
+  spvtools::Optimizer optimizer(targetEnv(code[1]));
+  auto messages = std::string();
+  optimizer.SetMessageConsumer(
+      [&messages](spv_message_level_t level, const char *,
+                  const spv_position_t &, const char *message) {
+        if (level <= SPV_MSG_ERROR)
+          messages += std::format("{}\n", message);
+      });
+
+  auto flags = recipeFlags(recipe);
+  if (flags.size() == 1 && flags[0] == "-O")
+    optimizer.RegisterPerformancePasses();
+  else if (flags.size() == 1 && flags[0] == "-Os")
+    optimizer.RegisterSizePasses();
+  else if (flags.empty() || !optimizer.RegisterPassesFromFlags(flags))
+    return std::unexpected(std::format("bad recipe \"{}\"\n{}", recipe,
+                                       messages));
+
+  auto out = std::vector<uint32_t>();
+  if (!optimizer.Run(code.data(), code.size(), &out))
+    return std::unexpected(messages);
+  return out;
+}
+
+} // namespace util::spirv
@@ -0,0 +1,43 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+namespace util {
+
+// Dump folder and GLSL extension of a shader stage.
+struct StageInfo {
+  std::string_view folder;
+  std::string_view ext;
+};
+
+// Indexed by the bit position of the VkShaderStageFlagBits value.
+constexpr std::array<StageInfo, 32> stageInfos = [] {
+  std::array<StageInfo, 32> infos;
+  infos.fill({"Unknown", "glsl"});
+
+  infos[0] = {"VS", "vert"};
+  infos[1] = {"TS_Control", "tesc"};
+  infos[2] = {"TS_evaluation", "tese"};
+  infos[3] = {"GS", "geom"};
+  infos[4] = {"FS", "frag"};
+  infos[5] = {"CS", "comp"};
+  infos[6] = {"Task", "task"};
+  infos[7] = {"Mesh", "mesh"};
+  infos[8] = {"RayGen", "rgen"};
+  infos[9] = {"AnyHit", "rahit"};
+  infos[10] = {"ClosestHit", "rchit"};
+  infos[11] = {"Miss", "rmiss"};
+  infos[12] = {"Intersection", "rint"};
+  infos[13] = {"Callable", "rcall"};
+  infos[14] = {"SubpassShading", "glsl"};
+  infos[19] = {"ClusterCulling", "glsl"};
+  return infos;
+}();
+
+constexpr auto stageInfo(uint32_t stageBit) -> const StageInfo & {
+  return stageInfos[std::countr_zero(stageBit) & 31];
+}
+
+} // namespace util
@@ -0,0 +1,148 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace util {
+
+// Work-stealing pool: every worker owns a deque, pops its own work from the
+// back and steals from the front of the others once it runs dry. Tasks
+// submitted from a worker stay on that worker's deque.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t threadCount = defaultThreadCount()) {
+    threadCount = threadCount ? threadCount : 1;
+
+    queues.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+      queues.push_back(std::make_unique<Queue>());
+
+    workers.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+      workers.emplace_back([this, i] { workerLoop(i); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> l(sleepLock);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  template <typename F>
+  auto submit(F &&func) -> std::future<std::invoke_result_t<F>> {
+    using R = std::invoke_result_t<F>;
+
+    auto task =
+        std::make_shared<std::packaged_task<R()>>(std::forward<F>(func));
+    auto future = task->get_future();
+
+    auto index = currentPool == this
+                     ? currentIndex
+                     : nextQueue.fetch_add(1, std::memory_order_relaxed) %
+                           queues.size();
+
+    // Counted before it's visible so a thief can't take pending below zero.
+    {
+      std::lock_guard<std::mutex> l(sleepLock);
+      ++pending;
+    }
+    {
+      std::lock_guard<std::mutex> l(queues[index]->lock);
+      queues[index]->tasks.emplace_back([task] { (*task)(); });
+    }
+    wakeup.notify_one();
+    return future;
+  }
+
+  auto size() const -> size_t { return workers.size(); }
+
+  // Whether the calling thread is one of this pool's workers. Those mustn't
+  // wait on the pool's futures, once every worker does nothing runs them.
+  auto isWorker() const -> bool { return currentPool == this; }
+
+  static auto defaultThreadCount() -> size_t {
+    auto count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+  }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  auto popOwn(size_t index) -> std::function<void()> {
+    auto &queue = *queues[index];
+    std::lock_guard<std::mutex> l(queue.lock);
+    if (queue.tasks.empty())
+      return {};
+
+    auto task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return task;
+  }
+
+  auto steal(size_t thief) -> std::function<void()> {
+    for (size_t i = 1; i < queues.size(); ++i) {
+      auto &queue = *queues[(thief + i) % queues.size()];
+      std::lock_guard<std::mutex> l(queue.lock);
+      if (queue.tasks.empty())
+        continue;
+
+      auto task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return task;
+    }
+    return {};
+  }
+
+  auto workerLoop(size_t index) -> void {
+    currentPool = this;
+    currentIndex = index;
+
+    for (;;) {
+      auto task = popOwn(index);
+      if (!task)
+        task = steal(index);
+
+      if (task) {
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> l(sleepLock);
+      wakeup.wait(l, [this] { return stopping || pending > 0; });
+      if (stopping && pending == 0)
+        return;
+    }
+  }
+
+  static inline thread_local const ThreadPool *currentPool = nullptr;
+  static inline thread_local size_t currentIndex = 0;
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> nextQueue = 0;
+
+  std::mutex sleepLock;
+  std::condition_variable wakeup;
+  std::atomic<size_t> pending = 0;
+  bool stopping = false;
+};
+
+} // namespace util
@@ -0,0 +1,286 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Binary event trace of the layer's own work, for lining it up with the
+// application's traces. `shader-guts trace` turns it into Chrome trace JSON,
+// which Perfetto opens as well.
+namespace util::trace {
+
+enum class Type : uint16_t {
+  moduleCreate,
+  graphicsPipelines,
+  computePipelines,
+  shadersCreate,
+  hash,
+  dump,
+  overrideHit,
+  compile,
+  rayTracingPipelines,
+  count,
+};
+
+constexpr std::array<std::string_view, size_t(Type::count)> typeNames{
+    "ModuleCreate", "GraphicsPipelines", "ComputePipelines", "ShadersCreate",
+    "Hash",         "Dump",              "OverrideHit",      "Compile",
+    "RayTracingPipelines",
+};
+
+enum class Phase : uint16_t { begin = 'B', end = 'E', instant = 'i' };
+
+struct Event {
+  uint64_t time; // CLOCK_MONOTONIC, ns
+  uint64_t arg;
+  uint32_t tid;
+  Type type;
+  Phase phase;
+};
+
+struct FileHeader {
+  std::array<char, 8> magic;
+  uint32_t version;
+  uint32_t pid;
+  uint64_t events;
+  uint64_t dropped;
+};
+
+constexpr std::array<char, 8> fileMagic{'V', 'K', 'S', 'G', 'T', 'R', 'C', '1'};
+constexpr uint32_t fileVersion = 1;
+
+// Off until Tracer::start(), checked before anything else is touched.
+inline std::atomic<bool> enabled = false;
+
+// First 16 hex digits of a shader hash, as an event argument.
+inline auto hashArg(std::string_view hash) -> uint64_t {
+  uint64_t arg = 0;
+  for (char c : hash.substr(0, 16))
+    arg = (arg << 4) | (c <= '9' ? c - '0' : c - 'a' + 10);
+  return arg;
+}
+
+class Tracer {
+public:
+  static auto get() -> Tracer & {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  ~Tracer() { stop(); }
+
+  auto start(const std::filesystem::path &path) -> void {
+    std::call_once(started, [&] { open(path); });
+  }
+
+  auto record(Type type, Phase phase, uint64_t arg) -> void {
+    thread_local RingLease lease(*this);
+    lease.ring->push({now(), arg, lease.ring->tid, type, phase});
+  }
+
+private:
+  // Single producer (its thread), single consumer (the flusher).
+  struct Ring {
+    static constexpr uint32_t size = 4096;
+
+    auto push(const Event &event) -> void {
+      auto h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) == size) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      events[h % size] = event;
+      head.store(h + 1, std::memory_order_release);
+    }
+
+    template <typename F> auto drain(F &&sink) -> void {
+      auto t = tail.load(std::memory_order_relaxed);
+      auto h = head.load(std::memory_order_acquire);
+      for (; t != h; ++t)
+        sink(events[t % size]);
+      tail.store(t, std::memory_order_release);
+    }
+
+    uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    std::array<Event, size> events;
+    std::atomic<uint32_t> head = 0;
+    std::atomic<uint32_t> tail = 0;
+    std::atomic<uint64_t> dropped = 0;
+  };
+
+  // A thread's ring, handed back when the thread exits so the next new
+  // thread reuses it. Apps that keep spawning threads then hold as many
+  // rings as they have threads at once, not one per thread ever started.
+  struct RingLease {
+    explicit RingLease(Tracer &tracer)
+        : tracer(tracer), ring(tracer.acquireRing()) {}
+    ~RingLease() { tracer.releaseRing(ring); }
+
+    RingLease(const RingLease &) = delete;
+    RingLease &operator=(const RingLease &) = delete;
+
+    Tracer &tracer;
+    Ring *ring;
+  };
+
+  // Room for this many events is mapped up front, the file is truncated to
+  // what was actually written on stop().
+  static constexpr size_t maxEvents = 1 << 20;
+
+  Tracer() = default;
+
+  static auto now() -> uint64_t {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+  auto open(const std::filesystem::path &path) -> void {
+    mapSize = sizeof(FileHeader) + maxEvents * sizeof(Event);
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, mapSize) != 0) {
+      std::clog << "[VK_SHADER_GUTS][err]: Can't create trace " << path
+                << "\n";
+      return;
+    }
+
+    auto map =
+        mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      std::clog << "[VK_SHADER_GUTS][err]: Can't map trace " << path << "\n";
+      return;
+    }
+
+    header = static_cast<FileHeader *>(map);
+    *header = {fileMagic, fileVersion, static_cast<uint32_t>(getpid()), 0, 0};
+    events = reinterpret_cast<Event *>(header + 1);
+
+    flusher = std::thread([this] { flushLoop(); });
+    enabled.store(true, std::memory_order_release);
+
+    std::clog << "[VK_SHADER_GUTS][log]: Trace: " << path << "\n";
+  }
+
+  auto stop() -> void {
+    if (!header)
+      return;
+
+    enabled.store(false, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    flusher.join();
+
+    flush();
+    auto used = sizeof(FileHeader) + header->events * sizeof(Event);
+    munmap(header, mapSize);
+    header = nullptr;
+
+    if (ftruncate(fd, used) != 0)
+      std::clog << "[VK_SHADER_GUTS][err]: Can't truncate trace\n";
+    close(fd);
+  }
+
+  // Rings are never freed, what a released one holds still gets flushed.
+  // Its events carry the old thread's id, the ring takes the new one's.
+  auto acquireRing() -> Ring * {
+    std::lock_guard<std::mutex> l(lock);
+    if (freeRings.empty())
+      return rings.emplace_back(std::make_unique<Ring>()).get();
+
+    auto *ring = freeRings.back();
+    freeRings.pop_back();
+    ring->tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    return ring;
+  }
+
+  auto releaseRing(Ring *ring) -> void {
+    std::lock_guard<std::mutex> l(lock);
+    freeRings.push_back(ring);
+  }
+
+  auto flush() -> void {
+    std::lock_guard<std::mutex> l(lock);
+
+    uint64_t dropped = 0;
+    for (auto &ring : rings) {
+      ring->drain([&](const Event &event) {
+        if (header->events < maxEvents)
+          events[header->events++] = event;
+        else
+          ++dropped;
+      });
+      dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    header->dropped += dropped;
+  }
+
+  auto flushLoop() -> void {
+    using namespace std::chrono_literals;
+
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> l(lock);
+        if (wakeup.wait_for(l, 50ms, [this] { return stopping; }))
+          return;
+      }
+      flush();
+    }
+  }
+
+  std::once_flag started;
+  int fd = -1;
+  size_t mapSize = 0;
+  FileHeader *header = nullptr;
+  Event *events = nullptr;
+
+  std::mutex lock;
+  std::condition_variable wakeup;
+  bool stopping = false;
+  std::vector<std::unique_ptr<Ring>> rings;
+  std::vector<Ring *> freeRings;
+  std::thread flusher;
+};
+
+// The whole cost of a disabled trace is this branch.
+inline auto record(Type type, Phase phase, uint64_t arg = 0) -> void {
+  if (enabled.load(std::memory_order_relaxed)) [[unlikely]]
+    Tracer::get().record(type, phase, arg);
+}
+
+// Begin/end pair around a scope.
+class Scope {
+public:
+  explicit Scope(Type type, uint64_t arg = 0) : type(type) {
+    record(type, Phase::begin, arg);
+  }
+  ~Scope() { record(type, Phase::end); }
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+private:
+  Type type;
+};
+
+} // namespace util::trace
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <array>
+#include <charconv>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
@@ -8,35 +11,13 @@
 #include <iterator>
 #include <map>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
 #include <vector>
 
-#include <spirv_cross/spirv_cross.hpp>
-#include <spirv_cross/spirv_glsl.hpp>
-
 namespace util {
 
-inline auto SaveGLSLToFile(const std::vector<std::byte> &shader,
-                           std::filesystem::path path) -> void {
-  // need to convert into v<uint32_t>
-  spirv_cross::CompilerGLSL compiler(
-      std::vector<uint32_t>(reinterpret_cast<const uint32_t *>(shader.data()),
-                            reinterpret_cast<const uint32_t *>(shader.data()) +
-                                (shader.size() / sizeof(uint32_t))));
-  spirv_cross::ShaderResources resources = compiler.get_shader_resources();
-
-  spirv_cross::CompilerGLSL::Options options;
-  options.vulkan_semantics = true;
-  compiler.set_common_options(options);
-
-  std::string glslCode = compiler.compile();
-
-  if (std::ofstream file(path, std::ios::binary); file.is_open()) {
-    file.write(glslCode.c_str(), glslCode.size());
-    file.close();
-  }
-}
-
 inline auto getEnv(std::string_view env) -> std::optional<std::string> {
   if (auto value = std::getenv(env.data()))
     return std::string(value);
@@ -70,6 +51,34 @@ inline auto envContainsString(std::string_view var, std::string &str) -> bool {
   return env != std::nullopt;
 }
 
+// Byte counts such as "512", "64k" or "1g".
+inline auto parseBytes(std::string_view text) -> std::optional<uint64_t> {
+  uint64_t scale = 1;
+  switch (text.empty() ? 0 : text.back()) {
+  case 'k':
+  case 'K':
+    scale = 1ull << 10;
+    break;
+  case 'm':
+  case 'M':
+    scale = 1ull << 20;
+    break;
+  case 'g':
+  case 'G':
+    scale = 1ull << 30;
+    break;
+  }
+  if (scale != 1)
+    text.remove_suffix(1);
+
+  uint64_t value = 0;
+  auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != std::errc() || end != text.data() + text.size())
+    return std::nullopt;
+  return value * scale;
+}
+
 // Thanks to the DXVK project for this util class. I'm a little bit confused
 // why there is no optimal (size/functions) package in vcpkg for sha1.
 // https://github.com/doitsujin/dxvk
@@ -88,6 +97,9 @@ public:
 
   std::string toString() const;
 
+  // Writes the 40 hex digits toString() returns, without allocating.
+  void toChars(char *out) const;
+
   uint32_t dword(uint32_t id) const {
     return uint32_t(m_digest[4 * id + 0]) << 0 |
            uint32_t(m_digest[4 * id + 1]) << 8 |
@@ -116,16 +128,55 @@ private:
   Sha1Digest m_digest;
 };
 
-template <typename T>
-inline void SaveSPVToFile(const std::vector<T> &code,
-                          const std::string &filename) {
+// Hex digest stored inline, so the intercepts can hash and compare shaders
+// without allocating. Empty until assigned.
+class HexHash {
+public:
+  HexHash() = default;
+  explicit HexHash(const Sha1Hash &hash) : length(digits.size()) {
+    hash.toChars(digits.data());
+  }
+
+  auto view() const -> std::string_view { return {digits.data(), length}; }
+  operator std::string_view() const { return view(); }
+  auto str() const -> std::string { return std::string(view()); }
+  auto empty() const -> bool { return !length; }
+
+  auto operator==(const HexHash &other) const -> bool {
+    return view() == other.view();
+  }
+
+private:
+  std::array<char, 40> digits{};
+  size_t length = 0;
+};
+
+inline void SaveBinaryFile(std::span<const std::byte> code,
+                           const std::string &filename) {
   if (std::ofstream file(filename, std::ios::binary); file.is_open()) {
-    file.write(reinterpret_cast<const char *>(code.data()),
-               code.size() * sizeof(T));
+    file.write(reinterpret_cast<const char *>(code.data()), code.size());
     file.close();
   }
 }
 
+template <typename T>
+inline void SaveSPVToFile(const std::vector<T> &code,
+                          const std::string &filename) {
+  SaveBinaryFile(std::as_bytes(std::span(code)), filename);
+}
+
+constexpr uint32_t SPIRVMagic = 0x07230203;
+
+// Header is five words: magic, version, generator, bound, schema.
+inline auto isSPIRV(const std::vector<std::byte> &code) -> bool {
+  if (code.size() < 5 * sizeof(uint32_t) || code.size() % sizeof(uint32_t))
+    return false;
+
+  uint32_t magic;
+  std::memcpy(&magic, code.data(), sizeof(magic));
+  return magic == SPIRVMagic;
+}
+
 inline auto LoadFile(std::filesystem::path path) -> std::string {
   if (path.empty() || !std::filesystem::exists(path)) {
     std::cerr << "[VK_SHADER_GUTS][err]: Can't find file: " << path << "\n";
@@ -140,13 +191,8 @@ inline auto LoadFile(std::filesystem::path path) -> std::string {
   return {};
 }
 
-inline auto LoadSPRV(std::filesystem::path path) -> std::vector<std::byte> {
-  if (path.empty() || !std::filesystem::exists(path)) {
-    std::clog << "[VK_SHADER_GUTS][err]: Can't find shader to load: " << path
-              << "\n";
-    return {};
-  }
-
+inline auto LoadBinaryFile(std::filesystem::path path)
+    -> std::vector<std::byte> {
   std::vector<std::byte> ret;
 
   if (std::ifstream file(path, std::ios::ate | std::ios::binary);
@@ -160,6 +206,16 @@ inline auto LoadSPRV(std::filesystem::path path) -> std::vector<std::byte> {
   return ret;
 }
 
+inline auto LoadSPRV(std::filesystem::path path) -> std::vector<std::byte> {
+  if (path.empty() || !std::filesystem::exists(path)) {
+    std::clog << "[VK_SHADER_GUTS][err]: Can't find shader to load: " << path
+              << "\n";
+    return {};
+  }
+
+  return LoadBinaryFile(path);
+}
+
 using Sha1Digest = std::array<uint8_t, 20>;
 
 struct Sha1Data {
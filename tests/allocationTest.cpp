@@ -0,0 +1,186 @@
+#include "guts.hpp"
+#include "testUtil.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <new>
+
+namespace {
+
+thread_local bool counting = false;
+std::atomic<size_t> allocations = 0;
+
+// Counts the calls to global operator new on this thread while alive.
+class CountAllocations {
+public:
+  CountAllocations() {
+    allocations = 0;
+    counting = true;
+  }
+  ~CountAllocations() { counting = false; }
+
+  auto count() const -> size_t { return allocations.load(); }
+};
+
+} // namespace
+
+void *operator new(size_t size) {
+  if (counting)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// Two modules and an inline stage, in four graphics pipelines: two of them
+// with the inline stage. `pipelines` gives each created pipeline a handle,
+// as a driver would.
+class GraphicsBatch {
+public:
+  GraphicsBatch(impl::ShaderGuts &guts, std::vector<uint32_t> vertexCode,
+                std::vector<uint32_t> fragmentCode,
+                std::vector<uint32_t> inlineCode)
+      : guts(guts), vertexCode(std::move(vertexCode)),
+        fragmentCode(std::move(fragmentCode)),
+        inlineCode(std::move(inlineCode)) {
+    inlineInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    inlineInfo.codeSize = this->inlineCode.size() * sizeof(uint32_t);
+    inlineInfo.pCode = this->inlineCode.data();
+
+    for (auto &stage : stages)
+      stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    stages[0].module = createModule(this->vertexCode, 1);
+    stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[1].module = createModule(this->fragmentCode, 2);
+    stages[2].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stages[2].pNext = &inlineInfo;
+
+    for (size_t i = 0; i < std::size(infos); ++i) {
+      infos[i].sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+      infos[i].stageCount = 2;
+      infos[i].pStages = i % 2 ? stages : stages + 1;
+    }
+  }
+
+  // Returns whether any stage was replaced.
+  auto create(uint64_t firstHandle = 0) -> bool {
+    util::Arena::Scope scratch;
+    auto batch = guts.CreateGraphicsPipelines(device, 4, infos);
+    bool replaced = batch.replaced && !batch.patches.empty();
+    VkPipeline pipelines[4]{};
+    if (firstHandle)
+      for (size_t i = 0; i < std::size(pipelines); ++i)
+        pipelines[i] = reinterpret_cast<VkPipeline>(firstHandle + i);
+    guts.CreateGraphicsPipelinesPost(device, 4, infos, pipelines,
+                                     std::move(batch));
+    return replaced;
+  }
+
+private:
+  auto createModule(const std::vector<uint32_t> &code, uint64_t handle)
+      -> VkShaderModule {
+    VkShaderModuleCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    info.codeSize = code.size() * sizeof(uint32_t);
+    info.pCode = code.data();
+    auto module = reinterpret_cast<VkShaderModule>(handle);
+    guts.CreateShaderModulePost(device, module,
+                                guts.CreateShaderModulePre(&info));
+    return module;
+  }
+
+  impl::ShaderGuts &guts;
+  impl::ShaderGuts::DeviceShaders device;
+  std::vector<uint32_t> vertexCode, fragmentCode, inlineCode;
+  VkShaderModuleCreateInfo inlineInfo{};
+  VkPipelineShaderStageCreateInfo stages[3]{};
+  VkGraphicsPipelineCreateInfo infos[4]{};
+};
+
+// Loading overrides with nothing to dump, the layer's hot path: once the
+// overrides are built, creates only use the calling thread's arena.
+class Allocations : public ::testing::Test {
+protected:
+  Allocations()
+      : overrides("shader-guts-alloc"),
+        loadPath("VK_SHADER_GUTS_LOAD_PATH", overrides.path.string()) {}
+
+  auto writeOverride(const std::vector<uint32_t> &original) -> void {
+    util::SaveSPVToFile(test::spirv(0xff, original.size()),
+                        (overrides.path / (test::hashOf(original) + ".spv"))
+                            .string());
+  }
+
+  test::TempDir overrides;
+  test::ScopedEnv loadPath;
+};
+
+TEST_F(Allocations, GraphicsPipelineCreatesStayInTheArena) {
+  auto replaced = test::spirv(1);
+  auto inlined = test::spirv(3, 96);
+  writeOverride(replaced);
+  writeOverride(inlined);
+
+  impl::ShaderGuts guts;
+  GraphicsBatch batch(guts, replaced, test::spirv(2, 80), inlined);
+
+  // Builds the overrides and sets up the thread's arena and trace ring.
+  for (int i = 0; i < 3; ++i)
+    ASSERT_TRUE(batch.create());
+
+  CountAllocations counter;
+  for (int i = 0; i < 100; ++i)
+    batch.create();
+  EXPECT_EQ(counter.count(), 0u);
+}
+
+// With dumping on, shaders that were already dumped are turned down
+// without allocating, whether they came in a module or inline.
+class DumpAllocations : public ::testing::Test {
+protected:
+  DumpAllocations()
+      : dump("shader-guts-alloc-dump"),
+        dumpPath("VK_SHADER_GUTS_DUMP_PATH", dump.path.string()) {}
+
+  test::TempDir dump;
+  test::ScopedEnv dumpPath;
+};
+
+TEST_F(DumpAllocations, RepeatedCreatesDontDumpAgain) {
+  impl::ShaderGuts guts;
+  GraphicsBatch batch(guts, test::spirv(1), test::spirv(2, 80),
+                      test::spirv(3, 96));
+
+  // Dumps everything once.
+  for (int i = 0; i < 3; ++i)
+    EXPECT_FALSE(batch.create());
+
+  CountAllocations counter;
+  for (int i = 0; i < 100; ++i)
+    batch.create();
+  EXPECT_EQ(counter.count(), 0u);
+}
+
+// Pipelines the driver created are recorded for pipelines.csv once, later
+// creates of the same ones are skipped before hashing.
+TEST_F(DumpAllocations, RepeatedPipelinesArentRecordedAgain) {
+  impl::ShaderGuts guts;
+  GraphicsBatch batch(guts, test::spirv(1), test::spirv(2, 80),
+                      test::spirv(3, 96));
+
+  for (int i = 0; i < 3; ++i)
+    batch.create(0x100 * (i + 1));
+
+  CountAllocations counter;
+  for (int i = 0; i < 100; ++i)
+    batch.create(0x1000 + 4 * i);
+  EXPECT_EQ(counter.count(), 0u);
+}
+
+} // namespace
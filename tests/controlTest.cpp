@@ -0,0 +1,99 @@
+#include "guts.hpp"
+#include "testUtil.hpp"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace {
+
+// One command, one reply, as `shader-guts control` sends them.
+auto send(const std::filesystem::path &socketPath, std::string command)
+    -> std::string {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  socketPath.native().copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    if (fd >= 0)
+      close(fd);
+    return "connect failed";
+  }
+
+  command += "\n";
+  ::send(fd, command.data(), command.size(), MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+
+  auto reply = std::string();
+  char buffer[1024];
+  for (ssize_t n; (n = recv(fd, buffer, sizeof(buffer), 0)) > 0;)
+    reply.append(buffer, n);
+  close(fd);
+  return reply;
+}
+
+class ControlSocket : public ::testing::Test {
+protected:
+  ControlSocket()
+      : dir("shader-guts-control"),
+        dumpPath("VK_SHADER_GUTS_DUMP_PATH", (dir.path / "dump").string()),
+        controlPath("VK_SHADER_GUTS_CONTROL", socket().string()) {}
+
+  auto socket() const -> std::filesystem::path { return dir.path / "ctl"; }
+
+  // Creates a compute pipeline with inline code, which is dumped as
+  // `CS/<hash>.spv` while dumping is on.
+  auto createPipeline(impl::ShaderGuts &guts, uint32_t seed) -> bool {
+    auto code = test::spirv(seed);
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = code.size() * sizeof(uint32_t);
+    moduleInfo.pCode = code.data();
+
+    VkComputePipelineCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    info.stage.pNext = &moduleInfo;
+
+    util::Arena::Scope scratch;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    guts.CreateComputePipelinesPost(device, 1, &pipeline,
+                                    guts.CreateComputePipelines(device, 1,
+                                                                &info));
+    return std::filesystem::exists(dir.path / "dump" / "CS" /
+                                   (test::hashOf(code) + ".spv"));
+  }
+
+  test::TempDir dir;
+  test::ScopedEnv dumpPath;
+  test::ScopedEnv controlPath;
+  impl::ShaderGuts::DeviceShaders device;
+};
+
+TEST_F(ControlSocket, TogglesDumpingAndRejectsMalformedCommands) {
+  impl::ShaderGuts guts;
+
+  auto status = send(socket(), "status");
+  EXPECT_TRUE(status.starts_with("dump: on ")) << status;
+  EXPECT_NE(status.find("load: off"), std::string::npos) << status;
+  EXPECT_TRUE(createPipeline(guts, 1));
+
+  EXPECT_EQ(send(socket(), "dump off"), "ok\n");
+  status = send(socket(), "status");
+  EXPECT_TRUE(status.starts_with("dump: off ")) << status;
+  EXPECT_FALSE(createPipeline(guts, 2));
+
+  auto reply = send(socket(), "dump sideways");
+  EXPECT_TRUE(reply.starts_with("error: ")) << reply;
+  reply = send(socket(), "");
+  EXPECT_TRUE(reply.starts_with("error: ")) << reply;
+  status = send(socket(), "status");
+  EXPECT_TRUE(status.starts_with("dump: off ")) << status;
+
+  EXPECT_EQ(send(socket(), "dump on"), "ok\n");
+  EXPECT_TRUE(createPipeline(guts, 3));
+}
+
+} // namespace
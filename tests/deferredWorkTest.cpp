@@ -0,0 +1,124 @@
+#include "deferredWork.hpp"
+#include <functional>
+#include <future>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// What a deferred create does with DeferredWork: each joining thread keeps
+// its stages to itself, merges them into the shared result when it hands
+// over, and the last one finishes with everything merged.
+struct Joins {
+  explicit Joins(size_t tasks) : work(tasks), runs(tasks) {}
+
+  auto join(std::function<void(size_t)> during = {}) -> bool {
+    auto found = std::vector<size_t>();
+    return work.join(
+        [&](size_t i) {
+          ++runs[i];
+          found.push_back(i);
+          if (during)
+            during(i);
+        },
+        [&] {
+          std::lock_guard<std::mutex> l(lock);
+          merged.insert(merged.end(), found.begin(), found.end());
+          ++handOvers;
+        },
+        [&] {
+          std::lock_guard<std::mutex> l(lock);
+          mergedAtLast = merged.size();
+          ++lasts;
+        });
+  }
+
+  impl::DeferredWork work;
+  std::vector<std::atomic<int>> runs;
+  std::mutex lock;
+  std::vector<size_t> merged;
+  int handOvers = 0;
+  std::atomic<int> lasts = 0;
+  size_t mergedAtLast = 0;
+};
+
+TEST(DeferredWork, OneThreadDoesItAll) {
+  Joins joins(5);
+  EXPECT_EQ(joins.work.remaining(), 5u);
+  EXPECT_TRUE(joins.join());
+
+  for (auto &runs : joins.runs)
+    EXPECT_EQ(runs, 1);
+  EXPECT_EQ(joins.handOvers, 1);
+  EXPECT_EQ(joins.lasts, 1);
+  EXPECT_EQ(joins.mergedAtLast, 5u);
+  EXPECT_EQ(joins.work.remaining(), 1u);
+
+  // Joins after completion find nothing to do.
+  EXPECT_TRUE(joins.join());
+  EXPECT_EQ(joins.handOvers, 1);
+  EXPECT_EQ(joins.lasts, 1);
+}
+
+TEST(DeferredWork, NoTasksCompleteOnFirstJoin) {
+  Joins joins(0);
+  EXPECT_FALSE(joins.work.completed());
+  EXPECT_TRUE(joins.join());
+  EXPECT_EQ(joins.handOvers, 0);
+  EXPECT_EQ(joins.lasts, 1);
+}
+
+// The first thread is still inside its task when the second one runs out
+// of tasks: the second join reports the share as busy, the first one
+// finishes it, and a later join of the second thread sees it complete.
+TEST(DeferredWork, EarlyJoinerComesBack) {
+  Joins joins(2);
+  std::promise<void> secondJoined;
+  auto wait = secondJoined.get_future();
+
+  auto first = std::async(std::launch::async, [&] {
+    return joins.join([&](size_t i) {
+      if (i == 0)
+        wait.wait();
+    });
+  });
+
+  // Wait for the first thread to hold task 0.
+  while (joins.work.remaining() == 2)
+    std::this_thread::yield();
+
+  EXPECT_FALSE(joins.join());
+  EXPECT_FALSE(joins.work.completed());
+  EXPECT_EQ(joins.lasts, 0);
+  secondJoined.set_value();
+
+  EXPECT_TRUE(first.get());
+  EXPECT_TRUE(joins.join());
+  EXPECT_EQ(joins.handOvers, 2);
+  EXPECT_EQ(joins.lasts, 1);
+  EXPECT_EQ(joins.mergedAtLast, 2u);
+}
+
+TEST(DeferredWork, ManyThreadsMergeEverythingOnce) {
+  constexpr size_t tasks = 256;
+  Joins joins(tasks);
+
+  auto threads = std::vector<std::thread>();
+  for (int t = 0; t < 8; ++t)
+    threads.emplace_back([&] {
+      while (!joins.join())
+        std::this_thread::yield();
+    });
+  for (auto &thread : threads)
+    thread.join();
+
+  for (auto &runs : joins.runs)
+    EXPECT_EQ(runs, 1);
+  EXPECT_EQ(joins.lasts, 1);
+  EXPECT_EQ(joins.mergedAtLast, tasks);
+  EXPECT_TRUE(joins.work.completed());
+}
+
+} // namespace
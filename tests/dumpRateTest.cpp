@@ -0,0 +1,69 @@
+#include "guts.hpp"
+#include "testUtil.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+// A rate of one byte per second lets the first dump through and holds back
+// everything after it for the length of the test.
+class DumpRate : public ::testing::Test {
+protected:
+  DumpRate()
+      : dir("shader-guts-rate"),
+        dumpPath("VK_SHADER_GUTS_DUMP_PATH", dir.path.string()),
+        rate("VK_SHADER_GUTS_DUMP_RATE", "1") {}
+
+  auto createPipeline(impl::ShaderGuts &guts,
+                      const std::vector<uint32_t> &code) -> void {
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = code.size() * sizeof(uint32_t);
+    moduleInfo.pCode = code.data();
+
+    VkComputePipelineCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    info.stage.pNext = &moduleInfo;
+
+    util::Arena::Scope scratch;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    guts.CreateComputePipelinesPost(device, 1, &pipeline,
+                                    guts.CreateComputePipelines(device, 1,
+                                                                &info));
+  }
+
+  auto dumped(const std::vector<uint32_t> &code) const -> bool {
+    return std::filesystem::exists(dir.path / "CS" /
+                                   (test::hashOf(code) + ".spv"));
+  }
+
+  test::TempDir dir;
+  test::ScopedEnv dumpPath;
+  test::ScopedEnv rate;
+  impl::ShaderGuts::DeviceShaders device;
+};
+
+TEST_F(DumpRate, ThrottledShadersAreWrittenLater) {
+  impl::ShaderGuts guts;
+  auto shaders = std::vector{test::spirv(1), test::spirv(2), test::spirv(3)};
+  for (const auto &code : shaders)
+    createPipeline(guts, code);
+  // Used again while held back, still queued once.
+  createPipeline(guts, shaders[1]);
+
+  EXPECT_TRUE(dumped(shaders[0]));
+  EXPECT_FALSE(dumped(shaders[1]));
+  EXPECT_FALSE(dumped(shaders[2]));
+
+  // Frames don't refill a second's worth of bytes this fast.
+  guts.QueuePresent();
+  EXPECT_FALSE(dumped(shaders[1]));
+
+  // The last instance going away writes the whole backlog.
+  guts.WriteIndex();
+  for (const auto &code : shaders)
+    EXPECT_TRUE(dumped(code));
+}
+
+} // namespace
@@ -0,0 +1,47 @@
+#include "glslangShaders.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+constexpr auto rayGenSource = R"(#version 460
+#extension GL_EXT_ray_tracing : require
+layout(set = 0, binding = 0) uniform accelerationStructureEXT scene;
+layout(location = 0) rayPayloadEXT vec4 payload;
+void main() {
+  traceRayEXT(scene, gl_RayFlagsOpaqueEXT, 0xff, 0, 0, 0, vec3(0), 0.0,
+              vec3(0, 0, 1), 100.0, 0);
+}
+)";
+
+constexpr auto computeSource = R"(#version 450
+layout(local_size_x = 64) in;
+layout(set = 0, binding = 0) buffer Data { uint values[]; };
+void main() { values[gl_GlobalInvocationID.x] *= 2u; }
+)";
+
+auto spirvVersion(const std::vector<std::byte> &code) -> uint32_t {
+  uint32_t version;
+  std::memcpy(&version, code.data() + sizeof(uint32_t), sizeof(version));
+  return version;
+}
+
+// Ray tracing stages only exist from SPIR-V 1.4 on.
+TEST(CompileGLSL, RayGenTargetsSpirv14) {
+  auto params = util::shaders::makeCompileParams(rayGenSource, "x.rgen");
+  ASSERT_TRUE(params) << params.error();
+
+  auto spirv = util::shaders::compileGLSL(*params);
+  ASSERT_TRUE(util::isSPIRV(spirv));
+  EXPECT_GE(spirvVersion(spirv), 0x00010400u);
+}
+
+TEST(CompileGLSL, ComputeKeepsDefaultTarget) {
+  auto params = util::shaders::makeCompileParams(computeSource, "x.comp");
+  ASSERT_TRUE(params) << params.error();
+
+  auto spirv = util::shaders::compileGLSL(*params);
+  ASSERT_TRUE(util::isSPIRV(spirv));
+  EXPECT_LT(spirvVersion(spirv), 0x00010400u);
+}
+
+} // namespace
@@ -0,0 +1,40 @@
+#include "prefilter.hpp"
+#include "testUtil.hpp"
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// One index.csv row of `code`, dumped under `name`.
+auto indexRow(const std::vector<uint32_t> &code, const std::string &name)
+    -> std::string {
+  auto bytes = std::as_bytes(std::span(code));
+  auto row = std::ostringstream();
+  row << "1,CS," << name << ",0,0,0,0,0,0,0,0,0,0," << bytes.size() << ","
+      << std::hex << std::setw(16) << std::setfill('0')
+      << util::spirv::signature(bytes);
+  return row.str();
+}
+
+TEST(Prefilter, VariantRowsCoverTheirModule) {
+  test::TempDir dir("shader-guts-prefilter");
+  auto code = test::spirv(1);
+  auto hash = test::hashOf(code);
+  auto spec = std::string(40, 'a');
+
+  // With spec dumps on, the module only has a row for its variant.
+  std::ofstream(dir.path / "index.csv")
+      << util::spirv::CostIndex::header << "\n"
+      << indexRow(code, hash + "-" + spec) << "\n";
+
+  impl::Prefilter prefilter(dir.path / "index.csv", {hash});
+  ASSERT_TRUE(prefilter.enabled());
+
+  auto other = test::spirv(2, 80);
+  EXPECT_TRUE(prefilter.mayMatch(code.data(), code.size() * 4));
+  EXPECT_FALSE(prefilter.mayMatch(other.data(), other.size() * 4));
+}
+
+} // namespace
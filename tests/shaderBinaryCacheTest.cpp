@@ -0,0 +1,150 @@
+#include "shaderBinaryCache.hpp"
+#include "testUtil.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+// A stand-in driver. Its binary for a shader is the SPIR-V with every byte
+// flipped, so a binary create can be checked against what was stored.
+struct FakeDriver {
+  static inline std::vector<VkShaderCodeTypeEXT> codeTypes;
+  static inline std::vector<std::vector<std::byte>> shaders;
+  static inline bool rejectBinaries = false;
+
+  static auto binaryOf(const void *code, size_t size)
+      -> std::vector<std::byte> {
+    auto bytes = static_cast<const std::byte *>(code);
+    auto binary = std::vector<std::byte>(bytes, bytes + size);
+    for (auto &byte : binary)
+      byte = ~byte;
+    return binary;
+  }
+
+  static VkResult CreateShaders(VkDevice, uint32_t count,
+                                const VkShaderCreateInfoEXT *pInfos,
+                                const VkAllocationCallbacks *,
+                                VkShaderEXT *pShaders) {
+    for (uint32_t i = 0; i < count; ++i) {
+      const auto &info = pInfos[i];
+      codeTypes.push_back(info.codeType);
+      if (info.codeType == VK_SHADER_CODE_TYPE_BINARY_EXT && rejectBinaries)
+        return VK_ERROR_INCOMPATIBLE_SHADER_BINARY_EXT;
+
+      auto bytes = static_cast<const std::byte *>(info.pCode);
+      shaders.push_back(
+          info.codeType == VK_SHADER_CODE_TYPE_BINARY_EXT
+              ? std::vector<std::byte>(bytes, bytes + info.codeSize)
+              : binaryOf(info.pCode, info.codeSize));
+      pShaders[i] = reinterpret_cast<VkShaderEXT>(shaders.size());
+    }
+    return VK_SUCCESS;
+  }
+
+  static void DestroyShader(VkDevice, VkShaderEXT,
+                            const VkAllocationCallbacks *) {}
+
+  static VkResult GetShaderBinaryData(VkDevice, VkShaderEXT shader,
+                                      size_t *pSize, void *pData) {
+    const auto &binary =
+        shaders.at(reinterpret_cast<uintptr_t>(shader) - 1);
+    if (pData) {
+      if (*pSize < binary.size())
+        return VK_INCOMPLETE;
+      std::memcpy(pData, binary.data(), binary.size());
+    }
+    *pSize = binary.size();
+    return VK_SUCCESS;
+  }
+};
+
+class ShaderBinaries : public ::testing::Test {
+protected:
+  ShaderBinaries() : dir("shader-guts-binaries") {
+    FakeDriver::codeTypes.clear();
+    FakeDriver::shaders.clear();
+    FakeDriver::rejectBinaries = false;
+
+    dispatch.CreateShadersEXT = FakeDriver::CreateShaders;
+    dispatch.DestroyShaderEXT = FakeDriver::DestroyShader;
+    dispatch.GetShaderBinaryDataEXT = FakeDriver::GetShaderBinaryData;
+
+    props.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_OBJECT_PROPERTIES_EXT;
+    props.shaderBinaryVersion = 1;
+  }
+
+  // A fresh cache over the same folder, as the next run would see it.
+  auto create(const std::vector<uint32_t> &code) -> VkShaderEXT {
+    impl::ShaderBinaryCache cache(VK_NULL_HANDLE, dispatch, dir.path, props);
+
+    VkShaderCreateInfoEXT info{};
+    info.sType = VK_STRUCTURE_TYPE_SHADER_CREATE_INFO_EXT;
+    info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    info.codeType = VK_SHADER_CODE_TYPE_SPIRV_EXT;
+    info.codeSize = code.size() * sizeof(uint32_t);
+    info.pCode = code.data();
+    info.pName = "main";
+
+    VkShaderEXT shader = VK_NULL_HANDLE;
+    EXPECT_EQ(cache.create(1, &info, nullptr, &shader), VK_SUCCESS);
+    return shader;
+  }
+
+  auto files() const -> std::vector<std::filesystem::path> {
+    auto found = std::vector<std::filesystem::path>();
+    for (const auto &entry :
+         std::filesystem::recursive_directory_iterator(dir.path))
+      if (entry.is_regular_file())
+        found.push_back(entry.path());
+    return found;
+  }
+
+  test::TempDir dir;
+  VkLayerDispatchTable dispatch{};
+  VkPhysicalDeviceShaderObjectPropertiesEXT props{};
+};
+
+TEST_F(ShaderBinaries, SecondRunCreatesFromStoredBinary) {
+  auto code = test::spirv(1);
+  create(code);
+
+  // Stored once under its key, no temp files left next to it.
+  auto stored = files();
+  ASSERT_EQ(stored.size(), 1u);
+  EXPECT_EQ(stored[0].extension(), ".bin");
+
+  auto shader = create(code);
+  ASSERT_EQ(FakeDriver::codeTypes.size(), 2u);
+  EXPECT_EQ(FakeDriver::codeTypes[0], VK_SHADER_CODE_TYPE_SPIRV_EXT);
+  EXPECT_EQ(FakeDriver::codeTypes[1], VK_SHADER_CODE_TYPE_BINARY_EXT);
+
+  auto expected = FakeDriver::binaryOf(code.data(),
+                                       code.size() * sizeof(uint32_t));
+  EXPECT_EQ(FakeDriver::shaders.at(reinterpret_cast<uintptr_t>(shader) - 1),
+            expected);
+}
+
+TEST_F(ShaderBinaries, RejectedBinaryFallsBackToSPIRV) {
+  auto code = test::spirv(2);
+  create(code);
+
+  FakeDriver::rejectBinaries = true;
+  EXPECT_TRUE(create(code) != VK_NULL_HANDLE);
+  ASSERT_EQ(FakeDriver::codeTypes.size(), 3u);
+  EXPECT_EQ(FakeDriver::codeTypes[1], VK_SHADER_CODE_TYPE_BINARY_EXT);
+  EXPECT_EQ(FakeDriver::codeTypes[2], VK_SHADER_CODE_TYPE_SPIRV_EXT);
+
+  // The stale binary was dropped and the fresh one stored in its place.
+  FakeDriver::rejectBinaries = false;
+  create(code);
+  EXPECT_EQ(FakeDriver::codeTypes.back(), VK_SHADER_CODE_TYPE_BINARY_EXT);
+  EXPECT_EQ(files().size(), 1u);
+}
+
+TEST_F(ShaderBinaries, DifferentShadersAreStoredApart) {
+  create(test::spirv(3));
+  create(test::spirv(4));
+  EXPECT_EQ(files().size(), 2u);
+}
+
+} // namespace
@@ -0,0 +1,35 @@
+#include "spirvCost.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+// One function of three adds, the last one uses both values before it, so
+// three values are alive at once.
+auto module(uint32_t bound) -> std::vector<uint32_t> {
+  return {
+      util::SPIRVMagic, 0x00010000, 0, bound, 0,
+      (5u << 16) | 54, 1, 2, 0, 3,  // OpFunction %1 %2 None %3
+      (2u << 16) | 248, 4,          // OpLabel %4
+      (5u << 16) | 128, 1, 5, 6, 6, // OpIAdd %1 %5 %6 %6
+      (5u << 16) | 128, 1, 7, 5, 5, // OpIAdd %1 %7 %5 %5
+      (5u << 16) | 128, 1, 8, 5, 7, // OpIAdd %1 %8 %5 %7
+      (1u << 16) | 253,             // OpReturn
+      (1u << 16) | 56,              // OpFunctionEnd
+  };
+}
+
+TEST(SpirvCost, LiveRangesOfAFunction) {
+  auto cost = util::spirv::analyze(std::span<const uint32_t>(module(9)));
+  EXPECT_EQ(cost.alu, 3u);
+  EXPECT_EQ(cost.livePeak, 3u);
+}
+
+// An id bound of 0xffffffff would size the live range table at 32 GiB.
+TEST(SpirvCost, BrokenBoundSkipsLiveRanges) {
+  auto cost =
+      util::spirv::analyze(std::span<const uint32_t>(module(0xffffffff)));
+  EXPECT_EQ(cost.alu, 3u);
+  EXPECT_EQ(cost.livePeak, 0u);
+}
+
+} // namespace
@@ -0,0 +1,60 @@
+#pragma once
+#include "util.hpp"
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace test {
+
+// A directory of its own under the system's temp dir, removed at the end.
+class TempDir {
+public:
+  explicit TempDir(std::string_view name)
+      : path(std::filesystem::temp_directory_path() /
+             (std::string(name) + "-" + std::to_string(getpid()))) {
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+  }
+
+  ~TempDir() {
+    std::error_code ec;
+    std::filesystem::remove_all(path, ec);
+  }
+
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  std::filesystem::path path;
+};
+
+// Sets a VK_SHADER_GUTS_* variable for as long as it lives. ShaderGuts reads
+// them once, when it's constructed.
+class ScopedEnv {
+public:
+  ScopedEnv(const char *name, const std::string &value) : name(name) {
+    setenv(name, value.c_str(), 1);
+  }
+  ~ScopedEnv() { unsetenv(name); }
+
+  ScopedEnv(const ScopedEnv &) = delete;
+  ScopedEnv &operator=(const ScopedEnv &) = delete;
+
+private:
+  const char *name;
+};
+
+// A module that passes util::isSPIRV, different for every `seed`.
+inline auto spirv(uint32_t seed, size_t words = 64) -> std::vector<uint32_t> {
+  auto code = std::vector<uint32_t>(words, seed);
+  code[0] = util::SPIRVMagic;
+  return code;
+}
+
+inline auto hashOf(const std::vector<uint32_t> &code) -> std::string {
+  return util::Sha1Hash::compute(code.data(), code.size() * sizeof(uint32_t))
+      .toString();
+}
+
+} // namespace test
@@ -0,0 +1,1306 @@
+#include "glslangShaders.hpp"
+#include "procTable.hpp"
+#include "shaderGutsCore.h"
+#include "stages.hpp"
+#include "threadPool.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <dlfcn.h>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <ranges>
+#include <spirv_cross/spirv_cross.hpp>
+#include <vulkan/vulkan.h>
+
+// A/B microbenchmark of a dumped compute shader against its replacement.
+// Both get the same resources, synthesized from what their SPIR-V declares,
+// are dispatched on any Vulkan device, lavapipe included, and timed with
+// timestamps. Their outputs are diffed, so a speedup that changes the
+// results doesn't go unnoticed.
+
+namespace {
+namespace fs = std::filesystem;
+
+enum class Fill { floats, small, zero };
+
+struct Options {
+  fs::path original;
+  fs::path replacement;
+  uint32_t iterations = 100;
+  uint32_t warmup = 10;
+  std::array<uint32_t, 3> groups{1, 1, 1};
+  uint64_t bufferSize = 1 << 20;
+  uint32_t imageSize = 256;
+  Fill fill = Fill::floats;
+  std::optional<uint32_t> device;
+};
+
+auto printUsage() -> void {
+  std::cerr
+      << "usage: shader-guts-bench <original.spv> <replacement> [options]\n"
+         "       shader-guts-bench <dump dir> <load dir> <hash> [options]\n"
+         "  The replacement may be SPIR-V or GLSL. With directories the\n"
+         "  original is <dump dir>/CS/<hash>.spv and the replacement the\n"
+         "  file named <hash> in <load dir>.\n"
+         "options:\n"
+         "  -n <n>       timed dispatches per shader, defaults to 100\n"
+         "  -w <n>       untimed warm-up dispatches, defaults to 10\n"
+         "  -g <x,y,z>   workgroups per dispatch, defaults to 1,1,1\n"
+         "  -b <bytes>   storage buffer size, k/m/g suffixes, defaults to "
+         "1m\n"
+         "  -i <n>       storage and sampled image size, defaults to 256\n"
+         "  -fill <float|small|zero>\n"
+         "               buffer contents: floats in [0, 1), integers in\n"
+         "               [0, 256) for shaders that index with them, zeros\n"
+         "  -d <n>       physical device index, defaults to the first\n"
+         "       shader-guts-bench procs [-n <rounds>]\n"
+         "  Times the layer's GetProcAddr name lookup against the strcmp\n"
+         "  chain it replaced, for intercepted names and for others.\n"
+         "       shader-guts-bench compile <dir> [-n <rounds>]\n"
+         "  Compiles every GLSL shader under <dir>, <rounds> times over,\n"
+         "  one after the other and then as one core CompileBatch.\n"
+         "       shader-guts-bench startup [-core <libshader-guts-core.so>]\n"
+         "  Time and resident memory of creating an instance and device,\n"
+         "  with whatever layers are enabled, and of loading the core\n"
+         "  library on top if given.\n";
+}
+
+template <typename T> auto parseNumber(std::string_view text, T &value) {
+  auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  return ec == std::errc() && end == text.data() + text.size();
+}
+
+auto findReplacement(const fs::path &loadDir, std::string_view hash)
+    -> fs::path {
+  for (const auto &file : fs::directory_iterator(loadDir))
+    if (file.is_regular_file() && file.path().stem() == hash)
+      return file.path();
+  return {};
+}
+
+auto parseOptions(int argc, char **argv) -> std::optional<Options> {
+  Options options;
+  auto positional = std::vector<std::string_view>();
+
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string_view(argv[i]);
+    bool hasValue = i + 1 < argc;
+    auto value = hasValue ? std::string_view(argv[i + 1]) : "";
+
+    bool ok = true;
+    if (!arg.starts_with("-")) {
+      positional.push_back(arg);
+      continue;
+    } else if (arg == "-n" && hasValue) {
+      ok = parseNumber(value, options.iterations) && options.iterations;
+    } else if (arg == "-w" && hasValue) {
+      ok = parseNumber(value, options.warmup);
+    } else if (arg == "-i" && hasValue) {
+      ok = parseNumber(value, options.imageSize) && options.imageSize;
+    } else if (arg == "-d" && hasValue) {
+      options.device.emplace();
+      ok = parseNumber(value, *options.device);
+    } else if (arg == "-b" && hasValue) {
+      auto bytes = util::parseBytes(value);
+      ok = bytes && *bytes;
+      options.bufferSize = bytes.value_or(0);
+    } else if (arg == "-g" && hasValue) {
+      size_t axis = 0;
+      for (auto part : std::views::split(value, ',')) {
+        ok = ok && axis < 3 &&
+             parseNumber(std::string_view(part.begin(), part.end()),
+                         options.groups[axis++]);
+      }
+    } else if (arg == "-fill" && hasValue) {
+      ok = value == "float" || value == "small" || value == "zero";
+      options.fill = value == "small"  ? Fill::small
+                     : value == "zero" ? Fill::zero
+                                       : Fill::floats;
+    } else {
+      return std::nullopt;
+    }
+
+    if (!ok) {
+      std::cerr << "[VK_SHADER_GUTS][err]: Bad value for " << arg << ": "
+                << value << "\n";
+      return std::nullopt;
+    }
+    ++i;
+  }
+
+  if (positional.size() == 2) {
+    options.original = positional[0];
+    options.replacement = positional[1];
+  } else if (positional.size() == 3) {
+    options.original = fs::path(positional[0]) / util::stageInfos[5].folder /
+                       (std::string(positional[2]) + ".spv");
+    options.replacement = findReplacement(positional[1], positional[2]);
+  } else {
+    return std::nullopt;
+  }
+
+  for (const auto &path : {options.original, options.replacement}) {
+    if (!fs::is_regular_file(path)) {
+      std::cerr << "[VK_SHADER_GUTS][err]: Not a file: " << path << "\n";
+      return std::nullopt;
+    }
+  }
+  return options;
+}
+
+// SPIR-V as is, anything else is compiled as GLSL.
+auto loadShader(const fs::path &path) -> std::vector<std::byte> {
+  if (path.extension() == ".spv") {
+    auto code = util::LoadSPRV(path);
+    if (!util::isSPIRV(code))
+      throw std::runtime_error("not SPIR-V: " + path.string());
+    return code;
+  }
+
+  auto params = util::shaders::makeCompileParams(util::LoadFile(path), path);
+  if (!params)
+    throw std::runtime_error(params.error());
+  auto code = util::shaders::compileGLSL(params.value());
+  if (code.empty())
+    throw std::runtime_error("can't compile " + path.string());
+  return code;
+}
+
+auto check(VkResult result, std::string_view what) -> void {
+  if (result < 0)
+    throw std::runtime_error(
+        std::format("{} failed: VkResult {}", what, int(result)));
+}
+
+// One descriptor binding, as both shaders need it.
+struct Binding {
+  VkDescriptorType type;
+  uint32_t count = 1;
+  uint64_t size = 0;
+  VkFormat format = VK_FORMAT_UNDEFINED;
+};
+
+struct Layout {
+  std::map<std::pair<uint32_t, uint32_t>, Binding> bindings;
+  uint32_t pushConstantSize = 0;
+};
+
+auto imageFormat(spv::ImageFormat format) -> VkFormat {
+  switch (format) {
+  case spv::ImageFormatRgba16f:
+    return VK_FORMAT_R16G16B16A16_SFLOAT;
+  case spv::ImageFormatR32f:
+    return VK_FORMAT_R32_SFLOAT;
+  case spv::ImageFormatRgba8:
+    return VK_FORMAT_R8G8B8A8_UNORM;
+  case spv::ImageFormatR32ui:
+    return VK_FORMAT_R32_UINT;
+  case spv::ImageFormatR32i:
+    return VK_FORMAT_R32_SINT;
+  case spv::ImageFormatRgba32ui:
+    return VK_FORMAT_R32G32B32A32_UINT;
+  case spv::ImageFormatRgba32f:
+  case spv::ImageFormatUnknown:
+    return VK_FORMAT_R32G32B32A32_SFLOAT;
+  default:
+    throw std::runtime_error(
+        std::format("unsupported storage image format {}", int(format)));
+  }
+}
+
+auto texelSize(VkFormat format) -> uint32_t {
+  switch (format) {
+  case VK_FORMAT_R32_SFLOAT:
+  case VK_FORMAT_R32_UINT:
+  case VK_FORMAT_R32_SINT:
+  case VK_FORMAT_R8G8B8A8_UNORM:
+    return 4;
+  case VK_FORMAT_R16G16B16A16_SFLOAT:
+    return 8;
+  default:
+    return 16;
+  }
+}
+
+// Adds what `code` declares to `layout`. Both shaders must agree on the type
+// of every binding they share, sizes are the larger of the two.
+auto reflect(const std::vector<std::byte> &code, const Options &options,
+             Layout &layout) -> void {
+  spirv_cross::Compiler compiler(
+      reinterpret_cast<const uint32_t *>(code.data()), code.size() / 4);
+  auto resources = compiler.get_shader_resources();
+
+  auto add = [&](const spirv_cross::Resource &resource,
+                 VkDescriptorType type) {
+    auto &spirType = compiler.get_type(resource.type_id);
+    auto key = std::pair(
+        compiler.get_decoration(resource.id, spv::DecorationDescriptorSet),
+        compiler.get_decoration(resource.id, spv::DecorationBinding));
+
+    Binding binding{type};
+    if (!spirType.array.empty())
+      binding.count = std::max(spirType.array[0], 1u);
+
+    if (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER ||
+        type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+      binding.size = compiler.get_declared_struct_size(
+          compiler.get_type(resource.base_type_id));
+      if (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+        binding.size = std::max(binding.size, options.bufferSize);
+    } else if (type != VK_DESCRIPTOR_TYPE_SAMPLER) {
+      if (spirType.image.dim != spv::Dim2D || spirType.image.arrayed)
+        throw std::runtime_error(resource.name +
+                                 ": only 2D images are supported");
+      binding.format = type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                           ? imageFormat(spirType.image.format)
+                           : VK_FORMAT_R8G8B8A8_UNORM;
+    }
+
+    auto [it, added] = layout.bindings.emplace(key, binding);
+    if (added)
+      return;
+    if (it->second.type != binding.type || it->second.format != binding.format)
+      throw std::runtime_error(std::format(
+          "set {} binding {} differs between the shaders", key.first,
+          key.second));
+    it->second.size = std::max(it->second.size, binding.size);
+    it->second.count = std::max(it->second.count, binding.count);
+  };
+
+  for (auto &r : resources.storage_buffers)
+    add(r, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  for (auto &r : resources.uniform_buffers)
+    add(r, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+  for (auto &r : resources.storage_images)
+    add(r, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  for (auto &r : resources.sampled_images)
+    add(r, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  for (auto &r : resources.separate_images)
+    add(r, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE);
+  for (auto &r : resources.separate_samplers)
+    add(r, VK_DESCRIPTOR_TYPE_SAMPLER);
+
+  for (auto &r : resources.push_constant_buffers)
+    layout.pushConstantSize = std::max(
+        layout.pushConstantSize,
+        uint32_t(compiler.get_declared_struct_size(
+            compiler.get_type(r.base_type_id))));
+}
+
+// Instance, device and compute queue of the benchmark.
+class Device {
+public:
+  explicit Device(std::optional<uint32_t> index) {
+    VkApplicationInfo app{};
+    app.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    app.pApplicationName = "shader-guts-bench";
+    app.apiVersion = VK_API_VERSION_1_1;
+
+    VkInstanceCreateInfo instanceInfo{};
+    instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instanceInfo.pApplicationInfo = &app;
+    check(vkCreateInstance(&instanceInfo, nullptr, &instance),
+          "vkCreateInstance");
+
+    uint32_t count = 0;
+    vkEnumeratePhysicalDevices(instance, &count, nullptr);
+    auto devices = std::vector<VkPhysicalDevice>(count);
+    vkEnumeratePhysicalDevices(instance, &count, devices.data());
+    if (devices.empty() || index.value_or(0) >= devices.size())
+      throw std::runtime_error("no such Vulkan device");
+
+    physical = devices[index.value_or(0)];
+    vkGetPhysicalDeviceProperties(physical, &properties);
+    vkGetPhysicalDeviceMemoryProperties(physical, &memory);
+
+    vkGetPhysicalDeviceQueueFamilyProperties(physical, &count, nullptr);
+    auto families = std::vector<VkQueueFamilyProperties>(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical, &count,
+                                             families.data());
+    auto family = std::ranges::find_if(families, [](auto &f) {
+      return f.queueFlags & VK_QUEUE_COMPUTE_BIT;
+    });
+    if (family == families.end())
+      throw std::runtime_error("no compute queue");
+    queueFamily = uint32_t(family - families.begin());
+    timestamps = family->timestampValidBits != 0;
+
+    float priority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo{};
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = queueFamily;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &priority;
+
+    VkDeviceCreateInfo deviceInfo{};
+    deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueInfo;
+    check(vkCreateDevice(physical, &deviceInfo, nullptr, &device),
+          "vkCreateDevice");
+    vkGetDeviceQueue(device, queueFamily, 0, &queue);
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = queueFamily;
+    check(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool),
+          "vkCreateCommandPool");
+  }
+
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+
+  ~Device() {
+    if (device) {
+      vkDeviceWaitIdle(device);
+      vkDestroyCommandPool(device, commandPool, nullptr);
+      vkDestroyDevice(device, nullptr);
+    }
+    vkDestroyInstance(instance, nullptr);
+  }
+
+  auto memoryType(uint32_t bits, VkMemoryPropertyFlags flags) const
+      -> uint32_t {
+    for (uint32_t i = 0; i < memory.memoryTypeCount; ++i)
+      if ((bits & (1u << i)) &&
+          (memory.memoryTypes[i].propertyFlags & flags) == flags)
+        return i;
+    throw std::runtime_error("no suitable memory type");
+  }
+
+  auto allocate(VkMemoryRequirements requirements,
+                VkMemoryPropertyFlags flags) const -> VkDeviceMemory {
+    VkMemoryAllocateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    info.allocationSize = requirements.size;
+    info.memoryTypeIndex = memoryType(requirements.memoryTypeBits, flags);
+
+    VkDeviceMemory result;
+    check(vkAllocateMemory(device, &info, nullptr, &result),
+          "vkAllocateMemory");
+    return result;
+  }
+
+  // Records with `record`, submits and waits.
+  template <typename Record> auto submit(Record &&record) const -> void {
+    VkCommandBufferAllocateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    info.commandPool = commandPool;
+    info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    info.commandBufferCount = 1;
+
+    VkCommandBuffer cmd;
+    check(vkAllocateCommandBuffers(device, &info, &cmd),
+          "vkAllocateCommandBuffers");
+
+    VkCommandBufferBeginInfo begin{};
+    begin.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(cmd, &begin);
+    record(cmd);
+    vkEndCommandBuffer(cmd);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmd;
+    auto result = vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+    if (result >= 0)
+      result = vkQueueWaitIdle(queue);
+    vkFreeCommandBuffers(device, commandPool, 1, &cmd);
+    check(result, "vkQueueSubmit");
+  }
+
+  VkInstance instance = VK_NULL_HANDLE;
+  VkPhysicalDevice physical = VK_NULL_HANDLE;
+  VkPhysicalDeviceProperties properties{};
+  VkPhysicalDeviceMemoryProperties memory{};
+  VkDevice device = VK_NULL_HANDLE;
+  uint32_t queueFamily = 0;
+  VkQueue queue = VK_NULL_HANDLE;
+  VkCommandPool commandPool = VK_NULL_HANDLE;
+  bool timestamps = false;
+};
+
+auto barrier(VkCommandBuffer cmd, VkPipelineStageFlags src,
+             VkAccessFlags srcAccess, VkPipelineStageFlags dst,
+             VkAccessFlags dstAccess) -> void {
+  VkMemoryBarrier memoryBarrier{};
+  memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  memoryBarrier.srcAccessMask = srcAccess;
+  memoryBarrier.dstAccessMask = dstAccess;
+  vkCmdPipelineBarrier(cmd, src, dst, 0, 1, &memoryBarrier, 0, nullptr, 0,
+                       nullptr);
+}
+
+auto transition(VkCommandBuffer cmd, VkImage image, VkImageLayout from,
+                VkImageLayout to) -> void {
+  VkImageMemoryBarrier imageBarrier{};
+  imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  imageBarrier.srcAccessMask =
+      VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                               VK_ACCESS_SHADER_WRITE_BIT |
+                               VK_ACCESS_TRANSFER_READ_BIT;
+  imageBarrier.oldLayout = from;
+  imageBarrier.newLayout = to;
+  imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.image = image;
+  imageBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  auto stages =
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+  vkCmdPipelineBarrier(cmd, stages, stages, 0, 0, nullptr, 0, nullptr, 1,
+                       &imageBarrier);
+}
+
+// One descriptor's buffer or image, with the contents every run starts
+// from. Images go through a host-visible staging buffer both ways.
+struct Resource {
+  VkDescriptorType type;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceMemory bufferMemory = VK_NULL_HANDLE;
+  std::byte *mapped = nullptr;
+  VkImage image = VK_NULL_HANDLE;
+  VkDeviceMemory imageMemory = VK_NULL_HANDLE;
+  VkImageView view = VK_NULL_HANDLE;
+  std::vector<std::byte> initial;
+
+  auto writable() const -> bool {
+    return type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER ||
+           type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  }
+  auto isImage() const -> bool { return image != VK_NULL_HANDLE; }
+  auto imageLayout() const -> VkImageLayout {
+    return type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+               ? VK_IMAGE_LAYOUT_GENERAL
+               : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  }
+};
+
+// The shared descriptor sets and resources, and one pipeline per shader.
+class Bench {
+public:
+  Bench(const Device &device, const Layout &layout, const Options &options)
+      : device(device), layout(layout), options(options) {
+    createLayouts();
+    createResources();
+    createDescriptors();
+
+    if (device.timestamps) {
+      VkQueryPoolCreateInfo info{};
+      info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      info.queryCount = 2 * options.iterations;
+      check(vkCreateQueryPool(device.device, &info, nullptr, &queryPool),
+            "vkCreateQueryPool");
+    }
+  }
+
+  Bench(const Bench &) = delete;
+  Bench &operator=(const Bench &) = delete;
+
+  ~Bench() {
+    auto dev = device.device;
+    vkDeviceWaitIdle(dev);
+    for (auto pipeline : pipelines)
+      vkDestroyPipeline(dev, pipeline, nullptr);
+    vkDestroyQueryPool(dev, queryPool, nullptr);
+    vkDestroyDescriptorPool(dev, descriptorPool, nullptr);
+    for (auto &resource : resources) {
+      vkDestroyImageView(dev, resource.view, nullptr);
+      vkDestroyImage(dev, resource.image, nullptr);
+      vkFreeMemory(dev, resource.imageMemory, nullptr);
+      vkDestroyBuffer(dev, resource.buffer, nullptr);
+      vkFreeMemory(dev, resource.bufferMemory, nullptr);
+    }
+    vkDestroySampler(dev, sampler, nullptr);
+    vkDestroyPipelineLayout(dev, pipelineLayout, nullptr);
+    for (auto setLayout : setLayouts)
+      vkDestroyDescriptorSetLayout(dev, setLayout, nullptr);
+  }
+
+  auto createPipeline(const std::vector<std::byte> &code) -> VkPipeline {
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = code.size();
+    moduleInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+
+    VkShaderModule module;
+    check(vkCreateShaderModule(device.device, &moduleInfo, nullptr, &module),
+          "vkCreateShaderModule");
+
+    VkComputePipelineCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    info.stage.module = module;
+    info.stage.pName = "main";
+    info.layout = pipelineLayout;
+
+    VkPipeline pipeline;
+    auto result = vkCreateComputePipelines(device.device, VK_NULL_HANDLE, 1,
+                                           &info, nullptr, &pipeline);
+    vkDestroyShaderModule(device.device, module, nullptr);
+    check(result, "vkCreateComputePipelines");
+    pipelines.push_back(pipeline);
+    return pipeline;
+  }
+
+  // Puts every resource back to its initial contents.
+  auto reset() -> void {
+    for (auto &resource : resources)
+      if (!resource.isImage())
+        std::ranges::copy(resource.initial, resource.mapped);
+
+    device.submit([&](VkCommandBuffer cmd) {
+      for (auto &resource : resources) {
+        if (!resource.isImage())
+          continue;
+        std::ranges::copy(resource.initial, resource.mapped);
+        transition(cmd, resource.image, VK_IMAGE_LAYOUT_UNDEFINED,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        auto region = imageRegion();
+        vkCmdCopyBufferToImage(cmd, resource.buffer, resource.image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                               &region);
+        transition(cmd, resource.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                   resource.imageLayout());
+      }
+    });
+  }
+
+  // One dispatch from the initial contents, returns what it wrote.
+  auto outputs(VkPipeline pipeline) -> std::vector<std::vector<std::byte>> {
+    reset();
+    device.submit([&](VkCommandBuffer cmd) {
+      dispatch(cmd, pipeline);
+      barrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+              VK_ACCESS_SHADER_WRITE_BIT,
+              VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+              VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_HOST_READ_BIT);
+      for (auto &resource : resources) {
+        if (!resource.isImage() || !resource.writable())
+          continue;
+        transition(cmd, resource.image, VK_IMAGE_LAYOUT_GENERAL,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        auto region = imageRegion();
+        vkCmdCopyImageToBuffer(cmd, resource.image,
+                               VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                               resource.buffer, 1, &region);
+      }
+      barrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+              VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+    });
+
+    auto result = std::vector<std::vector<std::byte>>();
+    for (auto &resource : resources)
+      if (resource.writable())
+        result.emplace_back(resource.mapped,
+                            resource.mapped + resource.initial.size());
+    return result;
+  }
+
+  // Milliseconds per dispatch. Without timestamps every dispatch gets a
+  // submit of its own and the host clock.
+  auto time(VkPipeline pipeline, uint32_t count) -> std::vector<double> {
+    auto times = std::vector<double>();
+    if (!device.timestamps) {
+      for (uint32_t i = 0; i < count; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        device.submit([&](VkCommandBuffer cmd) { dispatch(cmd, pipeline); });
+        times.push_back(std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+      }
+      return times;
+    }
+
+    for (uint32_t done = 0; done < count;) {
+      auto batch = std::min(count - done, options.iterations);
+      device.submit([&](VkCommandBuffer cmd) {
+        vkCmdResetQueryPool(cmd, queryPool, 0, 2 * batch);
+        for (uint32_t i = 0; i < batch; ++i) {
+          vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                              queryPool, 2 * i);
+          dispatch(cmd, pipeline);
+          vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                              queryPool, 2 * i + 1);
+          // Dispatches run one after the other, like frames would.
+          barrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                  VK_ACCESS_SHADER_WRITE_BIT,
+                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+        }
+      });
+
+      auto ticks = std::vector<uint64_t>(2 * batch);
+      check(vkGetQueryPoolResults(
+                device.device, queryPool, 0, 2 * batch,
+                ticks.size() * sizeof(uint64_t), ticks.data(),
+                sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT),
+            "vkGetQueryPoolResults");
+      for (uint32_t i = 0; i < batch; ++i)
+        times.push_back(double(ticks[2 * i + 1] - ticks[2 * i]) *
+                        device.properties.limits.timestampPeriod / 1e6);
+      done += batch;
+    }
+    return times;
+  }
+
+  // Writable resources in the order outputs() returns them.
+  auto outputNames() const -> std::vector<std::string> {
+    auto names = std::vector<std::string>();
+    for (auto &[key, binding] : layout.bindings)
+      for (uint32_t i = 0; i < binding.count; ++i)
+        if (binding.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER ||
+            binding.type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+          names.push_back(binding.count > 1
+                              ? std::format("set {} binding {}[{}]",
+                                            key.first, key.second, i)
+                              : std::format("set {} binding {}", key.first,
+                                            key.second));
+    return names;
+  }
+
+private:
+  auto imageRegion() const -> VkBufferImageCopy {
+    VkBufferImageCopy region{};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {options.imageSize, options.imageSize, 1};
+    return region;
+  }
+
+  auto dispatch(VkCommandBuffer cmd, VkPipeline pipeline) -> void {
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    if (!sets.empty())
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              pipelineLayout, 0, uint32_t(sets.size()),
+                              sets.data(), 0, nullptr);
+    if (!pushConstants.empty())
+      vkCmdPushConstants(cmd, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         uint32_t(pushConstants.size()),
+                         pushConstants.data());
+    vkCmdDispatch(cmd, options.groups[0], options.groups[1],
+                  options.groups[2]);
+  }
+
+  // Sets without bindings in between still need a layout, an empty one.
+  auto createLayouts() -> void {
+    uint32_t setCount = 0;
+    for (auto &[key, binding] : layout.bindings)
+      setCount = std::max(setCount, key.first + 1);
+
+    for (uint32_t set = 0; set < setCount; ++set) {
+      auto bindings = std::vector<VkDescriptorSetLayoutBinding>();
+      for (auto &[key, binding] : layout.bindings)
+        if (key.first == set)
+          bindings.push_back({key.second, binding.type, binding.count,
+                              VK_SHADER_STAGE_COMPUTE_BIT, nullptr});
+
+      VkDescriptorSetLayoutCreateInfo info{};
+      info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+      info.bindingCount = uint32_t(bindings.size());
+      info.pBindings = bindings.data();
+      check(vkCreateDescriptorSetLayout(device.device, &info, nullptr,
+                                        &setLayouts.emplace_back()),
+            "vkCreateDescriptorSetLayout");
+    }
+
+    VkPushConstantRange range{VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                              (layout.pushConstantSize + 3) & ~3u};
+    pushConstants.resize(range.size);
+    fill(pushConstants);
+
+    VkPipelineLayoutCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    info.setLayoutCount = uint32_t(setLayouts.size());
+    info.pSetLayouts = setLayouts.data();
+    info.pushConstantRangeCount = range.size ? 1 : 0;
+    info.pPushConstantRanges = &range;
+    check(vkCreatePipelineLayout(device.device, &info, nullptr,
+                                 &pipelineLayout),
+          "vkCreatePipelineLayout");
+  }
+
+  // Same seed every run, so results can be compared across runs too.
+  auto fill(std::vector<std::byte> &bytes) -> void {
+    auto words = bytes.size() / 4;
+    for (size_t i = 0; i < words; ++i) {
+      uint32_t word = 0;
+      if (options.fill == Fill::floats) {
+        auto value = std::uniform_real_distribution<float>(0, 1)(random);
+        std::memcpy(&word, &value, 4);
+      } else if (options.fill == Fill::small) {
+        word = std::uniform_int_distribution<uint32_t>(0, 255)(random);
+      }
+      std::memcpy(bytes.data() + 4 * i, &word, 4);
+    }
+  }
+
+  auto createBuffer(Resource &resource, uint64_t size,
+                    VkBufferUsageFlags usage) -> void {
+    VkBufferCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    check(vkCreateBuffer(device.device, &info, nullptr, &resource.buffer),
+          "vkCreateBuffer");
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device.device, resource.buffer,
+                                  &requirements);
+    resource.bufferMemory =
+        device.allocate(requirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    vkBindBufferMemory(device.device, resource.buffer, resource.bufferMemory,
+                       0);
+
+    void *mapped;
+    check(vkMapMemory(device.device, resource.bufferMemory, 0, VK_WHOLE_SIZE,
+                      0, &mapped),
+          "vkMapMemory");
+    resource.mapped = static_cast<std::byte *>(mapped);
+  }
+
+  auto createImage(Resource &resource, VkFormat format) -> void {
+    VkImageCreateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.format = format;
+    info.extent = {options.imageSize, options.imageSize, 1};
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.samples = VK_SAMPLE_COUNT_1_BIT;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                 VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                 (resource.writable() ? VK_IMAGE_USAGE_STORAGE_BIT
+                                      : VK_IMAGE_USAGE_SAMPLED_BIT);
+    check(vkCreateImage(device.device, &info, nullptr, &resource.image),
+          "vkCreateImage");
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device.device, resource.image, &requirements);
+    resource.imageMemory =
+        device.allocate(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    vkBindImageMemory(device.device, resource.image, resource.imageMemory, 0);
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = resource.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    check(vkCreateImageView(device.device, &viewInfo, nullptr, &resource.view),
+          "vkCreateImageView");
+  }
+
+  auto createResources() -> void {
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    check(vkCreateSampler(device.device, &samplerInfo, nullptr, &sampler),
+          "vkCreateSampler");
+
+    for (auto &[key, binding] : layout.bindings) {
+      for (uint32_t i = 0; i < binding.count; ++i) {
+        auto &resource = resources.emplace_back(binding.type);
+        if (binding.type == VK_DESCRIPTOR_TYPE_SAMPLER)
+          continue;
+
+        uint64_t size = binding.size;
+        if (binding.format != VK_FORMAT_UNDEFINED) {
+          size = uint64_t(options.imageSize) * options.imageSize *
+                 texelSize(binding.format);
+          createImage(resource, binding.format);
+        }
+
+        auto usage = binding.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                         ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                     : binding.type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+                         ? VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+                         : VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                               VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        createBuffer(resource, std::max<uint64_t>(size, 16), usage);
+
+        resource.initial.resize(std::max<uint64_t>(size, 16));
+        fill(resource.initial);
+      }
+    }
+  }
+
+  auto createDescriptors() -> void {
+    if (setLayouts.empty())
+      return;
+
+    auto sizes = std::vector<VkDescriptorPoolSize>();
+    for (auto &[key, binding] : layout.bindings)
+      sizes.push_back({binding.type, binding.count});
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = uint32_t(setLayouts.size());
+    poolInfo.poolSizeCount = uint32_t(sizes.size());
+    poolInfo.pPoolSizes = sizes.data();
+    check(vkCreateDescriptorPool(device.device, &poolInfo, nullptr,
+                                 &descriptorPool),
+          "vkCreateDescriptorPool");
+
+    VkDescriptorSetAllocateInfo info{};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    info.descriptorPool = descriptorPool;
+    info.descriptorSetCount = uint32_t(setLayouts.size());
+    info.pSetLayouts = setLayouts.data();
+    sets.resize(setLayouts.size());
+    check(vkAllocateDescriptorSets(device.device, &info, sets.data()),
+          "vkAllocateDescriptorSets");
+
+    // Kept alive until vkUpdateDescriptorSets, one entry per resource.
+    auto bufferInfos = std::vector<VkDescriptorBufferInfo>(resources.size());
+    auto imageInfos = std::vector<VkDescriptorImageInfo>(resources.size());
+    auto writes = std::vector<VkWriteDescriptorSet>();
+
+    size_t next = 0;
+    for (auto &[key, binding] : layout.bindings) {
+      for (uint32_t i = 0; i < binding.count; ++i, ++next) {
+        auto &resource = resources[next];
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = sets[key.first];
+        write.dstBinding = key.second;
+        write.dstArrayElement = i;
+        write.descriptorCount = 1;
+        write.descriptorType = binding.type;
+
+        if (binding.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER ||
+            binding.type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+          bufferInfos[next] = {resource.buffer, 0, VK_WHOLE_SIZE};
+          write.pBufferInfo = &bufferInfos[next];
+        } else {
+          imageInfos[next] = {sampler, resource.view, resource.imageLayout()};
+          write.pImageInfo = &imageInfos[next];
+        }
+        writes.push_back(write);
+      }
+    }
+    vkUpdateDescriptorSets(device.device, uint32_t(writes.size()),
+                           writes.data(), 0, nullptr);
+  }
+
+  const Device &device;
+  const Layout &layout;
+  const Options &options;
+  std::mt19937 random{0x5eed};
+
+  std::vector<VkDescriptorSetLayout> setLayouts;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+  std::vector<std::byte> pushConstants;
+  VkSampler sampler = VK_NULL_HANDLE;
+  std::vector<Resource> resources;
+  VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> sets;
+  VkQueryPool queryPool = VK_NULL_HANDLE;
+  std::vector<VkPipeline> pipelines;
+};
+
+struct Timing {
+  double min, median, mean, p95, stddev;
+
+  explicit Timing(std::vector<double> times) {
+    std::ranges::sort(times);
+    auto at = [&](double q) { return times[size_t(q * (times.size() - 1))]; };
+    min = times.front();
+    median = at(0.5);
+    p95 = at(0.95);
+    mean = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+    auto sq = 0.0;
+    for (auto t : times)
+      sq += (t - mean) * (t - mean);
+    stddev = std::sqrt(sq / times.size());
+  }
+};
+
+// Word by word, as floats for the largest difference. Returns whether the
+// outputs match exactly.
+auto diff(const std::vector<std::string> &names,
+          const std::vector<std::vector<std::byte>> &a,
+          const std::vector<std::vector<std::byte>> &b) -> bool {
+  bool same = true;
+  for (size_t i = 0; i < a.size(); ++i) {
+    size_t words = a[i].size() / 4, differ = 0;
+    double maxDiff = 0;
+    for (size_t w = 0; w < words; ++w) {
+      float x, y;
+      std::memcpy(&x, a[i].data() + 4 * w, 4);
+      std::memcpy(&y, b[i].data() + 4 * w, 4);
+      if (std::memcmp(&x, &y, 4) == 0)
+        continue;
+      ++differ;
+      if (std::isfinite(x) && std::isfinite(y))
+        maxDiff = std::max(maxDiff, std::abs(double(x) - double(y)));
+    }
+
+    if (differ)
+      std::cout << std::format("diff: {}: {} of {} words differ, max {:g} "
+                               "as floats\n",
+                               names[i], differ, words, maxDiff);
+    same = same && !differ;
+  }
+  if (same)
+    std::cout << "diff: outputs identical\n";
+  return same;
+}
+
+auto run(const Options &options) -> int {
+  auto original = loadShader(options.original);
+  auto replacement = loadShader(options.replacement);
+
+  Layout layout;
+  reflect(original, options, layout);
+  reflect(replacement, options, layout);
+
+  Device device(options.device);
+  std::cout << std::format("device: {}{}\n", device.properties.deviceName,
+                           device.timestamps ? "" : " (no timestamps)");
+
+  Bench bench(device, layout, options);
+  auto pipelines = std::array{bench.createPipeline(original),
+                              bench.createPipeline(replacement)};
+
+  auto outputs = std::array{bench.outputs(pipelines[0]),
+                            bench.outputs(pipelines[1])};
+
+  // Warm up both before timing either, clocks ramp up.
+  bench.reset();
+  for (auto pipeline : pipelines)
+    if (options.warmup)
+      bench.time(pipeline, options.warmup);
+
+  auto time = [&](VkPipeline pipeline) {
+    return Timing(bench.time(pipeline, options.iterations));
+  };
+  auto timings = std::array{time(pipelines[0]), time(pipelines[1])};
+
+  std::cout << std::format("{} dispatches of {}x{}x{} workgroups, ms:\n",
+                           options.iterations, options.groups[0],
+                           options.groups[1], options.groups[2]);
+  std::cout << std::format("{:<12} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "",
+                           "min", "median", "mean", "p95", "stddev");
+  auto names = std::array{"original", "replacement"};
+  for (size_t i = 0; i < 2; ++i)
+    std::cout << std::format(
+        "{:<12} {:>10.4f} {:>10.4f} {:>10.4f} {:>10.4f} {:>10.4f}\n",
+        names[i], timings[i].min, timings[i].median, timings[i].mean,
+        timings[i].p95, timings[i].stddev);
+  std::cout << std::format("speedup: {:.3f}x (median)\n",
+                           timings[0].median / timings[1].median);
+
+  return diff(bench.outputNames(), outputs[0], outputs[1]) ? 0 : 2;
+}
+
+
+// The lookup the perfect hash replaced: one strcmp per intercepted name, in
+// the order they're listed.
+#define PROC_STRCMP(func, scope)                                               \
+  if (!strcmp(name, "vk" #func))                                               \
+    return index;                                                              \
+  ++index;
+
+auto findByStrcmp(const char *name) -> size_t {
+  size_t index = 0;
+  SHADER_GUTS_PROCS(PROC_STRCMP)
+  return impl::procHash.npos;
+}
+
+#undef PROC_STRCMP
+
+// ns per lookup of every name in `names`, best of a few runs. The names are
+// read through a volatile so the lookups aren't hoisted out of the loop.
+template <typename Find>
+auto timeLookups(const std::vector<const char *> &names, uint32_t rounds,
+                 Find &&find) -> double {
+  auto best = std::numeric_limits<double>::max();
+  volatile size_t sink = 0;
+  for (int run = 0; run < 5; ++run) {
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < rounds; ++i)
+      for (const char *volatile name : names)
+        found += find(name);
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    sink = sink + found;
+    best = std::min(best, elapsed.count() / (double(rounds) * names.size()));
+  }
+  return best;
+}
+
+auto runProcs(int argc, char **argv) -> int {
+  uint32_t rounds = 100000;
+  bool ok = argc == 2 || (argc == 4 && std::string_view(argv[2]) == "-n" &&
+                          parseNumber(std::string_view(argv[3]), rounds) &&
+                          rounds);
+  if (!ok) {
+    printUsage();
+    return 1;
+  }
+
+  auto hits = std::vector<const char *>();
+  for (auto name : impl::procNames)
+    hits.push_back(name.data());
+
+  // What the loader asks for besides those, it asks for every entry point.
+  auto misses = std::vector<const char *>{
+      "vkCmdDraw",
+      "vkCmdDrawIndexed",
+      "vkCmdDispatch",
+      "vkCmdCopyBuffer",
+      "vkCmdPipelineBarrier",
+      "vkCmdBindDescriptorSets",
+      "vkCmdBeginRenderPass",
+      "vkBeginCommandBuffer",
+      "vkQueueSubmit",
+      "vkAllocateMemory",
+      "vkCreateBuffer",
+      "vkCreateImageView",
+      "vkUpdateDescriptorSets",
+      "vkCreateSwapchainKHR",
+      "vkAcquireNextImageKHR",
+      "vkGetPhysicalDeviceProperties2",
+  };
+
+  auto byHash = [](const char *name) { return impl::procHash.find(name); };
+  for (auto *names : {&hits, &misses})
+    for (auto *name : *names)
+      if (findByStrcmp(name) != byHash(name))
+        throw std::runtime_error(std::format("lookups disagree on {}", name));
+
+  std::cout << std::format("{} intercepted names, ns per lookup:\n",
+                           hits.size());
+  std::cout << std::format("{:<14} {:>10} {:>10} {:>10}\n", "", "strcmp",
+                           "hash", "speedup");
+  for (auto [label, names] : {std::pair{"intercepted", &hits},
+                              std::pair{"other", &misses}}) {
+    auto chain = timeLookups(*names, rounds, findByStrcmp);
+    auto hash = timeLookups(*names, rounds, byHash);
+    std::cout << std::format("{:<14} {:>10.2f} {:>10.2f} {:>9.1f}x\n", label,
+                             chain, hash, chain / hash);
+  }
+  return 0;
+}
+
+struct BenchSource {
+  std::string source;
+  std::string fileName;
+};
+
+// Every shader under `dir` glslang knows the stage of, `rounds` times over.
+auto loadSources(const fs::path &dir, uint32_t rounds)
+    -> std::vector<BenchSource> {
+  auto sources = std::vector<BenchSource>();
+  for (const auto &file : fs::recursive_directory_iterator(dir))
+    if (file.is_regular_file() &&
+        util::shaders::shaderTypeESh.contains(file.path().extension().c_str()))
+      sources.push_back({util::LoadFile(file.path()), file.path().string()});
+
+  auto all = std::vector<BenchSource>();
+  for (uint32_t i = 0; i < rounds; ++i)
+    all.insert(all.end(), sources.begin(), sources.end());
+  return all;
+}
+
+// The core writes each SPIR-V straight into one of these.
+auto outputTo(std::vector<std::byte> &out) -> ShaderGutsOutput {
+  auto allocate = [](void *user, size_t size) -> void * {
+    auto &out = *static_cast<std::vector<std::byte> *>(user);
+    out.resize(size);
+    return out.data();
+  };
+  return {allocate, &out, nullptr, 0};
+}
+
+// ShaderGutsCore_Compile one by one against ShaderGutsCore_CompileBatch, the
+// calls the tool and the layer's GLSL loading make.
+auto runCompile(int argc, char **argv) -> int {
+  uint32_t rounds = 1;
+  bool ok = argc == 3 || (argc == 5 && std::string_view(argv[3]) == "-n" &&
+                          parseNumber(std::string_view(argv[4]), rounds) &&
+                          rounds);
+  if (!ok || !fs::is_directory(argv[2])) {
+    printUsage();
+    return 1;
+  }
+
+  auto sources = loadSources(argv[2], rounds);
+  if (sources.empty())
+    throw std::runtime_error(std::format("no GLSL shaders in {}", argv[2]));
+
+  auto count = uint32_t(sources.size());
+  auto coreSources = std::vector<ShaderGutsSource>();
+  for (const auto &source : sources)
+    coreSources.push_back({source.source.data(), source.source.size(),
+                           source.fileName.c_str()});
+
+  auto compileBatch = [&](uint32_t n) {
+    auto spirvs = std::vector<std::vector<std::byte>>(n);
+    auto outputs = std::vector<ShaderGutsOutput>();
+    for (auto &spirv : spirvs)
+      outputs.push_back(outputTo(spirv));
+    auto results = std::vector<ShaderGutsResult>(n);
+    ShaderGutsCore_CompileBatch(n, coreSources.data(), outputs.data(),
+                                nullptr, results.data());
+    return spirvs;
+  };
+
+  // glslang's process init and the core's worker threads are paid for
+  // before timing.
+  compileBatch(std::min(count, 2u));
+
+  using Ms = std::chrono::duration<double, std::milli>;
+  auto start = std::chrono::steady_clock::now();
+  auto serial = std::vector<std::vector<std::byte>>(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    auto output = outputTo(serial[i]);
+    ShaderGutsCore_Compile(&coreSources[i], &output, nullptr);
+  }
+  Ms serialTime = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  auto batched = compileBatch(count);
+  Ms batchTime = std::chrono::steady_clock::now() - start;
+
+  auto failed = std::ranges::count_if(
+      serial, [](const auto &code) { return code.empty(); });
+  std::cout << std::format("{} shaders, {} failed, {} threads, ms:\n", count,
+                           failed, util::ThreadPool::defaultThreadCount());
+  std::cout << std::format("{:<8} {:>10} {:>12}\n", "", "total",
+                           "per shader");
+  for (auto [label, time] :
+       {std::pair{"serial", serialTime}, std::pair{"batch", batchTime}})
+    std::cout << std::format("{:<8} {:>10.1f} {:>12.3f}\n", label,
+                             time.count(), time.count() / count);
+  std::cout << std::format("speedup: {:.2f}x\n",
+                           serialTime.count() / batchTime.count());
+
+  // The workers must not change what comes out.
+  if (serial != batched) {
+    std::cerr << "[VK_SHADER_GUTS][err]: batch output differs from serial\n";
+    return 2;
+  }
+  return 0;
+}
+
+// A /proc/self/status field, in KiB.
+auto statusKiB(std::string_view field) -> uint64_t {
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line);) {
+    if (!line.starts_with(field) || line.size() <= field.size() ||
+        line[field.size()] != ':')
+      continue;
+    auto value = std::string_view(line).substr(field.size() + 1);
+    value.remove_prefix(std::min(value.find_first_not_of(" \t"),
+                                 value.size()));
+    uint64_t kib = 0;
+    std::from_chars(value.data(), value.data() + value.size(), kib);
+    return kib;
+  }
+  return 0;
+}
+
+auto isMapped(std::string_view library) -> bool {
+  std::ifstream maps("/proc/self/maps");
+  for (std::string line; std::getline(maps, line);)
+    if (line.ends_with("/" + std::string(library)))
+      return true;
+  return false;
+}
+
+// What an app pays for the layer before it does anything. Run it with the
+// layer enabled and disabled; `-core` adds what mapping glslang and
+// SPIRV-Cross costs, as the layer did before they moved to the core library.
+auto runStartup(int argc, char **argv) -> int {
+  auto core = std::optional<fs::path>();
+  if (argc == 4 && std::string_view(argv[2]) == "-core")
+    core = argv[3];
+  else if (argc != 2) {
+    printUsage();
+    return 1;
+  }
+
+  using Ms = std::chrono::duration<double, std::milli>;
+  auto report = [](std::string_view what, Ms time, uint64_t rssBefore) {
+    auto rss = statusKiB("VmRSS");
+    std::cout << std::format("{:<18} {:>9.2f} ms {:>9} KiB {:>+9} KiB\n",
+                             what, time.count(), rss,
+                             int64_t(rss) - int64_t(rssBefore));
+  };
+
+  std::cout << std::format("{:<18} {:>12} {:>13} {:>13}\n", "", "time",
+                           "rss", "rss delta");
+  // Without a driver there's still the core library to measure.
+  auto rss = statusKiB("VmRSS");
+  auto start = std::chrono::steady_clock::now();
+  auto device = std::optional<Device>();
+  try {
+    device.emplace(std::nullopt);
+    report("instance+device", std::chrono::steady_clock::now() - start, rss);
+  } catch (const std::runtime_error &e) {
+    std::cout << std::format("{:<18} {}\n", "instance+device", e.what());
+  }
+  bool layerMappedCore = isMapped("libshader-guts-core.so");
+
+  if (core) {
+    rss = statusKiB("VmRSS");
+    start = std::chrono::steady_clock::now();
+    auto *handle = dlopen(core->c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+      throw std::runtime_error(dlerror());
+    report("core library", std::chrono::steady_clock::now() - start, rss);
+    dlclose(handle);
+  }
+
+  std::cout << std::format("device: {}\npeak rss: {} KiB\n",
+                           device ? device->properties.deviceName : "none",
+                           statusKiB("VmHWM"));
+  std::cout << std::format("core library mapped by the layer: {}\n",
+                           layerMappedCore ? "yes" : "no");
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  auto mode = argc > 1 ? std::string_view(argv[1]) : "";
+  auto options = std::optional<Options>();
+  if (mode != "procs" && mode != "compile" && mode != "startup" &&
+      !(options = parseOptions(argc, argv))) {
+    printUsage();
+    return 1;
+  }
+
+  try {
+    if (mode == "procs")
+      return runProcs(argc, argv);
+    if (mode == "compile")
+      return runCompile(argc, argv);
+    if (mode == "startup")
+      return runStartup(argc, argv);
+    return run(*options);
+  } catch (const std::exception &e) {
+    std::cerr << "[VK_SHADER_GUTS][err]: " << e.what() << "\n";
+    return 1;
+  }
+}
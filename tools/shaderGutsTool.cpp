@@ -0,0 +1,546 @@
+#include "glslangShaders.hpp"
+#include "pipelineIndex.hpp"
+#include "spirvCost.hpp"
+#include "stages.hpp"
+#include "trace.hpp"
+#include "threadPool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Offline processing of VK_SHADER_GUTS_DUMP_PATH trees, in-process and on
+// every core instead of one spirv-cross/glslangValidator run per file.
+
+namespace {
+namespace fs = std::filesystem;
+
+enum class Mode { decompile, compile, hash, stats, trace };
+
+struct Options {
+  Mode mode;
+  fs::path input;
+  fs::path output;
+  size_t threads = util::ThreadPool::defaultThreadCount();
+  bool force = false;
+};
+
+struct Stats {
+  std::atomic<size_t> processed = 0;
+  std::atomic<size_t> upToDate = 0;
+  std::atomic<size_t> failed = 0;
+  std::atomic<size_t> bytes = 0;
+};
+
+struct HashedFile {
+  std::string hash;
+  fs::path path;
+};
+
+// Folder names written by ShaderGuts::DumpShader.
+auto folderToExt(std::string_view folder) -> std::string {
+  for (const auto &info : util::stageInfos) {
+    if (info.folder == folder)
+      return "." + std::string(info.ext);
+  }
+  return ".glsl";
+}
+
+const std::map<std::string_view, Mode> stringToMode{
+    {"decompile", Mode::decompile},
+    {"compile", Mode::compile},
+    {"hash", Mode::hash},
+    {"stats", Mode::stats},
+    {"trace", Mode::trace},
+};
+
+auto printUsage() -> void {
+  std::cerr
+      << "usage: shader-guts <decompile|compile|hash|stats> <dump dir> "
+         "[options]\n"
+         "       shader-guts trace <trace file> [-o <json>]\n"
+         "       shader-guts control <socket> <command>\n"
+         "       shader-guts pipelines <dump dir|pipelines.idx> <hash>...\n"
+         "  decompile  SPIR-V dumps to GLSL, the stage comes from the folder\n"
+         "  compile    edited GLSL back to SPIR-V and print the new hashes\n"
+         "  hash       re-hash SPIR-V dumps, report renamed files and "
+         "duplicates\n"
+         "  stats      static cost of every SPIR-V dump into index.csv\n"
+         "  trace      VK_SHADER_GUTS_TRACE file to Chrome trace JSON\n"
+         "  control    send a command to a VK_SHADER_GUTS_CONTROL socket: "
+         "status,\n"
+         "             dump on|off, load on|off, load-path <path>, "
+         "capture <seconds>\n"
+         "  pipelines  shaders of a pipeline, or pipelines using a shader, "
+         "from the\n"
+         "             layer's pipelines.idx; hashes may be prefixes\n"
+         "options:\n"
+         "  -o <dir>   output tree, defaults to the dump dir itself\n"
+         "  -j <n>     worker threads, defaults to all cores\n"
+         "  -f         redo outputs that are already up to date\n";
+}
+
+auto parseOptions(int argc, char **argv) -> std::optional<Options> {
+  if (argc < 3 || !stringToMode.contains(argv[1]))
+    return std::nullopt;
+
+  Options options;
+  options.mode = stringToMode.at(argv[1]);
+  options.input = argv[2];
+  options.output = argv[2];
+  if (options.mode == Mode::trace)
+    options.output += ".json";
+
+  for (int i = 3; i < argc; ++i) {
+    auto arg = std::string_view(argv[i]);
+
+    if (arg == "-f") {
+      options.force = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (arg == "-j" && i + 1 < argc) {
+      auto value = std::string_view(argv[++i]);
+      auto [_, ec] = std::from_chars(value.data(), value.data() + value.size(),
+                                     options.threads);
+      if (ec != std::errc() || !options.threads)
+        return std::nullopt;
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  if (options.mode == Mode::trace) {
+    if (fs::is_regular_file(options.input))
+      return options;
+    std::cerr << "[VK_SHADER_GUTS][err]: Not a file: " << options.input
+              << "\n";
+    return std::nullopt;
+  }
+
+  if (!fs::is_directory(options.input)) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Not a directory: " << options.input
+              << "\n";
+    return std::nullopt;
+  }
+  return options;
+}
+
+// Outputs newer than their input are kept, so an interrupted run resumes.
+auto isUpToDate(const fs::path &in, const fs::path &out) -> bool {
+  std::error_code ec;
+  auto outTime = fs::last_write_time(out, ec);
+  if (ec)
+    return false;
+
+  auto inTime = fs::last_write_time(in, ec);
+  return !ec && outTime >= inTime;
+}
+
+auto outputPath(const Options &options, const fs::path &in,
+                std::string_view ext) -> fs::path {
+  auto out = options.output / fs::relative(in, options.input);
+  out.replace_extension(ext);
+  return out;
+}
+
+auto decompile(const Options &options, const fs::path &in, Stats &stats)
+    -> void {
+  auto out = outputPath(options, in,
+                        folderToExt(in.parent_path().filename().string()));
+
+  if (!options.force && isUpToDate(in, out)) {
+    ++stats.upToDate;
+    return;
+  }
+
+  auto shader = util::LoadSPRV(in);
+  if (!util::isSPIRV(shader)) {
+    ++stats.failed;
+    return;
+  }
+
+  try {
+    fs::create_directories(out.parent_path());
+    util::SaveGLSLToFile(shader, out);
+  } catch (const std::exception &e) {
+    std::cerr << "[VK_SHADER_GUTS][err]: " << in << ": " << e.what() << "\n";
+    ++stats.failed;
+    return;
+  }
+
+  stats.bytes += shader.size();
+  ++stats.processed;
+}
+
+// `<out>.deps` lists the headers `out` was compiled with, one per line. It's
+// out of date as soon as any of them is newer.
+auto depsUpToDate(const fs::path &out) -> bool {
+  auto deps = out;
+  deps += ".deps";
+  std::ifstream file(deps);
+  if (!file)
+    return false;
+
+  for (std::string header; std::getline(file, header);)
+    if (!isUpToDate(header, out))
+      return false;
+  return true;
+}
+
+auto writeDeps(const fs::path &out, const std::vector<fs::path> &includes)
+    -> void {
+  auto deps = out;
+  deps += ".deps";
+  if (std::ofstream file(deps); file.is_open())
+    for (const auto &include : includes)
+      file << include.string() << "\n";
+}
+
+auto compile(const Options &options, const fs::path &in, Stats &stats)
+    -> std::optional<HashedFile> {
+  auto out = outputPath(options, in, ".spv");
+
+  if (!options.force && isUpToDate(in, out) && depsUpToDate(out)) {
+    ++stats.upToDate;
+    auto shader = util::LoadSPRV(out);
+    return HashedFile{
+        util::Sha1Hash::compute(shader.data(), shader.size()).toString(), in};
+  }
+
+  auto source = util::LoadFile(in);
+  stats.bytes += source.size();
+
+  auto params = util::shaders::makeCompileParams(std::move(source), in);
+  if (!params) {
+    std::cerr << params.error();
+    ++stats.failed;
+    return std::nullopt;
+  }
+
+  auto includes = std::vector<fs::path>();
+  auto shader = util::shaders::compileGLSL(params.value(), &includes);
+  if (shader.empty()) {
+    ++stats.failed;
+    return std::nullopt;
+  }
+
+  fs::create_directories(out.parent_path());
+  util::SaveSPVToFile(shader, out);
+  writeDeps(out, includes);
+
+  ++stats.processed;
+  return HashedFile{
+      util::Sha1Hash::compute(shader.data(), shader.size()).toString(), in};
+}
+
+auto hash(const fs::path &in, Stats &stats) -> std::optional<HashedFile> {
+  auto shader = util::LoadSPRV(in);
+  if (shader.empty()) {
+    ++stats.failed;
+    return std::nullopt;
+  }
+
+  stats.bytes += shader.size();
+  ++stats.processed;
+  return HashedFile{
+      util::Sha1Hash::compute(shader.data(), shader.size()).toString(), in};
+}
+
+auto cost(const fs::path &in, Stats &stats)
+    -> std::optional<util::spirv::IndexRow> {
+  auto shader = util::LoadSPRV(in);
+  if (!util::isSPIRV(shader)) {
+    ++stats.failed;
+    return std::nullopt;
+  }
+
+  stats.bytes += shader.size();
+  ++stats.processed;
+  return util::spirv::IndexRow{
+      in.parent_path().filename().string(), in.stem().string(),
+      util::spirv::analyze(shader), shader.size(),
+      util::spirv::signature(shader)};
+}
+
+// Chrome trace JSON, timestamps in microseconds of CLOCK_MONOTONIC.
+auto convertTrace(const Options &options) -> int {
+  namespace trace = util::trace;
+
+  auto data = util::LoadBinaryFile(options.input);
+  trace::FileHeader header;
+  if (data.size() < sizeof(header)) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Not a trace: " << options.input
+              << "\n";
+    return 1;
+  }
+
+  std::memcpy(&header, data.data(), sizeof(header));
+  auto available = (data.size() - sizeof(header)) / sizeof(trace::Event);
+  if (header.magic != trace::fileMagic ||
+      header.version != trace::fileVersion || header.events > available) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Not a trace: " << options.input
+              << "\n";
+    return 1;
+  }
+
+  std::ofstream out(options.output);
+  out << "{\"traceEvents\":[\n";
+
+  for (uint64_t i = 0; i < header.events; ++i) {
+    trace::Event event;
+    std::memcpy(&event, data.data() + sizeof(header) + i * sizeof(event),
+                sizeof(event));
+    if (size_t(event.type) >= trace::typeNames.size())
+      continue;
+
+    out << std::format("{}{{\"name\":\"{}\",\"ph\":\"{}\",\"ts\":{:.3f},"
+                       "\"pid\":{},\"tid\":{}{},\"args\":{{\"arg\":"
+                       "\"{:#x}\"}}}}\n",
+                       i ? "," : "", trace::typeNames[size_t(event.type)],
+                       char(event.phase), double(event.time) / 1000.0,
+                       header.pid, event.tid,
+                       event.phase == trace::Phase::instant ? ",\"s\":\"t\""
+                                                            : "",
+                       event.arg);
+  }
+  out << "]}\n";
+
+  std::cerr << std::format("{} events, {} dropped -> {}\n", header.events,
+                           header.dropped, options.output.string());
+  return 0;
+}
+
+auto wantsFile(Mode mode, const fs::path &path) -> bool {
+  auto ext = path.extension().string();
+  if (mode == Mode::compile)
+    return util::shaders::shaderTypeESh.contains(ext);
+  return ext == ".spv";
+}
+
+auto printHashes(Mode mode, std::vector<HashedFile> &files) -> void {
+  std::ranges::sort(files, {}, &HashedFile::hash);
+
+  if (mode == Mode::compile) {
+    for (const auto &file : files)
+      std::cout << file.hash << " " << file.path.string() << "\n";
+    return;
+  }
+
+  for (const auto &file : files) {
+    if (file.path.stem() != file.hash)
+      std::cout << "renamed: " << file.path.string() << " is " << file.hash
+                << "\n";
+  }
+
+  for (auto it = files.begin(); it != files.end();) {
+    auto end = std::find_if(it, files.end(), [&](const HashedFile &file) {
+      return file.hash != it->hash;
+    });
+
+    if (std::distance(it, end) > 1) {
+      std::cout << "duplicate: " << it->hash << "\n";
+      for (auto dup = it; dup != end; ++dup)
+        std::cout << "  " << dup->path.string() << "\n";
+    }
+    it = end;
+  }
+}
+
+// Client of the layer's control socket, prints its reply.
+auto control(const char *socketPath, std::string command) -> int {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(socketPath) >= sizeof(addr.sun_path)) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Socket path too long\n";
+    return 1;
+  }
+  std::strcpy(addr.sun_path, socketPath);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Can't connect to " << socketPath
+              << "\n";
+    return 1;
+  }
+
+  command += "\n";
+  if (send(fd, command.data(), command.size(), MSG_NOSIGNAL) !=
+      ssize_t(command.size())) {
+    close(fd);
+    return 1;
+  }
+  shutdown(fd, SHUT_WR);
+
+  auto reply = std::string();
+  char buffer[1024];
+  for (ssize_t n; (n = recv(fd, buffer, sizeof(buffer), 0)) > 0;)
+    reply.append(buffer, n);
+  close(fd);
+
+  std::cout << reply;
+  return reply.starts_with("error") ? 2 : 0;
+}
+
+// Looks every hash up as a pipeline and as a shader, straight from the
+// mapped index.
+auto queryPipelines(fs::path path, std::span<char *> hashes) -> int {
+  using util::PipelineIndex;
+
+  if (fs::is_directory(path))
+    path /= "pipelines.idx";
+
+  auto start = std::chrono::steady_clock::now();
+  PipelineIndex index(path);
+  if (!index.valid()) {
+    std::cerr << "[VK_SHADER_GUTS][err]: Not a pipeline index: " << path
+              << "\n";
+    return 1;
+  }
+
+  auto stage = [](uint32_t bits) { return util::stageInfo(bits).folder; };
+
+  size_t found = 0;
+  for (auto arg : hashes) {
+    auto first = PipelineIndex::key(arg, '0');
+    auto last = PipelineIndex::key(arg, 'f');
+    if (!first || !last) {
+      std::cerr << "[VK_SHADER_GUTS][err]: Not a hash: " << arg << "\n";
+      return 1;
+    }
+
+    // No hash is all zeros, the first edge always starts a group.
+    auto pipeline = PipelineIndex::Key();
+    for (const auto &edge : index.shadersOf(*first, *last)) {
+      ++found;
+      if (edge.pipeline != pipeline)
+        std::cout << "pipeline " << PipelineIndex::hex(edge.pipeline) << "\n";
+      pipeline = edge.pipeline;
+      std::cout << "  " << stage(edge.stage) << " "
+                << PipelineIndex::hex(edge.shader) << "\n";
+    }
+
+    auto shader = PipelineIndex::Key();
+    for (const auto &edge : index.pipelinesUsing(*first, *last)) {
+      ++found;
+      if (edge.shader != shader)
+        std::cout << "shader " << PipelineIndex::hex(edge.shader) << "\n";
+      shader = edge.shader;
+      std::cout << "  " << stage(edge.stage) << " pipeline "
+                << PipelineIndex::hex(edge.pipeline) << "\n";
+    }
+  }
+
+  auto ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  std::cerr << std::format("{} edges, {} found in {:.3f} ms\n", index.size(),
+                           found, ms);
+  return found ? 0 : 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc >= 4 && std::string_view(argv[1]) == "control") {
+    auto command = std::string(argv[3]);
+    for (int i = 4; i < argc; ++i)
+      command += std::string(" ") + argv[i];
+    return control(argv[2], std::move(command));
+  }
+
+  if (argc >= 4 && std::string_view(argv[1]) == "pipelines")
+    return queryPipelines(argv[2], std::span(argv + 3, argc - 3));
+
+  auto options = parseOptions(argc, argv);
+  if (!options) {
+    printUsage();
+    return 1;
+  }
+
+  if (options->mode == Mode::trace)
+    return convertTrace(*options);
+
+  auto start = std::chrono::steady_clock::now();
+
+  auto inputs = std::vector<fs::path>();
+  for (const auto &entry : fs::recursive_directory_iterator(options->input)) {
+    if (entry.is_regular_file() && wantsFile(options->mode, entry.path()))
+      inputs.push_back(entry.path());
+  }
+
+  Stats stats;
+  auto hashed = std::vector<HashedFile>();
+  auto costs = std::vector<util::spirv::IndexRow>();
+  std::mutex hashedLock;
+
+  {
+    util::ThreadPool pool(options->threads);
+    auto pending = std::vector<std::future<void>>();
+    pending.reserve(inputs.size());
+
+    for (const auto &in : inputs) {
+      pending.push_back(pool.submit([&, in] {
+        auto result = std::optional<HashedFile>();
+
+        switch (options->mode) {
+        case Mode::decompile:
+          decompile(*options, in, stats);
+          return;
+        case Mode::compile:
+          result = compile(*options, in, stats);
+          break;
+        case Mode::hash:
+          result = hash(in, stats);
+          break;
+        case Mode::stats:
+          if (auto row = cost(in, stats)) {
+            std::lock_guard<std::mutex> l(hashedLock);
+            costs.push_back(std::move(row.value()));
+          }
+          return;
+        case Mode::trace:
+          return;
+        }
+
+        if (result) {
+          std::lock_guard<std::mutex> l(hashedLock);
+          hashed.push_back(std::move(result.value()));
+        }
+      }));
+    }
+
+    for (auto &job : pending)
+      job.get();
+  }
+
+  printHashes(options->mode, hashed);
+  if (options->mode == Mode::stats) {
+    fs::create_directories(options->output);
+    util::spirv::CostIndex::write(options->output, costs);
+  }
+
+  auto seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  auto mib = double(stats.bytes) / (1024.0 * 1024.0);
+
+  std::cerr << std::format(
+      "{} files: {} processed, {} up to date, {} failed\n"
+      "{:.2f} MiB in {:.3f} s on {} threads: {:.1f} files/s, {:.2f} MiB/s\n",
+      inputs.size(), stats.processed.load(), stats.upToDate.load(),
+      stats.failed.load(), mib, seconds, options->threads,
+      double(stats.processed) / seconds, mib / seconds);
+  if (options->mode == Mode::compile) {
+    auto [hits, misses] = util::shaders::IncludeCache::get().status();
+    if (hits + misses)
+      std::cerr << std::format("{} #includes, {} headers read\n",
+                               hits + misses, misses);
+  }
+
+  return stats.failed ? 2 : 0;
+}